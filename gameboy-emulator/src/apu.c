@@ -0,0 +1,626 @@
+// apu.c - Audio processing unit (0xFF10-0xFF3F) and sound synthesis
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include "gameboy.h"
+
+#define NR10 0xFF10
+#define NR52 0xFF26
+#define WAVE_RAM 0xFF30
+
+// Registers by offset from NR10
+enum {
+    R_NR10, R_NR11, R_NR12, R_NR13, R_NR14,
+    R_NR20, R_NR21, R_NR22, R_NR23, R_NR24,
+    R_NR30, R_NR31, R_NR32, R_NR33, R_NR34,
+    R_NR40, R_NR41, R_NR42, R_NR43, R_NR44,
+    R_NR50, R_NR51, R_NR52
+};
+
+// 512 Hz, taken from the CPU clock rather than DIV
+#define SEQUENCER_CYCLES 8192
+#define CPU_CLOCK 4194304
+
+// Bits that always read as 1, NR10 through NR52
+static const uint8_t read_masks[0x17] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,
+    0x00, 0x00, 0x70
+};
+
+static const uint8_t duty_table[4][8] = {
+    { 0, 0, 0, 0, 0, 0, 0, 1 },
+    { 1, 0, 0, 0, 0, 0, 0, 1 },
+    { 1, 0, 0, 0, 0, 1, 1, 1 },
+    { 0, 1, 1, 1, 1, 1, 1, 0 },
+};
+
+GB_LOCAL APU_State apu;
+
+// Synthesis. Channel outputs are step functions, so rather than sample
+// them every cycle, each change of level adds a band-limited step at
+// its exact time into a buffer of sample deltas, and reading integrates
+// the deltas (blip buffer). The kernel is a windowed sinc in 32
+// sub-sample phases, scaled so each phase sums to exactly one step.
+#define BLIP_FRAC_BITS   20     // Sample positions are 44.20 fixed point
+#define BLIP_PHASE_BITS  5
+#define BLIP_PHASES      (1 << BLIP_PHASE_BITS)
+#define BLIP_TAPS        16
+#define BLIP_KERNEL_BITS 12
+#define BLIP_BASS_SHIFT  9      // High-pass that removes the DAC's DC offset
+#define BLIP_SIZE        512    // Samples between sequencer steps, plus taps
+#define BLIP_MAX_CYCLES  (2 * SEQUENCER_CYCLES)
+
+// A channel at full volume, on both NR50 volumes at 7, is 15 * 8 * 64;
+// four of them fit in 16 bits
+#define APU_AMPLITUDE 64
+
+static int16_t blip_kernel[BLIP_PHASES][BLIP_TAPS];
+static pthread_once_t blip_kernel_once = PTHREAD_ONCE_INIT;
+
+// Where samples go. Like serial output, this belongs to whoever runs
+// the emulator, so it is bound per thread and not saved with the state.
+typedef struct {
+    GB_Audio_Ring *ring;
+    uint64_t factor;            // Sample positions per cycle
+    uint64_t base;              // Cycle at the start of the buffers
+    uint64_t frac;              // Sample position of base within the first sample
+    int32_t buffers[2][BLIP_SIZE + BLIP_TAPS];
+    int32_t integrators[2];
+    int32_t levels[4][2];       // Each channel's output as last added, left and right
+} APU_Output;
+
+static GB_LOCAL APU_Output apu_output;
+
+// With nothing to synthesize, the frame sequencer need not run on time
+static bool apu_lazy() {
+    return gb_apu_lazy && !apu_output.ring;
+}
+
+static void blip_make_kernel() {
+    for (int phase = 0; phase < BLIP_PHASES; phase++) {
+        double taps[BLIP_TAPS];
+        double sum = 0;
+        for (int i = 0; i < BLIP_TAPS; i++) {
+            // Cut off a little under Nyquist, Blackman window
+            double x = i - (BLIP_TAPS / 2 - 1) - (double)phase / BLIP_PHASES;
+            double sinc = x == 0 ? 1 : sin(M_PI * 0.9 * x) / (M_PI * 0.9 * x);
+            double window = 0.42 + 0.5 * cos(2 * M_PI * x / BLIP_TAPS) +
+                            0.08 * cos(4 * M_PI * x / BLIP_TAPS);
+            taps[i] = sinc * window;
+            sum += taps[i];
+        }
+
+        int total = 0;
+        for (int i = 0; i < BLIP_TAPS; i++) {
+            blip_kernel[phase][i] = lround(taps[i] / sum * (1 << BLIP_KERNEL_BITS));
+            total += blip_kernel[phase][i];
+        }
+        // Rounding error goes to the centre tap, so steps are exact
+        blip_kernel[phase][BLIP_TAPS / 2 - 1] += (1 << BLIP_KERNEL_BITS) - total;
+    }
+}
+
+static void blip_reset(uint64_t time) {
+    memset(apu_output.buffers, 0, sizeof(apu_output.buffers));
+    memset(apu_output.levels, 0, sizeof(apu_output.levels));
+    apu_output.integrators[0] = apu_output.integrators[1] = 0;
+    apu_output.base = time;
+    apu_output.frac = 0;
+}
+
+static void blip_add(int side, uint64_t time, int32_t delta) {
+    uint64_t position = apu_output.frac + (time - apu_output.base) * apu_output.factor;
+    const int16_t *kernel = blip_kernel[(position >> (BLIP_FRAC_BITS - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    int32_t *buffer = &apu_output.buffers[side][position >> BLIP_FRAC_BITS];
+    for (int i = 0; i < BLIP_TAPS; i++) {
+        buffer[i] += kernel[i] * delta;
+    }
+}
+
+// Turns the deltas before time into samples and queues them
+static void blip_end(uint64_t time) {
+    uint64_t position = apu_output.frac + (time - apu_output.base) * apu_output.factor;
+    uint32_t count = position >> BLIP_FRAC_BITS;
+    int16_t samples[BLIP_SIZE * 2];
+
+    for (int side = 0; side < 2; side++) {
+        int32_t *buffer = apu_output.buffers[side];
+        int32_t integrator = apu_output.integrators[side];
+        for (uint32_t i = 0; i < count; i++) {
+            integrator += buffer[i];
+            int32_t sample = integrator >> BLIP_KERNEL_BITS;
+            samples[i * 2 + side] = sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample;
+            integrator -= integrator >> BLIP_BASS_SHIFT;
+        }
+        apu_output.integrators[side] = integrator;
+        memmove(buffer, buffer + count, (BLIP_SIZE + BLIP_TAPS - count) * sizeof(int32_t));
+        memset(buffer + BLIP_SIZE + BLIP_TAPS - count, 0, count * sizeof(int32_t));
+    }
+
+    gb_audio_ring_write(apu_output.ring, samples, count);
+    apu_output.base = time;
+    apu_output.frac = position & ((1 << BLIP_FRAC_BITS) - 1);
+}
+
+// Sends this thread's samples to ring, or stops synthesis with NULL.
+// Returns false if the ring's sample rate is over APU_MAX_SAMPLE_RATE.
+bool apu_bind(GB_Audio_Ring *ring) {
+    if (ring && gb_audio_ring_sample_rate(ring) > APU_MAX_SAMPLE_RATE) {
+        return false;
+    }
+    pthread_once(&blip_kernel_once, blip_make_kernel);
+    apu_output.ring = ring;
+    if (ring) {
+        apu_output.factor = ((uint64_t)gb_audio_ring_sample_rate(ring) << BLIP_FRAC_BITS) / CPU_CLOCK;
+        blip_reset(apu.time);
+    }
+    apu_sync();
+    return true;
+}
+
+// Cycles per waveform step, or 0 if the channel never steps
+static uint32_t channel_period(int c) {
+    const uint8_t *regs = &apu.regs[c * 5];
+    uint16_t frequency = regs[3] | (regs[4] & 0x07) << 8;
+    switch (c) {
+        case 0:
+        case 1:
+            return (2048 - frequency) * 4;
+        case 2:
+            return (2048 - frequency) * 2;
+        default: {
+            uint8_t nr43 = apu.regs[R_NR43];
+            uint8_t divisor = nr43 & 0x07;
+            uint8_t shift = nr43 >> 4;
+            return shift >= 14 ? 0 : (divisor ? divisor * 16u : 8u) << shift;
+        }
+    }
+}
+
+// Digital output, 0-15
+static uint8_t channel_level(int c) {
+    const APU_Channel *ch = &apu.channels[c];
+    if (!ch->enabled || !ch->dac) {
+        return 0;
+    }
+    switch (c) {
+        case 0:
+        case 1:
+            return duty_table[apu.regs[c * 5 + 1] >> 6][ch->position] ? ch->volume : 0;
+        case 2: {
+            uint8_t code = (apu.regs[R_NR32] >> 5) & 0x03;
+            uint8_t byte = memory[WAVE_RAM + ch->position / 2];
+            uint8_t sample = ch->position & 1 ? byte & 0x0F : byte >> 4;
+            return code ? sample >> (code - 1) : 0;
+        }
+        default:
+            return ch->lfsr & 1 ? 0 : ch->volume;
+    }
+}
+
+static int32_t channel_scale(int c, int side) {
+    uint8_t nr50 = apu.regs[R_NR50];
+    uint8_t nr51 = apu.regs[R_NR51];
+    if (side == 0) {
+        return (nr51 >> (4 + c) & 1) * (((nr50 >> 4) & 0x07) + 1) * APU_AMPLITUDE;
+    }
+    return (nr51 >> c & 1) * ((nr50 & 0x07) + 1) * APU_AMPLITUDE;
+}
+
+// Adds a step wherever channel c's output no longer matches the level
+static void channel_emit(int c, uint64_t time) {
+    uint8_t level = channel_level(c);
+    for (int side = 0; side < 2; side++) {
+        int32_t value = level * channel_scale(c, side);
+        if (value != apu_output.levels[c][side]) {
+            blip_add(side, time, value - apu_output.levels[c][side]);
+            apu_output.levels[c][side] = value;
+        }
+    }
+}
+
+static void apu_emit_all(uint64_t time) {
+    if (apu_output.ring) {
+        for (int c = 0; c < 4; c++) {
+            channel_emit(c, time);
+        }
+    }
+}
+
+static bool channel_audible(int c) {
+    const APU_Channel *ch = &apu.channels[c];
+    if (!ch->enabled || !ch->dac || (!channel_scale(c, 0) && !channel_scale(c, 1))) {
+        return false;
+    }
+    return c == 2 ? (apu.regs[R_NR32] & 0x60) != 0 : ch->volume != 0;
+}
+
+static void channel_step(int c) {
+    APU_Channel *ch = &apu.channels[c];
+    if (c == 3) {
+        uint16_t bit = (ch->lfsr ^ (ch->lfsr >> 1)) & 1;
+        ch->lfsr = (ch->lfsr >> 1) | (bit << 14);
+        if (apu.regs[R_NR43] & 0x08) {
+            ch->lfsr = (ch->lfsr & ~0x40) | (bit << 6);
+        }
+    } else {
+        ch->position = (ch->position + 1) & (c == 2 ? 31 : 7);
+    }
+}
+
+// Runs channel c's waveform from apu.time to until, adding a step at
+// each change of level. A silent channel only keeps its phase.
+static void channel_run(int c, uint64_t until) {
+    APU_Channel *ch = &apu.channels[c];
+    uint32_t period = channel_period(c);
+    uint64_t span = until - apu.time;
+    if (period == 0) {
+        return;
+    }
+
+    if (!channel_audible(c)) {
+        if (span < ch->countdown) {
+            ch->countdown -= span;
+            return;
+        }
+        span -= ch->countdown;
+        if (c != 3) {
+            ch->position = (ch->position + 1 + span / period) & (c == 2 ? 31 : 7);
+        }
+        ch->countdown = period - span % period;
+        return;
+    }
+
+    uint64_t time = apu.time;
+    while (until - time >= ch->countdown) {
+        time += ch->countdown;
+        ch->countdown = period;
+        channel_step(c);
+        channel_emit(c, time);
+    }
+    ch->countdown -= until - time;
+}
+
+// Brings the channels up to until. Everything that changes what they
+// play calls this first, so between calls their output is fixed
+// except for their own waveforms.
+static void apu_run(uint64_t until) {
+    if (until <= apu.time) {
+        return;
+    }
+    if (apu_output.ring && apu.power) {
+        // A loaded state can move the clock anywhere
+        if (apu.time < apu_output.base || until - apu_output.base > BLIP_MAX_CYCLES) {
+            blip_reset(apu.time);
+        }
+        for (int c = 0; c < 4; c++) {
+            channel_run(c, until);
+        }
+    }
+    apu.time = until;
+}
+
+// Keeps memory[] showing what the CPU reads back. The frame sequencer
+// changes registers behind the CPU's back, so the page is marked dirty
+// here as well as in memory_write().
+static void apu_update_register(int r) {
+    uint8_t value = apu.regs[r] | read_masks[r];
+    if (r == R_NR52) {
+        value = (apu.power ? 0x80 : 0) | 0x70;
+        for (int c = 0; c < 4; c++) {
+            value |= apu.channels[c].enabled << c;
+        }
+    }
+    memory[NR10 + r] = value;
+    memory_dirty |= 1 << ((NR10 + r) >> 12);
+}
+
+static uint16_t channel_length_max(int c) {
+    return c == 2 ? 256 : 64;
+}
+
+// Channel 1's next sweep frequency; over 2047 switches the channel off
+static uint16_t sweep_next(APU_Channel *ch) {
+    uint8_t nr10 = apu.regs[R_NR10];
+    uint16_t delta = ch->shadow >> (nr10 & 0x07);
+    uint16_t frequency = nr10 & 0x08 ? ch->shadow - delta : ch->shadow + delta;
+    if (frequency > 2047) {
+        ch->enabled = false;
+    }
+    return frequency;
+}
+
+static void channel_trigger(int c) {
+    APU_Channel *ch = &apu.channels[c];
+    const uint8_t *regs = &apu.regs[c * 5];
+
+    ch->enabled = ch->dac;
+    if (ch->length == 0) {
+        ch->length = channel_length_max(c);
+    }
+    ch->countdown = channel_period(c);
+    if (ch->countdown == 0) {
+        ch->countdown = 1;
+    }
+    ch->volume = regs[2] >> 4;
+    ch->envelope_timer = regs[2] & 0x07;
+    if (c == 2) {
+        ch->position = 0;
+    }
+    if (c == 3) {
+        ch->lfsr = 0x7FFF;
+    }
+    if (c == 0) {
+        uint8_t nr10 = apu.regs[R_NR10];
+        ch->shadow = regs[3] | (regs[4] & 0x07) << 8;
+        ch->sweep_timer = (nr10 >> 4) & 0x07 ? (nr10 >> 4) & 0x07 : 8;
+        ch->sweep_enabled = (nr10 & 0x77) != 0;
+        if (nr10 & 0x07) {
+            sweep_next(ch);
+        }
+    }
+}
+
+static void apu_power(bool on) {
+    if (apu.power == on) {
+        return;
+    }
+    apu.power = on;
+    if (!on) {
+        // Everything but wave RAM clears and ignores writes until power on
+        memset(apu.regs, 0, R_NR52);
+        memset(apu.channels, 0, sizeof(apu.channels));
+        for (int r = 0; r < R_NR52; r++) {
+            apu_update_register(r);
+        }
+    } else {
+        apu.sequencer_step = 0;
+    }
+}
+
+// Handles a CPU write to 0xFF10-0xFF3F
+void apu_write(uint16_t address, uint8_t value) {
+    apu_run(scheduler.cycles);
+    apu_sync();
+
+    if (address >= WAVE_RAM) {
+        memory[address] = value;
+        memory_dirty |= 1 << (address >> 12);
+        return;
+    }
+
+    int r = address - NR10;
+    if (r > R_NR52) {
+        return;                   // Unused 0xFF27-0xFF2F read as 0xFF
+    }
+    if (r == R_NR52) {
+        apu_power(value & 0x80);
+        apu_update_register(R_NR52);
+        apu_emit_all(apu.time);
+        return;
+    }
+    if (!apu.power) {
+        return;
+    }
+
+    apu.regs[r] = value;
+    int c = r / 5;
+    APU_Channel *ch = c < 4 ? &apu.channels[c] : NULL;
+    switch (r) {
+        case R_NR11:
+        case R_NR21:
+        case R_NR41:
+            ch->length = 64 - (value & 0x3F);
+            break;
+        case R_NR31:
+            ch->length = 256 - value;
+            break;
+        case R_NR12:
+        case R_NR22:
+        case R_NR42:
+            ch->dac = (value & 0xF8) != 0;
+            ch->enabled &= ch->dac;
+            break;
+        case R_NR30:
+            ch->dac = value & 0x80;
+            ch->enabled &= ch->dac;
+            break;
+        case R_NR14:
+        case R_NR24:
+        case R_NR34:
+        case R_NR44:
+            if (value & 0x80) {
+                channel_trigger(c);
+            }
+            break;
+    }
+
+    apu_update_register(r);
+    apu_update_register(R_NR52);
+    apu_emit_all(apu.time);
+}
+
+static void sequencer_length(uint64_t clocks) {
+    for (int c = 0; c < 4; c++) {
+        APU_Channel *ch = &apu.channels[c];
+        if (!(apu.regs[c * 5 + 4] & 0x40) || ch->length == 0) {
+            continue;
+        }
+        if (clocks >= ch->length) {
+            ch->length = 0;
+            ch->enabled = false;
+        } else {
+            ch->length -= clocks;
+        }
+    }
+}
+
+// Counts timer down by ticks, reloading it with reload (1-8) each time
+// it expires. A timer at 0 has wrapped and counts as 256, as it does
+// when ticked one at a time. Returns how often it expired.
+static uint64_t timer_run(uint8_t *timer, uint8_t reload, uint64_t ticks) {
+    uint32_t left = *timer ? *timer : 256;
+    if (ticks < left) {
+        *timer = left - ticks;
+        return 0;
+    }
+    ticks -= left;
+    *timer = reload - ticks % reload;
+    return 1 + ticks / reload;
+}
+
+// One sweep timer expiry. Returns true if it changed anything.
+static bool sweep_expire() {
+    APU_Channel *ch = &apu.channels[0];
+    uint8_t nr10 = apu.regs[R_NR10];
+    uint8_t period = (nr10 >> 4) & 0x07;
+    ch->sweep_timer = period ? period : 8;
+    if (!period) {
+        return false;
+    }
+
+    bool enabled = ch->enabled;
+    uint16_t shadow = ch->shadow;
+    uint16_t frequency = sweep_next(ch);
+    if (frequency <= 2047 && (nr10 & 0x07)) {
+        ch->shadow = frequency;
+        apu.regs[R_NR13] = frequency & 0xFF;
+        apu.regs[R_NR14] = (apu.regs[R_NR14] & ~0x07) | frequency >> 8;
+        apu_update_register(R_NR13);
+        sweep_next(ch);
+    }
+    return ch->enabled != enabled || ch->shadow != shadow;
+}
+
+// Once an expiry changes nothing, none after it will until a register
+// is written, so the rest only move the timer
+static void sequencer_sweep(uint64_t clocks) {
+    APU_Channel *ch = &apu.channels[0];
+    if (!ch->sweep_enabled) {
+        return;
+    }
+    while (clocks > 0) {
+        uint32_t left = ch->sweep_timer ? ch->sweep_timer : 256;
+        if (clocks < left) {
+            ch->sweep_timer = left - clocks;
+            return;
+        }
+        clocks -= left;
+        if (!sweep_expire()) {
+            timer_run(&ch->sweep_timer, ch->sweep_timer, clocks);
+            return;
+        }
+    }
+}
+
+static void sequencer_envelope(uint64_t clocks) {
+    for (int c = 0; c < 4; c++) {
+        APU_Channel *ch = &apu.channels[c];
+        uint8_t nrx2 = apu.regs[c * 5 + 2];
+        uint8_t period = nrx2 & 0x07;
+        if (c == 2 || !period) {
+            continue;
+        }
+        uint64_t steps = timer_run(&ch->envelope_timer, period, clocks);
+        if (nrx2 & 0x08) {
+            ch->volume = steps >= 15u - ch->volume ? 15 : ch->volume + steps;
+        } else {
+            ch->volume = steps >= ch->volume ? 0 : ch->volume - steps;
+        }
+    }
+}
+
+// How many of count steps from first land on a step in steps (a mask
+// of step numbers)
+static uint64_t steps_matching(uint8_t first, uint64_t count, uint8_t steps) {
+    uint64_t matches = count / 8 * __builtin_popcount(steps);
+    for (uint64_t i = 0; i < count % 8; i++) {
+        matches += steps >> ((first + i) & 7) & 1;
+    }
+    return matches;
+}
+
+// Runs count frame sequencer steps at once: length counters on even
+// steps, sweep on 2 and 6, envelopes on 7. Within a step, lengths and
+// the sweep only ever switch channels off and the envelope touches
+// neither, so each unit can take all its clocks in one go.
+static void sequencer_advance(uint64_t count) {
+    if (apu.power) {
+        uint8_t step = apu.sequencer_step;
+        sequencer_length(steps_matching(step, count, 0x55));
+        sequencer_sweep(steps_matching(step, count, 0x44));
+        sequencer_envelope(steps_matching(step, count, 0x80));
+        apu.sequencer_step = (step + count) & 7;
+        apu_update_register(R_NR52);
+    }
+    apu.sequencer_next += count * SEQUENCER_CYCLES;
+}
+
+// Frame sequencer, 512 times a second. Also where finished samples are
+// handed to the ring. Lazy, it stops here and catches up on demand.
+void apu_frame_sequencer(uint32_t late) {
+    uint64_t now = scheduler.cycles - late;
+    apu_run(now);
+    sequencer_advance(1);
+
+    if (apu_output.ring) {
+        if (apu.time < apu_output.base || now - apu_output.base > BLIP_MAX_CYCLES) {
+            blip_reset(now);
+        }
+        apu_emit_all(now);
+        blip_end(now);
+    }
+    if (!apu_lazy()) {
+        scheduler_schedule(EVENT_APU_FRAME, SEQUENCER_CYCLES - late);
+    }
+}
+
+// Brings a lazy frame sequencer up to the current cycle, from the steps
+// due since it last ran. Called before anything that depends on it:
+// sound register writes, NR52 reads, binding a ring and loading state.
+// Also starts the sequencer event again when the APU stops being lazy.
+void apu_sync() {
+    if (scheduler.deadlines[EVENT_APU_FRAME] != UINT64_MAX) {
+        return;
+    }
+    if (scheduler.cycles >= apu.sequencer_next) {
+        sequencer_advance((scheduler.cycles - apu.sequencer_next) / SEQUENCER_CYCLES + 1);
+    }
+    if (!apu_lazy()) {
+        scheduler_schedule(EVENT_APU_FRAME, apu.sequencer_next - scheduler.cycles);
+    }
+}
+
+// Registers as the boot ROM leaves them, with channel 1's chime over
+void apu_init() {
+    static const uint8_t boot_regs[0x17] = {
+        0x80, 0xBF, 0xF3, 0xFF, 0xBF,
+        0x00, 0x3F, 0x00, 0xFF, 0xBF,
+        0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+        0x00, 0xFF, 0x00, 0x00, 0xBF,
+        0x77, 0xF3, 0xF1
+    };
+
+    memset(&apu, 0, sizeof(apu));
+    memcpy(apu.regs, boot_regs, sizeof(boot_regs));
+    apu.power = true;
+    apu.time = scheduler.cycles;
+    apu.channels[0].enabled = true;
+    apu.channels[0].dac = true;
+    apu.channels[3].lfsr = 0x7FFF;
+    for (int r = 0; r <= R_NR52; r++) {
+        apu_update_register(r);
+    }
+    memset(&memory[NR10 + R_NR52 + 1], 0xFF, WAVE_RAM - (NR10 + R_NR52 + 1));
+    memory_dirty |= 1 << (NR10 >> 12);
+    if (apu_output.ring) {
+        blip_reset(apu.time);
+    }
+    apu.sequencer_next = scheduler.cycles + SEQUENCER_CYCLES;
+    if (!apu_lazy()) {
+        scheduler_schedule(EVENT_APU_FRAME, SEQUENCER_CYCLES);
+    }
+}
@@ -0,0 +1,184 @@
+// arena.c - Packed storage for batches of emulator instances
+#include <string.h>
+#include "gameboy.h"
+
+// An arena keeps the state of many instances as one array per
+// component, so the small per-slot state that every switch touches
+// (registers, PPU and timer counters, scheduler deadlines) sits
+// together, away from each slot's 64KB of memory. Memory blocks are
+// laid out in slot order and bound with memory_bind(), so switching
+// slots copies the hot state and nothing else.
+//
+// Slots run on the live globals of the thread that owns the arena.
+struct GB_Arena {
+    uint32_t count;
+    uint32_t capacity;
+    int current;               // Slot loaded into the live globals, or -1
+
+    // Hot state
+    CPU_State *cpu;
+    PPU_State *ppu;
+    Timer_State *timer;
+    Input_State *input;
+    Scheduler_State *scheduler;
+    APU_State *apu;
+    bool *dma_active;
+
+    // Cold state
+    Cartridge *cartridges;     // Shared ROM; each slot has its own RAM and banks
+    uint8_t *memory;           // capacity blocks of MEMORY_SIZE
+
+    Cartridge *source;         // Cartridge the arena was created from
+    Core_State saved;          // Live state at creation, restored by gb_arena_free
+};
+
+// Creates an empty arena for up to capacity slots. The live emulator
+// state is put back when the arena is freed.
+GB_Arena *gb_arena_create(uint32_t capacity) {
+    if (!current_cartridge || capacity == 0 || !gb_instance_deactivate()) {
+        return NULL;
+    }
+
+    GB_Arena *arena = calloc(1, sizeof(GB_Arena));
+    if (!arena) {
+        return NULL;
+    }
+
+    arena->capacity = capacity;
+    arena->current = -1;
+    arena->source = current_cartridge;
+    core_state_save(&arena->saved);
+
+    arena->cpu = calloc(capacity, sizeof(CPU_State));
+    arena->ppu = calloc(capacity, sizeof(PPU_State));
+    arena->timer = calloc(capacity, sizeof(Timer_State));
+    arena->input = calloc(capacity, sizeof(Input_State));
+    arena->scheduler = calloc(capacity, sizeof(Scheduler_State));
+    arena->apu = calloc(capacity, sizeof(APU_State));
+    arena->dma_active = calloc(capacity, sizeof(bool));
+    arena->cartridges = calloc(capacity, sizeof(Cartridge));
+    arena->memory = aligned_alloc(PAGE_SIZE, (size_t)capacity * MEMORY_SIZE);
+
+    if (!arena->cpu || !arena->ppu || !arena->timer || !arena->input ||
+        !arena->scheduler || !arena->apu || !arena->dma_active || !arena->cartridges || !arena->memory) {
+        gb_arena_free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+// Frees the arena and restores the emulator state from its creation
+void gb_arena_free(GB_Arena *arena) {
+    if (!arena) {
+        return;
+    }
+
+    memory_bind(NULL);
+    if (arena->source) {
+        current_cartridge = arena->source;
+        core_state_load(&arena->saved);
+    }
+
+    if (arena->cartridges) {
+        for (uint32_t i = 0; i < arena->count; i++) {
+            free(arena->cartridges[i].ram);
+        }
+    }
+    free(arena->cpu);
+    free(arena->ppu);
+    free(arena->timer);
+    free(arena->input);
+    free(arena->scheduler);
+    free(arena->apu);
+    free(arena->dma_active);
+    free(arena->cartridges);
+    free(arena->memory);
+    free(arena);
+}
+
+static void arena_store(GB_Arena *arena, uint32_t slot) {
+    arena->cpu[slot] = cpu;
+    arena->ppu[slot] = ppu;
+    arena->timer[slot] = timer_state;
+    arena->input[slot] = input_state;
+    arena->scheduler[slot] = scheduler;
+    arena->apu[slot] = apu;
+    arena->dma_active[slot] = dma_active;
+}
+
+// Copies the live emulator, which may be another slot, into a new slot.
+// Returns the slot number, or -1 if the arena is full.
+int gb_arena_add(GB_Arena *arena) {
+    if (arena->count == arena->capacity) {
+        return -1;
+    }
+
+    uint32_t slot = arena->count;
+    Cartridge *cartridge = &arena->cartridges[slot];
+    *cartridge = *current_cartridge;
+    if (cartridge->ram_size) {
+        cartridge->ram = malloc(cartridge->ram_size);
+        if (!cartridge->ram) {
+            return -1;
+        }
+        memcpy(cartridge->ram, current_cartridge->ram, cartridge->ram_size);
+    }
+
+    memcpy(&arena->memory[(size_t)slot * MEMORY_SIZE], memory, MEMORY_SIZE);
+    arena_store(arena, slot);
+    arena->count++;
+    return slot;
+}
+
+uint32_t gb_arena_count(const GB_Arena *arena) {
+    return arena->count;
+}
+
+// Loads slot into the live globals, storing the slot that was there
+void gb_arena_select(GB_Arena *arena, uint32_t slot) {
+    if (arena->current == (int)slot) {
+        return;
+    }
+    if (arena->current >= 0) {
+        arena_store(arena, arena->current);
+    }
+
+    memory_bind(&arena->memory[(size_t)slot * MEMORY_SIZE]);
+    current_cartridge = &arena->cartridges[slot];
+    cpu = arena->cpu[slot];
+    ppu = arena->ppu[slot];
+    timer_state = arena->timer[slot];
+    input_state = arena->input[slot];
+    scheduler = arena->scheduler[slot];
+    apu = arena->apu[slot];
+    dma_active = arena->dma_active[slot];
+    arena->current = slot;
+}
+
+// Frame counter of slot, without loading it
+uint32_t gb_arena_frames(const GB_Arena *arena, uint32_t slot) {
+    return arena->current == (int)slot ? ppu.frames : arena->ppu[slot].frames;
+}
+
+// Runs every slot for frames frames, in slot order. Returns the number
+// of instructions executed.
+uint64_t gb_arena_run_frames(GB_Arena *arena, uint32_t frames) {
+    uint64_t instructions = 0;
+    for (uint32_t slot = 0; slot < arena->count; slot++) {
+        gb_arena_select(arena, slot);
+        for (uint32_t i = 0; i < frames; i++) {
+            instructions += gb_run_frame();
+        }
+    }
+    return instructions;
+}
+
+// Runs every slot for a fixed number of instructions, in slot order
+void gb_arena_step(GB_Arena *arena, uint32_t instructions) {
+    for (uint32_t slot = 0; slot < arena->count; slot++) {
+        gb_arena_select(arena, slot);
+        for (uint32_t i = 0; i < instructions; i++) {
+            gb_step();
+        }
+    }
+}
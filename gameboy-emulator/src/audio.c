@@ -0,0 +1,104 @@
+// audio.c - Ring of audio samples between the emulator and the host
+#include <string.h>
+#include "gameboy.h"
+
+// Interleaved 16-bit stereo frames in a power-of-two ring, allocated
+// once. The emulator thread is the only writer and the host's audio
+// thread the only reader, so each index has one owner and no locks
+// are needed. A full ring drops new samples instead of stalling
+// emulation.
+struct GB_Audio_Ring {
+    int16_t *samples;
+    uint32_t capacity;      // Frames, a power of two
+    uint32_t sample_rate;
+    uint64_t dropped;       // Frames that did not fit, written by the producer
+    _Alignas(64) uint64_t head;   // Frames read, written by the consumer
+    _Alignas(64) uint64_t tail;   // Frames written, written by the producer
+};
+
+// Creates a ring holding at least frames stereo frames at sample_rate
+GB_Audio_Ring *gb_audio_ring_create(uint32_t sample_rate, uint32_t frames) {
+    if (sample_rate == 0 || frames == 0 || frames > (1u << 30)) {
+        return NULL;
+    }
+    uint32_t capacity = 1;
+    while (capacity < frames) {
+        capacity <<= 1;
+    }
+
+    GB_Audio_Ring *ring = aligned_alloc(64, (sizeof(GB_Audio_Ring) + 63) & ~(size_t)63);
+    if (!ring) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(GB_Audio_Ring));
+    ring->samples = calloc((size_t)capacity * 2, sizeof(int16_t));
+    if (!ring->samples) {
+        free(ring);
+        return NULL;
+    }
+    ring->capacity = capacity;
+    ring->sample_rate = sample_rate;
+    return ring;
+}
+
+void gb_audio_ring_free(GB_Audio_Ring *ring) {
+    if (!ring) {
+        return;
+    }
+    free(ring->samples);
+    free(ring);
+}
+
+uint32_t gb_audio_ring_sample_rate(const GB_Audio_Ring *ring) {
+    return ring->sample_rate;
+}
+
+// Copies frames in from a ring index, wrapping at the end
+static void ring_copy_in(GB_Audio_Ring *ring, uint64_t index, const int16_t *samples, uint32_t frames) {
+    uint32_t start = index & (ring->capacity - 1);
+    uint32_t first = frames < ring->capacity - start ? frames : ring->capacity - start;
+    memcpy(ring->samples + start * 2, samples, first * 2 * sizeof(int16_t));
+    memcpy(ring->samples, samples + first * 2, (frames - first) * 2 * sizeof(int16_t));
+}
+
+static void ring_copy_out(const GB_Audio_Ring *ring, uint64_t index, int16_t *samples, uint32_t frames) {
+    uint32_t start = index & (ring->capacity - 1);
+    uint32_t first = frames < ring->capacity - start ? frames : ring->capacity - start;
+    memcpy(samples, ring->samples + start * 2, first * 2 * sizeof(int16_t));
+    memcpy(samples + first * 2, ring->samples, (frames - first) * 2 * sizeof(int16_t));
+}
+
+// Producer side. Returns the frames that fit; the rest count as dropped.
+uint32_t gb_audio_ring_write(GB_Audio_Ring *ring, const int16_t *samples, uint32_t frames) {
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t space = ring->capacity - (uint32_t)(tail - head);
+    uint32_t count = frames < space ? frames : space;
+
+    ring_copy_in(ring, tail, samples, count);
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+    if (count < frames) {
+        __atomic_store_n(&ring->dropped, ring->dropped + frames - count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+// Consumer side. Copies up to frames frames out and returns how many.
+uint32_t gb_audio_ring_read(GB_Audio_Ring *ring, int16_t *samples, uint32_t frames) {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t count = tail - head < frames ? (uint32_t)(tail - head) : frames;
+
+    ring_copy_out(ring, head, samples, count);
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+// Frames waiting to be read
+uint32_t gb_audio_ring_available(const GB_Audio_Ring *ring) {
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+uint64_t gb_audio_ring_dropped(const GB_Audio_Ring *ring) {
+    return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
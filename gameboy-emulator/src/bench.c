@@ -0,0 +1,464 @@
+// bench.c - Headless throughput benchmarks for the emulator core
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "gameboy.h"
+
+#define BENCH_INSTRUCTIONS 50000000ULL
+#define BENCH_STATES       200000
+#define BENCH_FORKS        1000000
+#define BENCH_FORK_FRAMES  2000
+#define BENCH_LANES        64
+#define BENCH_LANE_FRAMES  10
+#define BENCH_SLOTS        256
+#define BENCH_SLOT_STEPS   100
+#define BENCH_SLOT_ROUNDS  2000
+#define BENCH_ENV_STEPS    5000
+#define BENCH_ENV_SKIP     4
+#define BENCH_VEC_ENVS     64
+#define BENCH_VEC_STEPS    100
+#define BENCH_LINK_FRAMES  3000
+#define BENCH_AUDIO_FRAMES 3000
+#define BENCH_AUDIO_RATE   48000
+
+// Hardware cache counters: L1 data and last-level cache reads and misses
+enum { CACHE_L1_READS, CACHE_L1_MISSES, CACHE_LL_READS, CACHE_LL_MISSES, CACHE_COUNTERS };
+
+typedef struct {
+    int fd[CACHE_COUNTERS];
+    uint64_t count[CACHE_COUNTERS];
+} Bench_Cache;
+
+static double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs the main loop without status output or throttling
+static void bench_core() {
+    double start = bench_seconds();
+    for (uint64_t i = 0; i < BENCH_INSTRUCTIONS; i++) {
+        gb_step();
+    }
+    double elapsed = bench_seconds() - start;
+
+    printf("core: %llu instructions in %.3f s (%.2f MIPS)\n",
+           BENCH_INSTRUCTIONS, elapsed, BENCH_INSTRUCTIONS / elapsed / 1e6);
+}
+
+// Save state round trips, the cost of branching a search from a state
+static void bench_state() {
+    uint8_t *buffer = malloc(gb_state_size());
+    if (!buffer) {
+        return;
+    }
+
+    double start = bench_seconds();
+    for (int i = 0; i < BENCH_STATES; i++) {
+        gb_state_save(buffer);
+    }
+    double save_time = bench_seconds() - start;
+
+    start = bench_seconds();
+    for (int i = 0; i < BENCH_STATES; i++) {
+        gb_state_load(buffer);
+    }
+    double load_time = bench_seconds() - start;
+
+    printf("state: %zu bytes, save %.2f us, load %.2f us\n", gb_state_size(),
+           save_time / BENCH_STATES * 1e6, load_time / BENCH_STATES * 1e6);
+    free(buffer);
+}
+
+// Copy-on-write forks: bare forks, then forks that each run a frame
+// from the same parent the way a tree search expands a node
+static void bench_fork() {
+    GB_Instance *parent = gb_instance_create();
+    if (!parent) {
+        return;
+    }
+
+    double start = bench_seconds();
+    for (int i = 0; i < BENCH_FORKS; i++) {
+        gb_instance_free(gb_instance_fork(parent));
+    }
+    double fork_time = bench_seconds() - start;
+
+    start = bench_seconds();
+    for (int i = 0; i < BENCH_FORK_FRAMES; i++) {
+        GB_Instance *child = gb_instance_fork(parent);
+        gb_instance_activate(child);
+        gb_run_frame();
+        gb_instance_sync(child);
+        gb_instance_free(child);
+    }
+    double frame_time = bench_seconds() - start;
+
+    printf("fork: %.0f forks/s, %.0f fork+frame/s\n",
+           BENCH_FORKS / fork_time, BENCH_FORK_FRAMES / frame_time);
+    gb_instance_free(parent);
+}
+
+// Input for a lane in a frame, so lanes act like rollouts with
+// different actions
+static uint8_t bench_lane_input(uint32_t lane, uint32_t frame) {
+    return (lane * 0x9D + frame * (lane | 1)) >> 3;
+}
+
+// The same lanes run in lockstep, then as independent instances one
+// after the other
+static void bench_lockstep() {
+    Lockstep *ls = lockstep_create(BENCH_LANES);
+    if (!ls) {
+        return;
+    }
+
+    double start = bench_seconds();
+    for (uint32_t frame = 0; frame < BENCH_LANE_FRAMES; frame++) {
+        for (uint32_t lane = 0; lane < BENCH_LANES; lane++) {
+            lockstep_set_input(ls, lane, bench_lane_input(lane, frame));
+        }
+        lockstep_run_frame(ls);
+    }
+    double lockstep_time = bench_seconds() - start;
+
+    Lockstep_Stats stats;
+    lockstep_stats(ls, &stats);
+    lockstep_free(ls);
+
+    GB_Instance *parent = gb_instance_create();
+    GB_Instance *lanes[BENCH_LANES];
+    for (uint32_t lane = 0; lane < BENCH_LANES; lane++) {
+        lanes[lane] = gb_instance_fork(parent);
+    }
+
+    uint64_t instructions = 0;
+    start = bench_seconds();
+    for (uint32_t frame = 0; frame < BENCH_LANE_FRAMES; frame++) {
+        for (uint32_t lane = 0; lane < BENCH_LANES; lane++) {
+            gb_instance_activate(lanes[lane]);
+            input_set_mask(bench_lane_input(lane, frame));
+            instructions += gb_run_frame();
+        }
+    }
+    double scalar_time = bench_seconds() - start;
+
+    for (uint32_t lane = 0; lane < BENCH_LANES; lane++) {
+        gb_instance_free(lanes[lane]);
+    }
+    gb_instance_free(parent);
+
+    uint64_t lane_instructions = stats.vector_instructions + stats.scalar_instructions;
+    printf("lockstep: %d lanes, %.2f MIPS (%.0f%% vector, %.0f%% occupancy), "
+           "independent %.2f MIPS\n", BENCH_LANES, lane_instructions / lockstep_time / 1e6,
+           lane_instructions ? 100.0 * stats.vector_instructions / lane_instructions : 0,
+           stats.vector_steps ? 100.0 * stats.vector_instructions / stats.vector_steps / BENCH_LANES : 0,
+           instructions / scalar_time / 1e6);
+}
+
+static int cache_open(uint32_t cache, uint32_t result) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Opens the counters for this thread. Returns false when the kernel or
+// the machine (a VM, usually) does not expose them.
+static bool cache_start(Bench_Cache *bc) {
+    bc->fd[CACHE_L1_READS] = cache_open(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+    bc->fd[CACHE_L1_MISSES] = cache_open(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS);
+    bc->fd[CACHE_LL_READS] = cache_open(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+    bc->fd[CACHE_LL_MISSES] = cache_open(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS);
+
+    bool ok = true;
+    for (int i = 0; i < CACHE_COUNTERS; i++) {
+        ok = ok && bc->fd[i] >= 0;
+    }
+    for (int i = 0; ok && i < CACHE_COUNTERS; i++) {
+        ioctl(bc->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(bc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if (!ok) {
+        for (int i = 0; i < CACHE_COUNTERS; i++) {
+            if (bc->fd[i] >= 0) {
+                close(bc->fd[i]);
+            }
+        }
+    }
+    return ok;
+}
+
+static void cache_stop(Bench_Cache *bc) {
+    for (int i = 0; i < CACHE_COUNTERS; i++) {
+        ioctl(bc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(bc->fd[i], &bc->count[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+            bc->count[i] = 0;
+        }
+        close(bc->fd[i]);
+    }
+}
+
+static void cache_print(const char *label, double seconds, bool counted, const Bench_Cache *bc) {
+    uint64_t instructions = (uint64_t)BENCH_SLOTS * BENCH_SLOT_STEPS * BENCH_SLOT_ROUNDS;
+    printf("  %-9s %.2f MIPS", label, instructions / seconds / 1e6);
+    if (counted) {
+        const uint64_t *c = bc->count;
+        printf(", L1D miss %.2f%% of %llu reads, LLC miss %.2f%% of %llu reads",
+               c[CACHE_L1_READS] ? 100.0 * c[CACHE_L1_MISSES] / c[CACHE_L1_READS] : 0,
+               (unsigned long long)c[CACHE_L1_READS],
+               c[CACHE_LL_READS] ? 100.0 * c[CACHE_LL_MISSES] / c[CACHE_LL_READS] : 0,
+               (unsigned long long)c[CACHE_LL_READS]);
+    } else {
+        printf(", cache counters unavailable");
+    }
+    printf("\n");
+}
+
+// Many instances stepped round-robin in short slices, the pattern of a
+// batched rollout. First as forked instances, each switch going
+// through the instance page tables, then packed in an arena.
+static void bench_arena() {
+    GB_Instance *parent = gb_instance_create();
+    if (!parent) {
+        return;
+    }
+    GB_Instance *slots[BENCH_SLOTS];
+    for (uint32_t slot = 0; slot < BENCH_SLOTS; slot++) {
+        slots[slot] = gb_instance_fork(parent);
+    }
+
+    Bench_Cache bc;
+    bool counted = cache_start(&bc);
+    double start = bench_seconds();
+    for (int round = 0; round < BENCH_SLOT_ROUNDS; round++) {
+        for (uint32_t slot = 0; slot < BENCH_SLOTS; slot++) {
+            gb_instance_activate(slots[slot]);
+            for (int i = 0; i < BENCH_SLOT_STEPS; i++) {
+                gb_step();
+            }
+        }
+    }
+    double instance_time = bench_seconds() - start;
+    if (counted) {
+        cache_stop(&bc);
+    }
+
+    printf("arena: %d slots, %d instructions per switch\n", BENCH_SLOTS, BENCH_SLOT_STEPS);
+    cache_print("instances", instance_time, counted, &bc);
+
+    // Arena slots are cloned from the live state, the parent's
+    gb_instance_activate(parent);
+    for (uint32_t slot = 0; slot < BENCH_SLOTS; slot++) {
+        gb_instance_free(slots[slot]);
+    }
+    GB_Arena *arena = gb_arena_create(BENCH_SLOTS);
+    for (uint32_t slot = 0; arena && slot < BENCH_SLOTS; slot++) {
+        gb_arena_add(arena);
+    }
+
+    if (arena) {
+        counted = cache_start(&bc);
+        start = bench_seconds();
+        for (int round = 0; round < BENCH_SLOT_ROUNDS; round++) {
+            gb_arena_step(arena, BENCH_SLOT_STEPS);
+        }
+        double arena_time = bench_seconds() - start;
+        if (counted) {
+            cache_stop(&bc);
+        }
+        cache_print("arena", arena_time, counted, &bc);
+        gb_arena_free(arena);
+    }
+
+    gb_instance_activate(parent);
+    gb_instance_free(parent);
+}
+
+// Environment steps with frame skip, raw and with the observation
+// converted the way agents usually take it
+static void bench_env(const char *rom_file) {
+    static const uint32_t flags[] = { 0, GB_ENV_GRAYSCALE | GB_ENV_DOWNSAMPLE };
+    static const char *names[] = { "raw", "gray 80x72" };
+
+    for (int mode = 0; mode < 2; mode++) {
+        GB_Env_Config config = { flags[mode], 18000, 30, NULL, false };
+        if (!gb_env_open(rom_file, &config)) {
+            return;
+        }
+
+        uint64_t episodes = 1;
+        gb_env_reset(0);
+        double start = bench_seconds();
+        for (uint32_t i = 0; i < BENCH_ENV_STEPS; i++) {
+            GB_Env_Step step = gb_env_step(bench_lane_input(i & 63, i), BENCH_ENV_SKIP);
+            if (step.done) {
+                gb_env_reset(episodes++);
+            }
+        }
+        double elapsed = bench_seconds() - start;
+        gb_env_close();
+
+        printf("env %-10s %.0f steps/s (frameskip %d, %.0f frames/s)\n", names[mode],
+               BENCH_ENV_STEPS / elapsed, BENCH_ENV_SKIP,
+               BENCH_ENV_STEPS * BENCH_ENV_SKIP / elapsed);
+    }
+}
+
+// Stand-in for a trainer reading a batch
+static uint64_t bench_consume(const uint8_t *tensor, size_t size) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < size; i++) {
+        sum += tensor[i];
+    }
+    return sum;
+}
+
+// A batch of environments on one worker per CPU, stepped synchronously
+// and then double-buffered with the batch read while the next one runs
+static void bench_vec_env(const char *rom_file) {
+    GB_Env_Config config = { GB_ENV_GRAYSCALE | GB_ENV_DOWNSAMPLE, 18000, 30, NULL, false };
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    GB_Vec_Env *ve = gb_vec_env_create(rom_file, &config, BENCH_VEC_ENVS, threads);
+    if (!ve) {
+        return;
+    }
+
+    size_t tensor_size = (size_t)BENCH_VEC_ENVS * gb_env_width(config.flags) * gb_env_height(config.flags);
+    uint8_t actions[BENCH_VEC_ENVS];
+    uint64_t checksum = 0;
+    double elapsed[2];
+
+    for (int async = 0; async < 2; async++) {
+        GB_Vec_Step step = gb_vec_env_reset(ve, 0);
+        double start = bench_seconds();
+        for (uint32_t i = 0; i < BENCH_VEC_STEPS; i++) {
+            for (uint32_t env = 0; env < BENCH_VEC_ENVS; env++) {
+                actions[env] = bench_lane_input(env, i);
+            }
+            if (async) {
+                gb_vec_env_step_async(ve, actions, BENCH_ENV_SKIP);
+                checksum += bench_consume(step.observations, tensor_size);
+                step = gb_vec_env_wait(ve);
+            } else {
+                step = gb_vec_env_step(ve, actions, BENCH_ENV_SKIP);
+                checksum += bench_consume(step.observations, tensor_size);
+            }
+        }
+        elapsed[async] = bench_seconds() - start;
+    }
+    gb_vec_env_free(ve);
+
+    uint64_t steps = (uint64_t)BENCH_VEC_ENVS * BENCH_VEC_STEPS;
+    printf("vec env: %d envs on %d threads, sync %.0f steps/s, async %.0f steps/s (checksum %llx)\n",
+           BENCH_VEC_ENVS, threads < BENCH_VEC_ENVS ? threads : BENCH_VEC_ENVS,
+           steps / elapsed[0], steps / elapsed[1], (unsigned long long)checksum);
+}
+
+// Two instances on threads of their own, unlinked and then joined by a
+// cable, which costs them a message a frame plus a wait per transfer
+static void bench_link(const char *rom_file) {
+    Link_Pipe *pipe = link_pipe_create();
+    if (!pipe) {
+        return;
+    }
+
+    double elapsed[2];
+    Link_Stats stats[2];
+    for (int linked = 0; linked < 2; linked++) {
+        Link_Player players[2];
+        memset(players, 0, sizeof(players));
+        for (int side = 0; side < 2; side++) {
+            players[side].rom_file = rom_file;
+            players[side].link = linked ? link_pipe_end(pipe, side) : NULL;
+            players[side].frames = BENCH_LINK_FRAMES;
+        }
+        elapsed[linked] = link_run(players, 2);
+        if (elapsed[linked] < 0 || players[0].failed || players[1].failed) {
+            link_pipe_free(pipe);
+            return;
+        }
+    }
+    link_stats(link_pipe_end(pipe, 0), &stats[0]);
+    link_stats(link_pipe_end(pipe, 1), &stats[1]);
+    link_pipe_free(pipe);
+
+    printf("link: 2 instances, unlinked %.0f frames/s, linked %.0f frames/s "
+           "(%llu transfers, %llu waits, %llu messages)\n",
+           2 * BENCH_LINK_FRAMES / elapsed[0], 2 * BENCH_LINK_FRAMES / elapsed[1],
+           (unsigned long long)(stats[0].transfers + stats[1].transfers),
+           (unsigned long long)(stats[0].waits + stats[1].waits),
+           (unsigned long long)(stats[0].sent + stats[1].sent));
+}
+
+// Frames with the APU silent, then synthesizing into a ring that is
+// drained every frame the way a host's audio callback would
+static void bench_audio() {
+    GB_Audio_Ring *ring = gb_audio_ring_create(BENCH_AUDIO_RATE, BENCH_AUDIO_RATE);
+    int16_t *samples = malloc(BENCH_AUDIO_RATE * 2 * sizeof(int16_t));
+    void *state = malloc(gb_state_size());
+    if (!ring || !samples || !state) {
+        gb_audio_ring_free(ring);
+        free(samples);
+        free(state);
+        return;
+    }
+
+    // Lazy, then the frame sequencer on time with no ring, then synthesis
+    gb_state_save(state);
+    double elapsed[3];
+    uint64_t frames_out = 0;
+    bool lazy = gb_apu_lazy;
+    for (int mode = 0; mode < 3; mode++) {
+        gb_apu_lazy = mode == 0;
+        gb_state_load(state);
+        apu_bind(mode == 2 ? ring : NULL);
+        double start = bench_seconds();
+        for (uint32_t i = 0; i < BENCH_AUDIO_FRAMES; i++) {
+            gb_run_frame();
+            frames_out += gb_audio_ring_read(ring, samples, BENCH_AUDIO_RATE);
+        }
+        elapsed[mode] = bench_seconds() - start;
+    }
+    apu_bind(NULL);
+    gb_apu_lazy = lazy;
+    gb_state_load(state);
+
+    printf("audio: lazy %.0f frames/s, silent %.0f frames/s, %u Hz synthesis %.0f frames/s "
+           "(%.1f%% of the time over lazy, %llu sample frames, %llu dropped)\n",
+           BENCH_AUDIO_FRAMES / elapsed[0], BENCH_AUDIO_FRAMES / elapsed[1], BENCH_AUDIO_RATE,
+           BENCH_AUDIO_FRAMES / elapsed[2],
+           elapsed[2] > elapsed[0] ? 100 * (elapsed[2] - elapsed[0]) / elapsed[2] : 0.0,
+           (unsigned long long)frames_out, (unsigned long long)gb_audio_ring_dropped(ring));
+    gb_audio_ring_free(ring);
+    free(samples);
+    free(state);
+}
+
+int bench_run(const char *rom_file) {
+    if (!gb_init(rom_file)) {
+        return 1;
+    }
+
+    bench_core();
+    bench_state();
+    bench_fork();
+    bench_lockstep();
+    bench_arena();
+    bench_audio();
+    cartridge_free();
+
+    bench_env(rom_file);
+    bench_vec_env(rom_file);
+    bench_link(rom_file);
+    return 0;
+}
@@ -1,9 +1,163 @@
 // cartridge.c - ROM cartridge handling
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "gameboy.h"
 
-Cartridge *current_cartridge = NULL;
+#define RAM_BANK_SIZE 0x2000
 
-bool cartridge_load(const char *filename) {
+GB_LOCAL Cartridge *current_cartridge = NULL;
+GB_LOCAL uint32_t cartridge_ram_dirty;
+
+// Backs reads of unmapped ROM and RAM pages
+static const uint8_t unmapped_page[0x100] = {
+    [0 ... 0xFF] = 0xFF
+};
+
+// External RAM sizes indexed by header byte 0x149
+static const size_t ram_sizes[] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+
+static uint8_t cartridge_mbc_type(uint8_t type) {
+    switch (type) {
+        case 0x01: case 0x02: case 0x03:
+            return 1;
+        case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+            return 3;
+        case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+static bool cartridge_has_battery(uint8_t type) {
+    switch (type) {
+        case 0x03: case 0x06: case 0x09: case 0x0D: case 0x0F:
+        case 0x10: case 0x13: case 0x1B: case 0x1E: case 0xFF:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Builds "<rom without extension>.sav" next to the ROM
+static void cartridge_save_path(const char *filename, char *path, size_t size) {
+    snprintf(path, size, "%s", filename);
+    char *dot = strrchr(path, '.');
+    char *slash = strrchr(path, '/');
+    if (dot && (!slash || dot > slash)) {
+        *dot = '\0';
+    }
+    strncat(path, ".sav", size - strlen(path) - 1);
+}
+
+// Maps external RAM. Battery-backed RAM is a shared mapping of the .sav
+// file, so every write lands in the page cache and persists without an
+// explicit save pass. Other cartridges, and all of them when battery
+// saves are not wanted, get anonymous memory.
+static bool cartridge_map_ram(const char *filename, bool battery_saves) {
+    size_t size = current_cartridge->ram_size;
+    if (size == 0) {
+        return true;
+    }
+
+    if (!current_cartridge->battery || !battery_saves) {
+        current_cartridge->ram = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return current_cartridge->ram != MAP_FAILED;
+    }
+
+    char path[4096];
+    cartridge_save_path(filename, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Failed to open save file: %s\n", path);
+        return false;
+    }
+
+    // A new or short save file is zero-extended to the RAM size
+    off_t length = lseek(fd, 0, SEEK_END);
+    if (length < (off_t)size && ftruncate(fd, size) != 0) {
+        printf("Failed to size save file: %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    current_cartridge->ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (current_cartridge->ram == MAP_FAILED) {
+        printf("Failed to map save file: %s\n", path);
+        return false;
+    }
+    current_cartridge->saved = true;
+
+    if (!gb_quiet) {
+        printf("Battery RAM: %s (%zu bytes)\n", path, size);
+    }
+    return true;
+}
+
+// Recomputes the ROM offsets of both windows from the bank registers,
+// so reads do not redo the MBC arithmetic. On MBC1 the 2-bit register
+// always supplies bits 5-6 of the 0x4000-0x7FFF bank, and in mode 1 it
+// also banks 0x0000-0x3FFF, which large ROMs use to reach banks 0x20,
+// 0x40 and 0x60 there.
+static void cartridge_update_rom_bank() {
+    MBC_State *mbc = &current_cartridge->mbc;
+    uint16_t bank;
+    uint16_t bank0 = 0;
+
+    switch (current_cartridge->mbc_type) {
+        case 1:
+            bank = mbc->rom_bank & 0x1F;
+            if (bank == 0) bank = 1;
+            bank |= mbc->ram_bank << 5;
+            if (mbc->mode == 1) bank0 = mbc->ram_bank << 5;
+            break;
+        case 3:
+            bank = mbc->rom_bank & 0x7F;
+            if (bank == 0) bank = 1;
+            break;
+        case 5:
+            bank = mbc->rom_bank & 0x1FF;
+            break;
+        default:
+            bank = 1;
+            break;
+    }
+
+    size_t banks = current_cartridge->size / ROM_BANK_SIZE;
+    if (banks > 0) {
+        bank %= banks;
+        bank0 %= banks;
+    }
+    current_cartridge->rom_offset = (size_t)bank * ROM_BANK_SIZE;
+    current_cartridge->rom0_offset = (size_t)bank0 * ROM_BANK_SIZE;
+}
+
+static void cartridge_update_ram_bank() {
+    MBC_State *mbc = &current_cartridge->mbc;
+    size_t size = current_cartridge->ram_size;
+    uint8_t bank = mbc->ram_bank;
+
+    // MBC1 only banks RAM in mode 1; MBC3 banks 0x08-0x0C select the RTC,
+    // which is not emulated
+    if (current_cartridge->mbc_type == 1 && mbc->mode == 0) {
+        bank = 0;
+    }
+
+    if (size == 0 || (current_cartridge->mbc_type == 3 && bank > 0x03)) {
+        current_cartridge->ram_offset = SIZE_MAX;
+        return;
+    }
+    current_cartridge->ram_offset = ((size_t)bank * RAM_BANK_SIZE) % size;
+}
+
+// Loads filename as this thread's cartridge. battery_saves maps battery
+// RAM from the .sav file; without it the RAM starts blank and is lost.
+bool cartridge_load(const char *filename, bool battery_saves) {
     FILE *file = fopen(filename, "rb");
     if (!file) {
         printf("Failed to open ROM file: %s\n", filename);
@@ -16,7 +170,7 @@ bool cartridge_load(const char *filename) {
     fseek(file, 0, SEEK_SET);
 
     // Allocate cartridge
-    current_cartridge = malloc(sizeof(Cartridge));
+    current_cartridge = calloc(1, sizeof(Cartridge));
     if (!current_cartridge) {
         fclose(file);
         printf("Failed to allocate memory for cartridge\n");
@@ -52,33 +206,187 @@ bool cartridge_load(const char *filename) {
             if (current_cartridge->title[i] == 0) break;
         }
         current_cartridge->title[15] = '\0';
-        
+
         // Get cartridge type
         current_cartridge->type = current_cartridge->data[0x147];
-        
-        printf("Loaded ROM: %s (Type: 0x%02X)\n", current_cartridge->title, current_cartridge->type);
+
+        // External RAM size
+        uint8_t ram_code = current_cartridge->data[0x149];
+        if (ram_code < sizeof(ram_sizes) / sizeof(ram_sizes[0])) {
+            current_cartridge->ram_size = ram_sizes[ram_code];
+        }
+
+        if (!gb_quiet) {
+            printf("Loaded ROM: %s (Type: 0x%02X)\n", current_cartridge->title, current_cartridge->type);
+        }
+    }
+
+    current_cartridge->mbc_type = cartridge_mbc_type(current_cartridge->type);
+    current_cartridge->battery = cartridge_has_battery(current_cartridge->type);
+
+    if (!cartridge_map_ram(filename, battery_saves)) {
+        current_cartridge->ram = NULL;
+        cartridge_free();
+        return false;
     }
 
+    // Cartridges without an MBC have their RAM permanently enabled
+    current_cartridge->mbc.rom_bank = 1;
+    current_cartridge->mbc.ram_enabled = current_cartridge->mbc_type == 0;
+    cartridge_update_rom_bank();
+    cartridge_update_ram_bank();
+    cartridge_ram_dirty = CART_RAM_PAGES_ALL;
+
     return true;
 }
 
-void cartridge_free() {
-    if (current_cartridge) {
-        if (current_cartridge->data) {
-            free(current_cartridge->data);
-        }
-        free(current_cartridge);
+// Frees cartridge, which need not be this thread's current one, e.g.
+// when it belongs to a suspended instance
+void cartridge_destroy(Cartridge *cartridge) {
+    if (!cartridge) {
+        return;
+    }
+    if (cartridge == current_cartridge) {
         current_cartridge = NULL;
     }
+    if (cartridge->data) {
+        free(cartridge->data);
+    }
+    if (cartridge->ram) {
+        // Flush battery RAM to the save file before unmapping
+        if (cartridge->saved) {
+            msync(cartridge->ram, cartridge->ram_size, MS_SYNC);
+        }
+        munmap(cartridge->ram, cartridge->ram_size);
+    }
+    free(cartridge);
+}
+
+void cartridge_free() {
+    cartridge_destroy(current_cartridge);
 }
 
 uint8_t cartridge_read(uint16_t address) {
-    if (!current_cartridge || address >= current_cartridge->size) {
+    if (!current_cartridge) {
         return 0xFF; // Return 0xFF for unmapped reads
     }
-    return current_cartridge->data[address];
+
+    size_t offset = current_cartridge->rom0_offset + address;
+    if (address >= ROM_BANK_SIZE) {
+        offset = current_cartridge->rom_offset + (address - ROM_BANK_SIZE);
+    }
+
+    if (offset >= current_cartridge->size) {
+        return 0xFF;
+    }
+    return current_cartridge->data[offset];
 }
 
-bool load_cartridge(const char* filename) {
-    return cartridge_load(filename);
-}
\ No newline at end of file
+// Writes to the ROM area program the MBC registers
+void cartridge_write(uint16_t address, uint8_t value) {
+    if (!current_cartridge || current_cartridge->mbc_type == 0) {
+        return;
+    }
+
+    MBC_State *mbc = &current_cartridge->mbc;
+    uint8_t mbc_type = current_cartridge->mbc_type;
+
+    if (address < 0x2000) {
+        // RAM enable
+        mbc->ram_enabled = (value & 0x0F) == 0x0A;
+    } else if (address < 0x4000) {
+        // ROM bank number
+        if (mbc_type == 5) {
+            if (address < 0x3000) {
+                mbc->rom_bank = (mbc->rom_bank & 0x100) | value;
+            } else {
+                mbc->rom_bank = (mbc->rom_bank & 0xFF) | ((value & 0x01) << 8);
+            }
+        } else {
+            mbc->rom_bank = value;
+        }
+        cartridge_update_rom_bank();
+    } else if (address < 0x6000) {
+        // RAM bank number (upper ROM bank bits on MBC1)
+        mbc->ram_bank = mbc_type == 1 ? (value & 0x03) : (value & 0x0F);
+        cartridge_update_rom_bank();
+        cartridge_update_ram_bank();
+    } else if (mbc_type == 1) {
+        // Banking mode select
+        mbc->mode = value & 0x01;
+        cartridge_update_rom_bank();
+        cartridge_update_ram_bank();
+    }
+}
+
+// Restores bank registers, e.g. from a save state
+void cartridge_set_banks(const MBC_State *mbc) {
+    if (!current_cartridge) {
+        return;
+    }
+    current_cartridge->mbc = *mbc;
+    cartridge_update_rom_bank();
+    cartridge_update_ram_bank();
+}
+
+uint8_t cartridge_ram_read(uint16_t address) {
+    if (!current_cartridge || !current_cartridge->mbc.ram_enabled ||
+        current_cartridge->ram_offset == SIZE_MAX) {
+        return 0xFF;
+    }
+
+    size_t offset = current_cartridge->ram_offset + (address - 0xA000);
+    if (offset >= current_cartridge->ram_size) {
+        return 0xFF;
+    }
+    return current_cartridge->ram[offset];
+}
+
+void cartridge_ram_write(uint16_t address, uint8_t value) {
+    if (!current_cartridge || !current_cartridge->mbc.ram_enabled ||
+        current_cartridge->ram_offset == SIZE_MAX) {
+        return;
+    }
+
+    size_t offset = current_cartridge->ram_offset + (address - 0xA000);
+    if (offset < current_cartridge->ram_size) {
+        current_cartridge->ram[offset] = value;
+        cartridge_ram_dirty |= 1u << (offset / PAGE_SIZE);
+    }
+}
+
+// Pointer to the 256-byte ROM page at address, or to an all-0xFF page
+// when the ROM does not cover it
+const uint8_t *cartridge_page_pointer(uint16_t address) {
+    if (!current_cartridge) {
+        return unmapped_page;
+    }
+
+    size_t offset = current_cartridge->rom0_offset + address;
+    if (address >= ROM_BANK_SIZE) {
+        offset = current_cartridge->rom_offset + (address - ROM_BANK_SIZE);
+    }
+
+    if (offset + 0x100 > current_cartridge->size) {
+        return unmapped_page;
+    }
+    return &current_cartridge->data[offset];
+}
+
+// Pointer to the 256-byte external RAM page at address (0xA000-0xBFFF)
+const uint8_t *cartridge_ram_page_pointer(uint16_t address) {
+    if (!current_cartridge || !current_cartridge->mbc.ram_enabled ||
+        current_cartridge->ram_offset == SIZE_MAX) {
+        return unmapped_page;
+    }
+
+    size_t offset = current_cartridge->ram_offset + (address - 0xA000);
+    if (offset + 0x100 > current_cartridge->ram_size) {
+        return unmapped_page;
+    }
+    return &current_cartridge->ram[offset];
+}
+
+bool load_cartridge(const char* filename, bool battery_saves) {
+    return cartridge_load(filename, battery_saves);
+}
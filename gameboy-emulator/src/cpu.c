@@ -1,7 +1,34 @@
 // cpu.c - Game Boy CPU (Sharp LR35902) emulation
 #include "gameboy.h"
 
-CPU_State cpu;
+// Interrupt registers
+#define IF_REG 0xFF0F
+#define IE_REG 0xFFFF
+
+GB_LOCAL CPU_State cpu;
+
+// Base opcode timings in clock cycles. Conditional branches list the
+// not-taken cost; the taken penalty is added when the branch resolves.
+// The 11 illegal opcodes are 0.
+const uint8_t opcode_cycles[256] = {
+//   x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xA  xB  xC  xD  xE  xF
+     4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4, // 0x
+     4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4, // 1x
+     8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4, // 2x
+     8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4, // 3x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 4x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 5x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 6x
+     8,  8,  8,  8,  8,  8,  4,  8,  4,  4,  4,  4,  4,  4,  8,  4, // 7x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 8x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 9x
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // Ax
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // Bx
+     8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  4, 12, 24,  8, 16, // Cx
+     8, 12, 12,  0, 12, 16,  8, 16,  8, 16, 12,  0, 12,  0,  8, 16, // Dx
+    12, 12,  8,  0,  0, 16,  8, 16, 16,  4, 16,  0,  0,  0,  8, 16, // Ex
+    12, 12,  8,  4,  0, 16,  8, 16, 12,  8, 16,  4,  0,  0,  8, 16  // Fx
+};
 
 void cpu_init() {
     // Initial register values for Game Boy after boot ROM
@@ -16,7 +43,9 @@ void cpu_init() {
     cpu.pc = 0x0100;  // Start after boot ROM
     cpu.sp = 0xFFFE;
     cpu.halted = false;
+    cpu.locked = false;
     cpu.interrupts_enabled = false;
+    cpu.ei_pending = false;
 }
 
 uint8_t cpu_fetch_byte() {
@@ -29,897 +58,560 @@ uint16_t cpu_fetch_word() {
     return (high << 8) | low;
 }
 
-// Helper functions for register pairs
-uint16_t get_bc() { return (cpu.b << 8) | cpu.c; }
-uint16_t get_de() { return (cpu.d << 8) | cpu.e; }
-uint16_t get_hl() { return (cpu.h << 8) | cpu.l; }
-
-void set_bc(uint16_t value) { cpu.b = value >> 8; cpu.c = value & 0xFF; }
-void set_de(uint16_t value) { cpu.d = value >> 8; cpu.e = value & 0xFF; }
-void set_hl(uint16_t value) { cpu.h = value >> 8; cpu.l = value & 0xFF; }
-
 // Flag operations
 void set_flag(uint8_t flag) { cpu.f |= flag; }
 void clear_flag(uint8_t flag) { cpu.f &= ~flag; }
 bool get_flag(uint8_t flag) { return (cpu.f & flag) != 0; }
 
-void cpu_execute_instruction() {
-    if (cpu.halted) {
-        return; // CPU is halted, do nothing
+void cpu_request_interrupt(uint8_t interrupt) {
+    memory_write(IF_REG, memory_read(IF_REG) | interrupt);
+}
+
+// 8-bit operands are encoded in three bits: B, C, D, E, H, L, (HL), A
+static uint8_t read_r8(uint8_t index) {
+    switch (index) {
+        case 0: return cpu.b;
+        case 1: return cpu.c;
+        case 2: return cpu.d;
+        case 3: return cpu.e;
+        case 4: return cpu.h;
+        case 5: return cpu.l;
+        case 6: return memory_read(cpu.hl);
+        default: return cpu.a;
     }
+}
 
-    uint8_t opcode = cpu_fetch_byte();
-    
-    switch (opcode) {
-        case 0x00: // NOP
+static void write_r8(uint8_t index, uint8_t value) {
+    switch (index) {
+        case 0: cpu.b = value; break;
+        case 1: cpu.c = value; break;
+        case 2: cpu.d = value; break;
+        case 3: cpu.e = value; break;
+        case 4: cpu.h = value; break;
+        case 5: cpu.l = value; break;
+        case 6: memory_write(cpu.hl, value); break;
+        default: cpu.a = value; break;
+    }
+}
+
+// 16-bit operands are encoded in two bits: BC, DE, HL, SP
+static uint16_t read_r16(uint8_t index) {
+    switch (index) {
+        case 0: return cpu.bc;
+        case 1: return cpu.de;
+        case 2: return cpu.hl;
+        default: return cpu.sp;
+    }
+}
+
+static void write_r16(uint8_t index, uint16_t value) {
+    switch (index) {
+        case 0: cpu.bc = value; break;
+        case 1: cpu.de = value; break;
+        case 2: cpu.hl = value; break;
+        default: cpu.sp = value; break;
+    }
+}
+
+static void push_word(uint16_t value) {
+    cpu.sp--;
+    memory_write(cpu.sp, value >> 8);
+    cpu.sp--;
+    memory_write(cpu.sp, value & 0xFF);
+}
+
+static uint16_t pop_word() {
+    uint8_t low = memory_read(cpu.sp++);
+    uint8_t high = memory_read(cpu.sp++);
+    return (high << 8) | low;
+}
+
+// Branch conditions are encoded in two bits: NZ, Z, NC, C
+static bool check_condition(uint8_t condition) {
+    switch (condition) {
+        case 0: return !get_flag(FLAG_Z);
+        case 1: return get_flag(FLAG_Z);
+        case 2: return !get_flag(FLAG_C);
+        default: return get_flag(FLAG_C);
+    }
+}
+
+static uint8_t alu_inc(uint8_t value) {
+    value++;
+    cpu.f = (cpu.f & FLAG_C) | (value == 0 ? FLAG_Z : 0) | ((value & 0x0F) == 0 ? FLAG_H : 0);
+    return value;
+}
+
+static uint8_t alu_dec(uint8_t value) {
+    cpu.f = (cpu.f & FLAG_C) | FLAG_N | ((value & 0x0F) == 0 ? FLAG_H : 0);
+    value--;
+    if (value == 0) cpu.f |= FLAG_Z;
+    return value;
+}
+
+// Accumulator operations: ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+static void alu_op(uint8_t op, uint8_t value) {
+    uint8_t carry = ((op == 1 || op == 3) && get_flag(FLAG_C)) ? 1 : 0;
+
+    switch (op) {
+        case 0: // ADD
+        case 1: // ADC
+        {
+            uint16_t result = cpu.a + value + carry;
+            cpu.f = ((result & 0xFF) == 0 ? FLAG_Z : 0) |
+                    (result > 0xFF ? FLAG_C : 0) |
+                    ((cpu.a & 0x0F) + (value & 0x0F) + carry > 0x0F ? FLAG_H : 0);
+            cpu.a = result & 0xFF;
             break;
-            
-        case 0x01: // LD BC, d16
-            set_bc(cpu_fetch_word());
+        }
+
+        case 2: // SUB
+        case 3: // SBC
+        case 7: // CP
+        {
+            int result = cpu.a - value - carry;
+            cpu.f = FLAG_N | ((result & 0xFF) == 0 ? FLAG_Z : 0) |
+                    (result < 0 ? FLAG_C : 0) |
+                    ((cpu.a & 0x0F) - (value & 0x0F) - carry < 0 ? FLAG_H : 0);
+            if (op != 7) {
+                cpu.a = result & 0xFF;
+            }
             break;
-            
-        case 0x02: // LD (BC), A
-            memory_write(get_bc(), cpu.a);
+        }
+
+        case 4: // AND
+            cpu.a &= value;
+            cpu.f = (cpu.a == 0 ? FLAG_Z : 0) | FLAG_H;
             break;
-            
-        case 0x03: // INC BC
-            set_bc(get_bc() + 1);
+
+        case 5: // XOR
+            cpu.a ^= value;
+            cpu.f = (cpu.a == 0) ? FLAG_Z : 0;
             break;
-            
-        case 0x04: // INC B
-            cpu.b++;
-            cpu.f = (cpu.f & FLAG_C) | (cpu.b == 0 ? FLAG_Z : 0) | ((cpu.b & 0x0F) == 0 ? FLAG_H : 0);
+
+        case 6: // OR
+            cpu.a |= value;
+            cpu.f = (cpu.a == 0) ? FLAG_Z : 0;
             break;
-            
-        case 0x05: // DEC B
-            cpu.f = (cpu.f & FLAG_C) | FLAG_N | ((cpu.b & 0x0F) == 0 ? FLAG_H : 0);
-            cpu.b--;
-            if (cpu.b == 0) cpu.f |= FLAG_Z;
+    }
+}
+
+static void add_hl(uint16_t value) {
+    uint32_t result = cpu.hl + value;
+    cpu.f = (cpu.f & FLAG_Z) | (result > 0xFFFF ? FLAG_C : 0) |
+            ((cpu.hl & 0x0FFF) + (value & 0x0FFF) > 0x0FFF ? FLAG_H : 0);
+    cpu.hl = result & 0xFFFF;
+}
+
+// SP plus a signed immediate, shared by ADD SP, r8 and LD HL, SP+r8.
+// H and C come from the unsigned add of the low byte.
+static uint16_t add_sp_offset() {
+    uint8_t offset = cpu_fetch_byte();
+    cpu.f = ((cpu.sp & 0x0F) + (offset & 0x0F) > 0x0F ? FLAG_H : 0) |
+            ((cpu.sp & 0xFF) + offset > 0xFF ? FLAG_C : 0);
+    return cpu.sp + (int8_t)offset;
+}
+
+// Rotates and shifts: RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL
+static uint8_t shift_op(uint8_t op, uint8_t value) {
+    uint8_t carry_in = get_flag(FLAG_C) ? 1 : 0;
+    uint8_t carry_out;
+
+    switch (op) {
+        case 0: carry_out = value >> 7; value = (value << 1) | carry_out; break;
+        case 1: carry_out = value & 0x01; value = (value >> 1) | (carry_out << 7); break;
+        case 2: carry_out = value >> 7; value = (value << 1) | carry_in; break;
+        case 3: carry_out = value & 0x01; value = (value >> 1) | (carry_in << 7); break;
+        case 4: carry_out = value >> 7; value <<= 1; break;
+        case 5: carry_out = value & 0x01; value = (value >> 1) | (value & 0x80); break;
+        case 6: carry_out = 0; value = (value << 4) | (value >> 4); break;
+        default: carry_out = value & 0x01; value >>= 1; break;
+    }
+
+    cpu.f = (value == 0 ? FLAG_Z : 0) | (carry_out ? FLAG_C : 0);
+    return value;
+}
+
+// CB prefix instructions decode as operation (bits 6-7), bit or shift
+// type (bits 3-5) and operand (bits 0-2)
+static uint8_t cpu_execute_cb() {
+    uint8_t cb_opcode = cpu_fetch_byte();
+    uint8_t bit = (cb_opcode >> 3) & 0x07;
+    uint8_t reg = cb_opcode & 0x07;
+    uint8_t value = read_r8(reg);
+
+    switch (cb_opcode >> 6) {
+        case 0: // Rotates and shifts
+            value = shift_op(bit, value);
             break;
-            
-        case 0x06: // LD B, d8
-            cpu.b = cpu_fetch_byte();
+
+        case 1: // BIT b, r
+            cpu.f = (cpu.f & FLAG_C) | FLAG_H | ((value & (1 << bit)) ? 0 : FLAG_Z);
+            return reg == 6 ? 12 : 8;
+
+        case 2: // RES b, r
+            value &= ~(1 << bit);
             break;
-            
-        case 0x07: // RLCA (Rotate Left Circular Accumulator)
-            cpu.f = (cpu.a & 0x80) ? FLAG_C : 0;
-            cpu.a = (cpu.a << 1) | ((cpu.f & FLAG_C) ? 0x01 : 0);
+
+        case 3: // SET b, r
+            value |= 1 << bit;
             break;
-            
-        case 0x08: // LD (a16), SP
-        {
-            uint16_t addr = cpu_fetch_word();
-            memory_write(addr, cpu.sp & 0xFF);
-            memory_write(addr + 1, cpu.sp >> 8);
+    }
+
+    write_r8(reg, value);
+    return reg == 6 ? 16 : 8;
+}
+
+// Dispatches the highest priority pending interrupt, if enabled.
+// Returns the cycles spent, or 0 if no interrupt was taken.
+static uint8_t cpu_service_interrupts() {
+    uint8_t pending = memory_read(IE_REG) & memory_read(IF_REG) & 0x1F;
+    if (!pending) {
+        return 0;
+    }
+
+    // A pending interrupt ends HALT even when interrupts are disabled
+    cpu.halted = false;
+    if (!cpu.interrupts_enabled) {
+        return 0;
+    }
+
+    for (uint8_t n = 0; n < 5; n++) {
+        if (pending & (1 << n)) {
+            memory_write(IF_REG, memory_read(IF_REG) & ~(1 << n));
+            cpu.interrupts_enabled = false;
+            push_word(cpu.pc);
+            cpu.pc = 0x0040 + n * 8;
             break;
         }
-        
-        case 0x09: // ADD HL, BC
-        {
-            uint32_t result = get_hl() + get_bc();
-            cpu.f = (cpu.f & FLAG_Z) | ((result > 0xFFFF) ? FLAG_C : 0) | 
-                   (((get_hl() & 0x0FFF) + (get_bc() & 0x0FFF)) > 0x0FFF ? FLAG_H : 0);
-            set_hl(result & 0xFFFF);
+    }
+    return 20;
+}
+
+uint8_t cpu_execute_instruction() {
+    if (cpu.locked) {
+        return 4; // Illegal opcode hung the CPU
+    }
+
+    uint8_t cycles = cpu_service_interrupts();
+    if (cycles) {
+        return cycles;
+    }
+
+    if (cpu.halted) {
+        return 4; // CPU is halted, wait for an interrupt
+    }
+
+    // EI takes effect after the instruction that follows it
+    bool enable_interrupts = cpu.ei_pending;
+    cpu.ei_pending = false;
+
+    uint8_t opcode = cpu_fetch_byte();
+    cycles = opcode_cycles[opcode];
+
+    if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76) {
+        // LD r, r'
+        write_r8((opcode >> 3) & 0x07, read_r8(opcode & 0x07));
+    } else if (opcode >= 0x80 && opcode < 0xC0) {
+        // ALU A, r
+        alu_op((opcode >> 3) & 0x07, read_r8(opcode & 0x07));
+    } else switch (opcode) {
+        case 0x00: // NOP
             break;
-        }
-        
-        case 0x0A: // LD A, (BC)
-            cpu.a = memory_read(get_bc());
+
+        case 0x01: case 0x11: case 0x21: case 0x31: // LD rr, d16
+            write_r16(opcode >> 4, cpu_fetch_word());
             break;
-            
-        case 0x0B: // DEC BC
-            set_bc(get_bc() - 1);
+
+        case 0x02: // LD (BC), A
+            memory_write(cpu.bc, cpu.a);
             break;
-            
-        case 0x0C: // INC C
-            cpu.c++;
-            cpu.f = (cpu.f & FLAG_C) | (cpu.c == 0 ? FLAG_Z : 0) | ((cpu.c & 0x0F) == 0 ? FLAG_H : 0);
+
+        case 0x12: // LD (DE), A
+            memory_write(cpu.de, cpu.a);
             break;
-            
-        case 0x0D: // DEC C
-            cpu.f = (cpu.f & FLAG_C) | FLAG_N | ((cpu.c & 0x0F) == 0 ? FLAG_H : 0);
-            cpu.c--;
-            if (cpu.c == 0) cpu.f |= FLAG_Z;
+
+        case 0x22: // LD (HL+), A
+            memory_write(cpu.hl++, cpu.a);
             break;
-            
-        case 0x0E: // LD C, d8
-            cpu.c = cpu_fetch_byte();
+
+        case 0x32: // LD (HL-), A
+            memory_write(cpu.hl--, cpu.a);
             break;
-            
-        case 0x0F: // RRCA (Rotate Right Circular Accumulator)
-            cpu.f = (cpu.a & 0x01) ? FLAG_C : 0;
-            cpu.a = (cpu.a >> 1) | ((cpu.f & FLAG_C) ? 0x80 : 0);
+
+        case 0x0A: // LD A, (BC)
+            cpu.a = memory_read(cpu.bc);
             break;
-            
-        case 0x11: // LD DE, d16
-            set_de(cpu_fetch_word());
+
+        case 0x1A: // LD A, (DE)
+            cpu.a = memory_read(cpu.de);
             break;
-            
-        case 0x12: // LD (DE), A
-            memory_write(get_de(), cpu.a);
+
+        case 0x2A: // LD A, (HL+)
+            cpu.a = memory_read(cpu.hl++);
             break;
-            
-        case 0x13: // INC DE
-            set_de(get_de() + 1);
+
+        case 0x3A: // LD A, (HL-)
+            cpu.a = memory_read(cpu.hl--);
             break;
-            
-        case 0x14: // INC D
-            cpu.d++;
-            cpu.f = (cpu.f & FLAG_C) | (cpu.d == 0 ? FLAG_Z : 0) | ((cpu.d & 0x0F) == 0 ? FLAG_H : 0);
+
+        case 0x03: case 0x13: case 0x23: case 0x33: // INC rr
+            write_r16(opcode >> 4, read_r16(opcode >> 4) + 1);
             break;
-            
-        case 0x15: // DEC D
-            cpu.f = (cpu.f & FLAG_C) | FLAG_N | ((cpu.d & 0x0F) == 0 ? FLAG_H : 0);
-            cpu.d--;
-            if (cpu.d == 0) cpu.f |= FLAG_Z;
+
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B: // DEC rr
+            write_r16(opcode >> 4, read_r16(opcode >> 4) - 1);
             break;
-            
-        case 0x16: // LD D, d8
-            cpu.d = cpu_fetch_byte();
+
+        case 0x09: case 0x19: case 0x29: case 0x39: // ADD HL, rr
+            add_hl(read_r16(opcode >> 4));
             break;
-            
-        case 0x19: // ADD HL, DE
+
+        case 0x04: case 0x0C: case 0x14: case 0x1C: // INC r
+        case 0x24: case 0x2C: case 0x34: case 0x3C:
         {
-            uint32_t result = get_hl() + get_de();
-            cpu.f = (cpu.f & FLAG_Z) | ((result > 0xFFFF) ? FLAG_C : 0) | 
-                   (((get_hl() & 0x0FFF) + (get_de() & 0x0FFF)) > 0x0FFF ? FLAG_H : 0);
-            set_hl(result & 0xFFFF);
+            uint8_t reg = (opcode >> 3) & 0x07;
+            write_r8(reg, alu_inc(read_r8(reg)));
             break;
         }
-        
-        case 0x1A: // LD A, (DE)
-            cpu.a = memory_read(get_de());
-            break;
-            
-        case 0x1B: // DEC DE
-            set_de(get_de() - 1);
-            break;
-            
-        case 0x1C: // INC E
-            cpu.e++;
-            cpu.f = (cpu.f & FLAG_C) | (cpu.e == 0 ? FLAG_Z : 0) | ((cpu.e & 0x0F) == 0 ? FLAG_H : 0);
+
+        case 0x05: case 0x0D: case 0x15: case 0x1D: // DEC r
+        case 0x25: case 0x2D: case 0x35: case 0x3D:
+        {
+            uint8_t reg = (opcode >> 3) & 0x07;
+            write_r8(reg, alu_dec(read_r8(reg)));
             break;
-            
-        case 0x1D: // DEC E
-            cpu.f = (cpu.f & FLAG_C) | FLAG_N | ((cpu.e & 0x0F) == 0 ? FLAG_H : 0);
-            cpu.e--;
-            if (cpu.e == 0) cpu.f |= FLAG_Z;
+        }
+
+        case 0x06: case 0x0E: case 0x16: case 0x1E: // LD r, d8
+        case 0x26: case 0x2E: case 0x36: case 0x3E:
+            write_r8((opcode >> 3) & 0x07, cpu_fetch_byte());
             break;
-            
-        case 0x1E: // LD E, d8
-            cpu.e = cpu_fetch_byte();
+
+        case 0x07: case 0x0F: case 0x17: case 0x1F: // RLCA, RRCA, RLA, RRA
+            cpu.a = shift_op(opcode >> 3, cpu.a);
+            cpu.f &= ~FLAG_Z;
             break;
-            
-        case 0x17: // RLA (Rotate Left through Carry)
+
+        case 0x08: // LD (a16), SP
         {
-            uint8_t old_carry = get_flag(FLAG_C) ? 1 : 0;
-            cpu.f = (cpu.a & 0x80) ? FLAG_C : 0;
-            cpu.a = (cpu.a << 1) | old_carry;
+            uint16_t addr = cpu_fetch_word();
+            memory_write(addr, cpu.sp & 0xFF);
+            memory_write(addr + 1, cpu.sp >> 8);
             break;
         }
-        
+
+        case 0x10: // STOP
+            cpu_fetch_byte();
+            cpu.halted = true;
+            break;
+
         case 0x18: // JR r8 (relative jump)
         {
             int8_t offset = (int8_t)cpu_fetch_byte();
             cpu.pc += offset;
             break;
         }
-        
-        case 0x1F: // RRA (Rotate Right through Carry)
-        {
-            uint8_t old_carry = get_flag(FLAG_C) ? 0x80 : 0;
-            cpu.f = (cpu.a & 0x01) ? FLAG_C : 0;
-            cpu.a = (cpu.a >> 1) | old_carry;
-            break;
-        }
-        
-        case 0x20: // JR NZ, r8
+
+        case 0x20: case 0x28: case 0x30: case 0x38: // JR cc, r8
         {
             int8_t offset = (int8_t)cpu_fetch_byte();
-            if (!get_flag(FLAG_Z)) {
+            if (check_condition((opcode >> 3) & 0x03)) {
                 cpu.pc += offset;
+                cycles += 4;
             }
             break;
         }
-        
-        case 0x21: // LD HL, d16
-            set_hl(cpu_fetch_word());
-            break;
-            
-        case 0x22: // LD (HL+), A
-            memory_write(get_hl(), cpu.a);
-            set_hl(get_hl() + 1);
-            break;
-            
-        case 0x23: // INC HL
-            set_hl(get_hl() + 1);
-            break;
-            
-        case 0x24: // INC H
-            cpu.h++;
-            cpu.f = (cpu.f & FLAG_C) | (cpu.h == 0 ? FLAG_Z : 0) | ((cpu.h & 0x0F) == 0 ? FLAG_H : 0);
-            break;
-            
-        case 0x25: // DEC H
-            cpu.f = (cpu.f & FLAG_C) | FLAG_N | ((cpu.h & 0x0F) == 0 ? FLAG_H : 0);
-            cpu.h--;
-            if (cpu.h == 0) cpu.f |= FLAG_Z;
-            break;
-            
-        case 0x26: // LD H, d8
-            cpu.h = cpu_fetch_byte();
-            break;
-            
+
         case 0x27: // DAA (Decimal Adjust Accumulator)
         {
-            uint8_t correction = 0;
-            bool set_carry = false;
-            
-            if (get_flag(FLAG_H) || (!get_flag(FLAG_N) && (cpu.a & 0x0F) > 9)) {
-                correction |= 0x06;
-            }
-            
-            if (get_flag(FLAG_C) || (!get_flag(FLAG_N) && cpu.a > 0x99)) {
-                correction |= 0x60;
-                set_carry = true;
-            }
-            
-            if (get_flag(FLAG_N)) {
-                cpu.a -= correction;
+            uint8_t carry = cpu.f & FLAG_C;
+
+            if (!get_flag(FLAG_N)) {
+                if (carry || cpu.a > 0x99) {
+                    cpu.a += 0x60;
+                    carry = FLAG_C;
+                }
+                if (get_flag(FLAG_H) || (cpu.a & 0x0F) > 0x09) {
+                    cpu.a += 0x06;
+                }
             } else {
-                cpu.a += correction;
+                if (carry) cpu.a -= 0x60;
+                if (get_flag(FLAG_H)) cpu.a -= 0x06;
             }
-            
-            cpu.f = (cpu.f & FLAG_N) | (cpu.a == 0 ? FLAG_Z : 0);
-            if (set_carry) cpu.f |= FLAG_C;
-            break;
-        }
-        
-        case 0x28: // JR Z, r8
-        {
-            int8_t offset = (int8_t)cpu_fetch_byte();
-            if (get_flag(FLAG_Z)) {
-                cpu.pc += offset;
-            }
-            break;
-        }
-        
-        case 0x29: // ADD HL, HL
-        {
-            uint32_t result = get_hl() + get_hl();
-            cpu.f = (cpu.f & FLAG_Z) | ((result > 0xFFFF) ? FLAG_C : 0) | 
-                   (((get_hl() & 0x0FFF) + (get_hl() & 0x0FFF)) > 0x0FFF ? FLAG_H : 0);
-            set_hl(result & 0xFFFF);
+
+            cpu.f = (cpu.f & FLAG_N) | (cpu.a == 0 ? FLAG_Z : 0) | carry;
             break;
         }
-        
-        case 0x2A: // LD A, (HL+)
-            cpu.a = memory_read(get_hl());
-            set_hl(get_hl() + 1);
-            break;
-            
-        case 0x2C: // INC L
-            cpu.l++;
-            cpu.f = (cpu.f & FLAG_C) | (cpu.l == 0 ? FLAG_Z : 0) | ((cpu.l & 0x0F) == 0 ? FLAG_H : 0);
-            break;
-            
+
         case 0x2F: // CPL (Complement A)
             cpu.a = ~cpu.a;
             cpu.f |= FLAG_N | FLAG_H;
             break;
-        
-        case 0x31: // LD SP, d16
-            cpu.sp = cpu_fetch_word();
-            break;
-            
-        case 0x32: // LD (HL-), A
-            memory_write(get_hl(), cpu.a);
-            set_hl(get_hl() - 1);
-            break;
-            
-        case 0x35: // DEC (HL)
-        {
-            uint8_t value = memory_read(get_hl());
-            cpu.f = (cpu.f & FLAG_C) | FLAG_N | ((value & 0x0F) == 0 ? FLAG_H : 0);
-            value--;
-            if (value == 0) cpu.f |= FLAG_Z;
-            memory_write(get_hl(), value);
-            break;
-        }
-        
-        case 0x36: // LD (HL), d8
-        {
-            uint8_t value = cpu_fetch_byte();
-            memory_write(get_hl(), value);
-            break;
-        }
-        
+
         case 0x37: // SCF (Set Carry Flag)
             cpu.f = (cpu.f & FLAG_Z) | FLAG_C;
             break;
-            
-        case 0x3D: // DEC A
-            cpu.f = (cpu.f & FLAG_C) | FLAG_N | ((cpu.a & 0x0F) == 0 ? FLAG_H : 0);
-            cpu.a--;
-            if (cpu.a == 0) cpu.f |= FLAG_Z;
-            break;
-            
-        case 0x3E: // LD A, d8
-            cpu.a = cpu_fetch_byte();
-            break;
-            
-        case 0x44: // LD B, H
-            cpu.b = cpu.h;
-            break;
-            
-        case 0x47: // LD B, A
-            cpu.b = cpu.a;
-            break;
-            
-        case 0x4F: // LD C, A
-            cpu.c = cpu.a;
-            break;
-            
-        case 0x56: // LD D, (HL)
-            cpu.d = memory_read(get_hl());
-            break;
-            
-        case 0x57: // LD D, A
-            cpu.d = cpu.a;
-            break;
-            
-        case 0x5E: // LD E, (HL)
-            cpu.e = memory_read(get_hl());
-            break;
-            
-        case 0x5F: // LD E, A
-            cpu.e = cpu.a;
-            break;
-            
-        case 0x67: // LD H, A
-            cpu.h = cpu.a;
-            break;
-            
-        case 0x6F: // LD L, A
-            cpu.l = cpu.a;
-            break;
-            
-        case 0x77: // LD (HL), A
-            memory_write(get_hl(), cpu.a);
-            break;
-            
-        case 0x78: // LD A, B
-            cpu.a = cpu.b;
-            break;
-            
-        case 0x79: // LD A, C
-            cpu.a = cpu.c;
-            break;
-            
-        case 0x7A: // LD A, D
-            cpu.a = cpu.d;
-            break;
-            
-        case 0x7B: // LD A, E
-            cpu.a = cpu.e;
-            break;
-            
-        case 0x7C: // LD A, H
-            cpu.a = cpu.h;
-            break;
-            
-        case 0x7D: // LD A, L
-            cpu.a = cpu.l;
-            break;
-            
-        case 0x7E: // LD A, (HL)
-            cpu.a = memory_read(get_hl());
-            break;
-            
-        case 0x7F: // LD A, A (essentially NOP)
-            break;
-            
-        case 0x87: // ADD A, A
-        {
-            uint16_t result = cpu.a + cpu.a;
-            cpu.f = ((result & 0xFF) == 0) ? FLAG_Z : 0;
-            cpu.f |= (result > 0xFF) ? FLAG_C : 0;
-            cpu.f |= ((cpu.a & 0x0F) + (cpu.a & 0x0F) > 0x0F) ? FLAG_H : 0;
-            cpu.a = result & 0xFF;
-            break;
-        }
-        
-        case 0xA1: // AND C
-            cpu.a &= cpu.c;
-            cpu.f = (cpu.a == 0 ? FLAG_Z : 0) | FLAG_H;
-            break;
-            
-        case 0xA7: // AND A
-            cpu.f = (cpu.a == 0 ? FLAG_Z : 0) | FLAG_H;
-            break;
-            
-        case 0xA9: // XOR C
-            cpu.a ^= cpu.c;
-            cpu.f = (cpu.a == 0) ? FLAG_Z : 0;
-            break;
-            
-        case 0xAE: // XOR (HL)
-            cpu.a ^= memory_read(get_hl());
-            cpu.f = (cpu.a == 0) ? FLAG_Z : 0;
-            break;
-            
-        case 0xAF: // XOR A
-            cpu.a = 0;
-            cpu.f = FLAG_Z;
-            break;
-            
-        case 0xB0: // OR B
-            cpu.a |= cpu.b;
-            cpu.f = (cpu.a == 0) ? FLAG_Z : 0;
-            break;
-            
-        case 0xB1: // OR C
-            cpu.a |= cpu.c;
-            cpu.f = (cpu.a == 0) ? FLAG_Z : 0;
-            break;
-            
-        case 0xB7: // OR A
-            cpu.f = (cpu.a == 0) ? FLAG_Z : 0;
-            break;
-            
-        case 0xBE: // CP (HL)
-        {
-            uint8_t value = memory_read(get_hl());
-            uint8_t result = cpu.a - value;
-            cpu.f = FLAG_N | (result == 0 ? FLAG_Z : 0) | 
-                   ((cpu.a & 0x0F) < (value & 0x0F) ? FLAG_H : 0) |
-                   (cpu.a < value ? FLAG_C : 0);
-            break;
-        }
-            
-        case 0xC0: // RET NZ
-            if (!get_flag(FLAG_Z)) {
-                uint8_t low = memory_read(cpu.sp++);
-                uint8_t high = memory_read(cpu.sp++);
-                cpu.pc = (high << 8) | low;
-            }
-            break;
-            
-        case 0xC1: // POP BC
-        {
-            uint8_t low = memory_read(cpu.sp++);
-            uint8_t high = memory_read(cpu.sp++);
-            set_bc((high << 8) | low);
-            break;
-        }
-        
-        case 0xC2: // JP NZ, a16
-        {
-            uint16_t addr = cpu_fetch_word();
-            if (!get_flag(FLAG_Z)) {
-                cpu.pc = addr;
-            }
-            break;
-        }
-        
-        case 0xC3: // JP a16
-            cpu.pc = cpu_fetch_word();
-            break;
-            
-        case 0xC5: // PUSH BC
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.b);
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.c);
-            break;
-            
-        case 0xC6: // ADD A, d8
-        {
-            uint8_t value = cpu_fetch_byte();
-            uint16_t result = cpu.a + value;
-            
-            cpu.f = ((result & 0xFF) == 0) ? FLAG_Z : 0;
-            cpu.f |= (result > 0xFF) ? FLAG_C : 0;
-            cpu.f |= ((cpu.a & 0x0F) + (value & 0x0F) > 0x0F) ? FLAG_H : 0;
-            
-            cpu.a = result & 0xFF;
+
+        case 0x3F: // CCF (Complement Carry Flag)
+            cpu.f = (cpu.f & (FLAG_Z | FLAG_C)) ^ FLAG_C;
             break;
-        }
-        
-        case 0xC8: // RET Z
-            if (get_flag(FLAG_Z)) {
-                uint8_t low = memory_read(cpu.sp++);
-                uint8_t high = memory_read(cpu.sp++);
-                cpu.pc = (high << 8) | low;
-            }
+
+        case 0x76: // HALT
+            cpu.halted = true;
             break;
-            
-        case 0xCA: // JP Z, a16
-        {
-            uint16_t addr = cpu_fetch_word();
-            if (get_flag(FLAG_Z)) {
-                cpu.pc = addr;
+
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8: // RET cc
+            if (check_condition((opcode >> 3) & 0x03)) {
+                cpu.pc = pop_word();
+                cycles += 12;
             }
             break;
-        }
-        
-        case 0xCC: // CALL Z, a16
+
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1: // POP rr
         {
-            uint16_t addr = cpu_fetch_word();
-            if (get_flag(FLAG_Z)) {
-                cpu.sp--;
-                memory_write(cpu.sp, cpu.pc >> 8);
-                cpu.sp--;
-                memory_write(cpu.sp, cpu.pc & 0xFF);
-                cpu.pc = addr;
+            uint8_t reg = (opcode >> 4) & 0x03;
+            uint16_t value = pop_word();
+            if (reg == 3) {
+                cpu.af = value & 0xFFF0; // Low nibble of F is always zero
+            } else {
+                write_r16(reg, value);
             }
             break;
         }
-        
-        case 0xD0: // RET NC
-            if (!get_flag(FLAG_C)) {
-                uint8_t low = memory_read(cpu.sp++);
-                uint8_t high = memory_read(cpu.sp++);
-                cpu.pc = (high << 8) | low;
-            }
-            break;
-            
-        case 0xD1: // POP DE
-        {
-            uint8_t low = memory_read(cpu.sp++);
-            uint8_t high = memory_read(cpu.sp++);
-            set_de((high << 8) | low);
-            break;
-        }
-        
-        case 0xD2: // JP NC, a16
+
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5: // PUSH rr
         {
-            uint16_t addr = cpu_fetch_word();
-            if (!get_flag(FLAG_C)) {
-                cpu.pc = addr;
-            }
+            uint8_t reg = (opcode >> 4) & 0x03;
+            push_word(reg == 3 ? cpu.af : read_r16(reg));
             break;
         }
-        
-        case 0xD4: // CALL NC, a16
+
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA: // JP cc, a16
         {
             uint16_t addr = cpu_fetch_word();
-            if (!get_flag(FLAG_C)) {
-                cpu.sp--;
-                memory_write(cpu.sp, cpu.pc >> 8);
-                cpu.sp--;
-                memory_write(cpu.sp, cpu.pc & 0xFF);
+            if (check_condition((opcode >> 3) & 0x03)) {
                 cpu.pc = addr;
+                cycles += 4;
             }
             break;
         }
-        
-        case 0xD6: // SUB d8
-        {
-            uint8_t value = cpu_fetch_byte();
-            uint8_t result = cpu.a - value;
-            
-            cpu.f = FLAG_N | (result == 0 ? FLAG_Z : 0) | 
-                   ((cpu.a & 0x0F) < (value & 0x0F) ? FLAG_H : 0) |
-                   (cpu.a < value ? FLAG_C : 0);
-            
-            cpu.a = result;
-            break;
-        }
-        
-        case 0xD8: // RET C
-            if (get_flag(FLAG_C)) {
-                uint8_t low = memory_read(cpu.sp++);
-                uint8_t high = memory_read(cpu.sp++);
-                cpu.pc = (high << 8) | low;
-            }
+
+        case 0xC3: // JP a16
+            cpu.pc = cpu_fetch_word();
             break;
-            
-        case 0xDA: // JP C, a16
+
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC: // CALL cc, a16
         {
             uint16_t addr = cpu_fetch_word();
-            if (get_flag(FLAG_C)) {
+            if (check_condition((opcode >> 3) & 0x03)) {
+                push_word(cpu.pc);
                 cpu.pc = addr;
+                cycles += 12;
             }
             break;
         }
-        
-        case 0xDC: // CALL C, a16
-        {
-            uint16_t addr = cpu_fetch_word();
-            if (get_flag(FLAG_C)) {
-                cpu.sp--;
-                memory_write(cpu.sp, cpu.pc >> 8);
-                cpu.sp--;
-                memory_write(cpu.sp, cpu.pc & 0xFF);
-                cpu.pc = addr;
-            }
+
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: // ALU A, d8
+        case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+            alu_op((opcode >> 3) & 0x07, cpu_fetch_byte());
             break;
-        }
-        
-        case 0xDE: // SBC A, d8
-        {
-            uint8_t value = cpu_fetch_byte();
-            uint8_t carry = get_flag(FLAG_C) ? 1 : 0;
-            uint8_t result = cpu.a - value - carry;
-            
-            cpu.f = FLAG_N | (result == 0 ? FLAG_Z : 0) | 
-                   ((cpu.a & 0x0F) < ((value & 0x0F) + carry) ? FLAG_H : 0) |
-                   (cpu.a < (value + carry) ? FLAG_C : 0);
-            
-            cpu.a = result;
+
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: // RST n
+        case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            push_word(cpu.pc);
+            cpu.pc = opcode & 0x38;
             break;
-        }
-            
+
         case 0xC9: // RET
-        {
-            // Pop return address from stack
-            uint8_t low = memory_read(cpu.sp++);
-            uint8_t high = memory_read(cpu.sp++);
-            cpu.pc = (high << 8) | low;
+            cpu.pc = pop_word();
             break;
-        }
-            
+
+        case 0xD9: // RETI
+            cpu.pc = pop_word();
+            cpu.interrupts_enabled = true;
+            break;
+
         case 0xCB: // CB prefix instructions
-        {
-            uint8_t cb_opcode = cpu_fetch_byte();
-            switch (cb_opcode) {
-                // RLC operations (0x00-0x07)
-                case 0x07: // RLC A
-                    cpu.f = (cpu.a & 0x80) ? FLAG_C : 0;
-                    cpu.a = (cpu.a << 1) | ((cpu.f & FLAG_C) ? 0x01 : 0);
-                    cpu.f |= (cpu.a == 0) ? FLAG_Z : 0;
-                    break;
-                    
-                // RRC operations (0x08-0x0F)
-                case 0x0F: // RRC A
-                    cpu.f = (cpu.a & 0x01) ? FLAG_C : 0;
-                    cpu.a = (cpu.a >> 1) | ((cpu.f & FLAG_C) ? 0x80 : 0);
-                    cpu.f |= (cpu.a == 0) ? FLAG_Z : 0;
-                    break;
-                    
-                // RL operations (0x10-0x17)
-                case 0x17: // RL A
-                {
-                    uint8_t old_carry = get_flag(FLAG_C) ? 1 : 0;
-                    cpu.f = (cpu.a & 0x80) ? FLAG_C : 0;
-                    cpu.a = (cpu.a << 1) | old_carry;
-                    cpu.f |= (cpu.a == 0) ? FLAG_Z : 0;
-                    break;
-                }
-                    
-                // RR operations (0x18-0x1F)
-                case 0x1F: // RR A
-                {
-                    uint8_t old_carry = get_flag(FLAG_C) ? 0x80 : 0;
-                    cpu.f = (cpu.a & 0x01) ? FLAG_C : 0;
-                    cpu.a = (cpu.a >> 1) | old_carry;
-                    cpu.f |= (cpu.a == 0) ? FLAG_Z : 0;
-                    break;
-                }
-                    
-                // SLA operations (0x20-0x27)
-                case 0x27: // SLA A
-                    cpu.f = (cpu.a & 0x80) ? FLAG_C : 0;
-                    cpu.a <<= 1;
-                    cpu.f |= (cpu.a == 0) ? FLAG_Z : 0;
-                    break;
-                    
-                // SRA operations (0x28-0x2F)
-                case 0x2F: // SRA A
-                    cpu.f = (cpu.a & 0x01) ? FLAG_C : 0;
-                    cpu.a = (cpu.a >> 1) | (cpu.a & 0x80);
-                    cpu.f |= (cpu.a == 0) ? FLAG_Z : 0;
-                    break;
-                    
-                // SWAP operations (0x30-0x37)
-                case 0x37: // SWAP A
-                    cpu.a = ((cpu.a & 0x0F) << 4) | ((cpu.a & 0xF0) >> 4);
-                    cpu.f = (cpu.a == 0) ? FLAG_Z : 0;
-                    break;
-                    
-                // SRL operations (0x38-0x3F)
-                case 0x3F: // SRL A
-                    cpu.f = (cpu.a & 0x01) ? FLAG_C : 0;
-                    cpu.a >>= 1;
-                    cpu.f |= (cpu.a == 0) ? FLAG_Z : 0;
-                    break;
-                    
-                // BIT operations (0x40-0x7F)
-                case 0x7C: // BIT 7, H
-                    cpu.f = (cpu.f & FLAG_C) | FLAG_H | ((cpu.h & 0x80) ? 0 : FLAG_Z);
-                    break;
-                    
-                case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47: // BIT 0
-                case 0x48: case 0x49: case 0x4A: case 0x4B: case 0x4C: case 0x4D: case 0x4E: case 0x4F: // BIT 1
-                case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57: // BIT 2
-                case 0x58: case 0x59: case 0x5A: case 0x5B: case 0x5C: case 0x5D: case 0x5E: case 0x5F: // BIT 3
-                case 0x60: case 0x61: case 0x62: case 0x63: case 0x64: case 0x65: case 0x66: case 0x67: // BIT 4
-                case 0x68: case 0x69: case 0x6A: case 0x6B: case 0x6C: case 0x6D: case 0x6E: case 0x6F: // BIT 5
-                case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77: // BIT 6
-                case 0x78: case 0x79: case 0x7A: case 0x7B: case 0x7D: case 0x7E: case 0x7F: // BIT 7
-                {
-                    uint8_t bit = (cb_opcode - 0x40) / 8;
-                    uint8_t reg = (cb_opcode - 0x40) % 8;
-                    uint8_t value;
-                    
-                    switch (reg) {
-                        case 0: value = cpu.b; break;
-                        case 1: value = cpu.c; break;
-                        case 2: value = cpu.d; break;
-                        case 3: value = cpu.e; break;
-                        case 4: value = cpu.h; break;
-                        case 5: value = cpu.l; break;
-                        case 6: value = memory_read(get_hl()); break;
-                        case 7: value = cpu.a; break;
-                        default: value = 0; break;
-                    }
-                    
-                    cpu.f = (cpu.f & FLAG_C) | FLAG_H | ((value & (1 << bit)) ? 0 : FLAG_Z);
-                    break;
-                }
-                
-                // RES operations (0x80-0xBF)
-                case 0x87: // RES 0, A
-                    cpu.a &= ~0x01;
-                    break;
-                    
-                // SET operations (0xC0-0xFF)
-                case 0xC7: // SET 0, A
-                    cpu.a |= 0x01;
-                    break;
-                    
-                default:
-                    printf("Unimplemented CB opcode: 0x%02X at PC: 0x%04X\n", cb_opcode, cpu.pc - 2);
-                    break;
-            }
+            cycles = cpu_execute_cb();
             break;
-        }
-        
+
         case 0xCD: // CALL a16
         {
             uint16_t addr = cpu_fetch_word();
-            // Push return address onto stack
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.pc >> 8);
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.pc & 0xFF);
+            push_word(cpu.pc);
             cpu.pc = addr;
             break;
         }
-        
-        case 0xCE: // ADC A, d8
-        {
-            uint8_t value = cpu_fetch_byte();
-            uint8_t carry = get_flag(FLAG_C) ? 1 : 0;
-            uint16_t result = cpu.a + value + carry;
-            
-            cpu.f = (result & 0xFF) == 0 ? FLAG_Z : 0;
-            cpu.f |= (result > 0xFF) ? FLAG_C : 0;
-            cpu.f |= ((cpu.a & 0x0F) + (value & 0x0F) + carry > 0x0F) ? FLAG_H : 0;
-            
-            cpu.a = result & 0xFF;
-            break;
-        }
-        
-        case 0xD5: // PUSH DE
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.d);
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.e);
-            break;
-            
+
         case 0xE0: // LDH (a8), A
-        {
-            uint8_t addr = cpu_fetch_byte();
-            memory_write(0xFF00 + addr, cpu.a);
+            memory_write(0xFF00 + cpu_fetch_byte(), cpu.a);
             break;
-        }
-        
-        case 0xE1: // POP HL
-        {
-            uint8_t low = memory_read(cpu.sp++);
-            uint8_t high = memory_read(cpu.sp++);
-            set_hl((high << 8) | low);
+
+        case 0xF0: // LDH A, (a8)
+            cpu.a = memory_read(0xFF00 + cpu_fetch_byte());
             break;
-        }
-        
+
         case 0xE2: // LD (C), A
             memory_write(0xFF00 + cpu.c, cpu.a);
             break;
-            
-        case 0xE5: // PUSH HL
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.h);
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.l);
+
+        case 0xF2: // LD A, (C)
+            cpu.a = memory_read(0xFF00 + cpu.c);
             break;
-        
-        case 0xE6: // AND d8
-        {
-            uint8_t value = cpu_fetch_byte();
-            cpu.a &= value;
-            cpu.f = (cpu.a == 0 ? FLAG_Z : 0) | FLAG_H;
+
+        case 0xE8: // ADD SP, r8
+            cpu.sp = add_sp_offset();
             break;
-        }
-        
+
+        case 0xF8: // LD HL, SP+r8
+            cpu.hl = add_sp_offset();
+            break;
+
         case 0xE9: // JP (HL)
-            cpu.pc = get_hl();
+            cpu.pc = cpu.hl;
             break;
-            
-        case 0xEA: // LD (a16), A
-        {
-            uint16_t addr = cpu_fetch_word();
-            memory_write(addr, cpu.a);
+
+        case 0xF9: // LD SP, HL
+            cpu.sp = cpu.hl;
             break;
-        }
-        
-        case 0xEF: // RST 28H
-            // Push return address onto stack
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.pc >> 8);
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.pc & 0xFF);
-            cpu.pc = 0x0028;
-            break;
-        
-        case 0xF0: // LDH A, (a8)
-        {
-            uint8_t addr = cpu_fetch_byte();
-            cpu.a = memory_read(0xFF00 + addr);
+
+        case 0xEA: // LD (a16), A
+            memory_write(cpu_fetch_word(), cpu.a);
             break;
-        }
-        
-        case 0xF2: // LD A, (C)
-            cpu.a = memory_read(0xFF00 + cpu.c);
+
+        case 0xFA: // LD A, (a16)
+            cpu.a = memory_read(cpu_fetch_word());
             break;
-        
+
         case 0xF3: // DI (Disable Interrupts)
             cpu.interrupts_enabled = false;
+            enable_interrupts = false;
             break;
-            
-        case 0xF5: // PUSH AF
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.a);
-            cpu.sp--;
-            memory_write(cpu.sp, cpu.f);
-            break;
-            
-        case 0xFA: // LD A, (a16)
-        {
-            uint16_t addr = cpu_fetch_word();
-            cpu.a = memory_read(addr);
-            break;
-        }
-        
+
         case 0xFB: // EI (Enable Interrupts)
-            cpu.interrupts_enabled = true;
-            break;
-        
-        case 0xFE: // CP d8
-        {
-            uint8_t value = cpu_fetch_byte();
-            uint8_t result = cpu.a - value;
-            cpu.f = FLAG_N | (result == 0 ? FLAG_Z : 0) | 
-                   ((cpu.a & 0x0F) < (value & 0x0F) ? FLAG_H : 0) |
-                   (cpu.a < value ? FLAG_C : 0);
+            cpu.ei_pending = true;
             break;
-        }
-        
-        case 0x76: // HALT
-            cpu.halted = true;
-            break;
-            
+
         default:
-            printf("Unimplemented opcode: 0x%02X at PC: 0x%04X\n", opcode, cpu.pc - 1);
-            break;
+            // 0xD3, 0xDB, 0xDD, 0xE3, 0xE4, 0xEB, 0xEC, 0xED, 0xF4, 0xFC, 0xFD
+            // hang the CPU until reset
+            printf("Illegal opcode: 0x%02X at PC: 0x%04X, CPU locked\n", opcode, cpu.pc - 1);
+            cpu.locked = true;
+            return 4;
+    }
+
+    if (enable_interrupts) {
+        cpu.interrupts_enabled = true;
     }
+
+    return cycles;
 }
 
-void execute_cpu_cycle() {
-    cpu_execute_instruction();
+uint8_t execute_cpu_cycle() {
+    return cpu_execute_instruction();
 }
 
 void init_cpu() {
     cpu_init();
-}
\ No newline at end of file
+}
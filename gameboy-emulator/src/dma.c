@@ -0,0 +1,30 @@
+// dma.c - OAM DMA transfers (0xFF46)
+#include <string.h>
+#include "gameboy.h"
+
+#define OAM_START 0xFE00
+#define OAM_SIZE  0xA0
+
+// Machine cycles the transfer holds the bus, in clock cycles
+#define DMA_CYCLES (160 * 4)
+
+GB_LOCAL bool dma_active;
+
+void dma_init() {
+    dma_active = false;
+}
+
+// Copies the source page into OAM at once and blocks the bus for the
+// length of the transfer. The CPU cannot observe OAM until the window
+// ends, so the bulk copy is indistinguishable from the byte-wise one.
+void dma_start(uint8_t page) {
+    memcpy(&memory[OAM_START], memory_page_pointer(page << 8), OAM_SIZE);
+    memory_dirty |= 1 << (OAM_START >> 12);
+    dma_active = true;
+    scheduler_schedule(EVENT_DMA_END, DMA_CYCLES);
+}
+
+void dma_complete(uint32_t late) {
+    (void)late;
+    dma_active = false;
+}
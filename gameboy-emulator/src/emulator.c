@@ -0,0 +1,52 @@
+// emulator.c - Emulator setup and stepping shared by the front ends
+#include "gameboy.h"
+
+bool gb_quiet = false;
+bool gb_battery_saves = true;
+bool gb_apu_lazy = false;
+
+bool gb_init(const char *rom_file) {
+    return gb_load(rom_file, gb_battery_saves);
+}
+
+// gb_init, with battery saves chosen by the caller rather than the
+// process-wide gb_battery_saves
+bool gb_load(const char *rom_file, bool battery_saves) {
+    scheduler_init();
+    init_memory();
+    init_cpu();
+    init_ppu();
+    init_timer();
+    init_input();
+    serial_init();
+    apu_init();
+
+    if (!load_cartridge(rom_file, battery_saves)) {
+        printf("Failed to load ROM: %s\n", rom_file);
+        return false;
+    }
+    return true;
+}
+
+// Executes one instruction and advances the hardware alongside it
+uint8_t gb_step() {
+    uint8_t cycles = execute_cpu_cycle();
+    update_ppu(cycles);
+    update_timer(cycles);
+    scheduler_advance(cycles);
+    return cycles;
+}
+
+// Runs until the next V-Blank, or for a frame's worth of cycles while the
+// LCD is off. Returns the number of instructions executed.
+uint32_t gb_run_frame() {
+    uint32_t frame = ppu.frames;
+    uint32_t cycles = 0;
+    uint32_t instructions = 0;
+
+    while (ppu.frames == frame && cycles < FRAME_CYCLES) {
+        cycles += gb_step();
+        instructions++;
+    }
+    return instructions;
+}
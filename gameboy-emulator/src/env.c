@@ -0,0 +1,210 @@
+// env.c - Reinforcement learning environment interface
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "gameboy.h"
+
+// One environment per thread, running on the thread's live emulator.
+// Episodes start from a snapshot taken right after power on, so a reset
+// is a state load. Observations are the PPU framebuffer itself, or a
+// converted copy in a buffer allocated when the environment is opened;
+// nothing is allocated per step.
+typedef struct {
+    GB_Env_Config config;
+    uint8_t *start;            // Power-on state
+    uint8_t *observation;      // Converted observation, when flags ask for one
+    uint32_t episode_frames;
+    bool open;
+} GB_Env;
+
+static GB_LOCAL GB_Env env;
+
+// Width of observations for flags
+uint32_t gb_env_width(uint32_t flags) {
+    return flags & GB_ENV_DOWNSAMPLE ? SCREEN_WIDTH / 2 : SCREEN_WIDTH;
+}
+
+uint32_t gb_env_height(uint32_t flags) {
+    return flags & GB_ENV_DOWNSAMPLE ? SCREEN_HEIGHT / 2 : SCREEN_HEIGHT;
+}
+
+// Maps shades (0 white to 3 black) to 8-bit luminance: 255 - shade * 85
+static void grayscale_row(const uint8_t *in, uint8_t *out, uint32_t length) {
+    uint32_t i = 0;
+#ifdef __SSE2__
+    // Shades are below 4, so shifting 16-bit lanes never carries a bit
+    // into the neighbouring byte
+    const __m128i white = _mm_set1_epi8((char)0xFF);
+    for (; i + 16 <= length; i += 16) {
+        __m128i shade = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i scaled = _mm_add_epi8(_mm_add_epi8(_mm_slli_epi16(shade, 6), _mm_slli_epi16(shade, 4)),
+                                      _mm_add_epi8(_mm_slli_epi16(shade, 2), shade));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(white, scaled));
+    }
+#endif
+    for (; i < length; i++) {
+        out[i] = 255 - in[i] * 85;
+    }
+}
+
+// Averages 2x2 blocks of two rows into one row of half the width. Pairs
+// are averaged vertically, then horizontally, rounding up each time as
+// the SSE2 average instructions do.
+static void downsample_rows(const uint8_t *row0, const uint8_t *row1, uint8_t *out) {
+    uint32_t x = 0;
+#ifdef __SSE2__
+    const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+    for (; x + 32 <= SCREEN_WIDTH; x += 32) {
+        __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(row0 + x)),
+                                 _mm_loadu_si128((const __m128i *)(row1 + x)));
+        __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(row0 + x + 16)),
+                                 _mm_loadu_si128((const __m128i *)(row1 + x + 16)));
+        a = _mm_avg_epu16(_mm_and_si128(a, low_bytes), _mm_srli_epi16(a, 8));
+        b = _mm_avg_epu16(_mm_and_si128(b, low_bytes), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *)(out + x / 2), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; x < SCREEN_WIDTH; x += 2) {
+        uint8_t left = (row0[x] + row1[x] + 1) >> 1;
+        uint8_t right = (row0[x + 1] + row1[x + 1] + 1) >> 1;
+        out[x / 2] = (left + right + 1) >> 1;
+    }
+}
+
+// Converts the thread's framebuffer into out, which must hold
+// gb_env_width(flags) * gb_env_height(flags) bytes
+void gb_env_observe(uint32_t flags, uint8_t *out) {
+    const uint8_t *frame = ppu_framebuffer;
+
+    if (!(flags & GB_ENV_DOWNSAMPLE)) {
+        if (flags & GB_ENV_GRAYSCALE) {
+            grayscale_row(frame, out, SCREEN_WIDTH * SCREEN_HEIGHT);
+        } else {
+            memcpy(out, frame, SCREEN_WIDTH * SCREEN_HEIGHT);
+        }
+        return;
+    }
+
+    uint8_t gray[2][SCREEN_WIDTH];
+    for (int y = 0; y < SCREEN_HEIGHT; y += 2) {
+        const uint8_t *row0 = &frame[y * SCREEN_WIDTH];
+        const uint8_t *row1 = row0 + SCREEN_WIDTH;
+        if (flags & GB_ENV_GRAYSCALE) {
+            grayscale_row(row0, gray[0], SCREEN_WIDTH);
+            grayscale_row(row1, gray[1], SCREEN_WIDTH);
+            row0 = gray[0];
+            row1 = gray[1];
+        }
+        downsample_rows(row0, row1, &out[y / 2 * (SCREEN_WIDTH / 2)]);
+    }
+}
+
+// Loads the ROM for this thread and takes the power-on snapshot
+bool gb_env_open(const char *rom_file, const GB_Env_Config *config) {
+    gb_env_close();
+
+    // Every reset rolls battery RAM back, so it only maps the .sav when
+    // the config asks for it
+    if (!gb_load(rom_file, config->battery_saves)) {
+        cartridge_free();
+        return false;
+    }
+
+    env.config = *config;
+    env.start = malloc(gb_state_size());
+    if (config->flags & (GB_ENV_GRAYSCALE | GB_ENV_DOWNSAMPLE)) {
+        env.observation = malloc(gb_env_width(config->flags) * gb_env_height(config->flags));
+        if (!env.observation) {
+            free(env.start);
+            env.start = NULL;
+        }
+    }
+    if (!env.start) {
+        cartridge_free();
+        return false;
+    }
+
+    gb_state_save(env.start);
+    env.open = true;
+    return true;
+}
+
+void gb_env_close() {
+    if (env.open) {
+        cartridge_free();
+    }
+    ppu_render = false;
+    free(env.start);
+    free(env.observation);
+    memset(&env, 0, sizeof(env));
+}
+
+static GB_Env_Step env_result(bool done) {
+    GB_Env_Step step;
+    if (env.observation) {
+        gb_env_observe(env.config.flags, env.observation);
+        step.observation = env.observation;
+    } else {
+        step.observation = ppu_framebuffer;
+    }
+    step.ram = memory;
+    step.done = done;
+    return step;
+}
+
+// Number of idle frames a reset with seed runs, mixed with splitmix64
+// so nearby seeds give unrelated counts
+uint32_t env_reset_frames(const GB_Env_Config *config, uint64_t seed) {
+    if (!config->noop_max) {
+        return 0;
+    }
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (z ^ (z >> 31)) % (config->noop_max + 1);
+}
+
+// Runs frames frames, drawing only the last one
+void env_run_frames(uint32_t frames) {
+    for (uint32_t i = 0; i < frames; i++) {
+        ppu_render = i == frames - 1;
+        gb_run_frame();
+    }
+    ppu_render = false;
+}
+
+// The episode ends when the CPU hangs, max_frames is reached or the
+// done callback says so
+bool env_episode_done(const GB_Env_Config *config, uint32_t episode_frames) {
+    return cpu.locked ||
+           (config->max_frames && episode_frames >= config->max_frames) ||
+           (config->done && config->done(memory));
+}
+
+// Starts a new episode. The seed picks how many idle frames, up to
+// noop_max, run before the first observation; the emulator itself is
+// deterministic.
+GB_Env_Step gb_env_reset(uint64_t seed) {
+    gb_state_load(env.start);
+    env.episode_frames = 0;
+
+    memset(ppu_framebuffer, 0, sizeof(ppu_framebuffer));
+    input_set_mask(0);
+    env_run_frames(env_reset_frames(&env.config, seed));
+    return env_result(false);
+}
+
+// Holds action (an input_set_mask() mask) for frameskip frames. Only the
+// last frame is drawn, and the end of the episode is checked once per
+// step.
+GB_Env_Step gb_env_step(uint8_t action, uint32_t frameskip) {
+    if (frameskip == 0) {
+        frameskip = 1;
+    }
+
+    input_set_mask(action);
+    env_run_frames(frameskip);
+    env.episode_frames += frameskip;
+    return env_result(env_episode_done(&env.config, env.episode_frames));
+}
@@ -0,0 +1,277 @@
+// farm.c - Runs many emulator jobs on a work-stealing thread pool
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include "gameboy.h"
+
+// Each worker owns a deque of job indices. It takes work from the tail
+// and puts an unfinished job back on the tail, so it usually resumes the
+// instance whose pages it still has resident and only a few instances
+// are live at a time. Idle workers steal jobs, started or not, from the
+// heads of other deques. A job runs for slice_frames frames and is
+// deactivated before it goes back, so no thread holds it while it waits
+// and it can migrate to another thread.
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t *items;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+} Farm_Deque;
+
+typedef struct {
+    GB_Instance *instance;
+    GB_Movie *movie;            // Playing movie_file, when there is one
+} Farm_Session;
+
+typedef struct {
+    Farm_Job *jobs;
+    Farm_Session *sessions;
+    Farm_Deque *deques;
+    int threads;
+    uint32_t slice_frames;
+} Farm;
+
+typedef struct {
+    Farm *farm;
+    int index;
+} Farm_Worker;
+
+static double farm_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void deque_push_tail(Farm_Deque *deque, uint32_t job) {
+    pthread_mutex_lock(&deque->lock);
+    deque->items[(deque->head + deque->count) % deque->capacity] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool deque_pop_tail(Farm_Deque *deque, uint32_t *job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->count > 0;
+    if (found) {
+        deque->count--;
+        *job = deque->items[(deque->head + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool deque_steal_head(Farm_Deque *deque, uint32_t *job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->count > 0;
+    if (found) {
+        *job = deque->items[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Loads the ROM on this thread and captures it as the job's instance
+static bool farm_start_job(Farm_Job *job, Farm_Session *session) {
+    if (job->movie_file) {
+        session->movie = gb_movie_open(job->movie_file);
+        if (!session->movie) {
+            return false;
+        }
+    }
+
+    gb_instance_deactivate();
+    if (!gb_init(job->rom_file)) {
+        cartridge_free();
+        return false;
+    }
+
+    session->instance = gb_instance_create();
+    if (!session->instance) {
+        cartridge_free();
+        return false;
+    }
+    return true;
+}
+
+// Frees everything the job holds. Its cartridge is freed by pointer, as
+// it is not the current one if the instance could not be activated.
+static void farm_finish_job(Farm_Session *session) {
+    Cartridge *cartridge = gb_instance_cartridge(session->instance);
+    gb_instance_free(session->instance);
+    cartridge_destroy(cartridge);
+    session->instance = NULL;
+    gb_movie_close(session->movie);
+    session->movie = NULL;
+}
+
+// True once a job that stops on a verdict has one
+static bool farm_verdict(const Farm_Job *job) {
+    return job->serial_stop && job->serial->verdict != SERIAL_NO_VERDICT;
+}
+
+// Runs one slice of a job. Returns true once the job is done.
+static bool farm_run_slice(Farm *farm, uint32_t index) {
+    Farm_Job *job = &farm->jobs[index];
+    Farm_Session *session = &farm->sessions[index];
+    double start = farm_seconds();
+
+    if (!session->instance) {
+        if (!farm_start_job(job, session)) {
+            gb_movie_close(session->movie);
+            session->movie = NULL;
+            job->failed = true;
+            return true;
+        }
+    } else if (!gb_instance_activate(session->instance)) {
+        job->failed = true;
+        farm_finish_job(session);
+        return true;
+    }
+
+    uint32_t end = job->frames_run + farm->slice_frames;
+    if (end > job->frames) {
+        end = job->frames;
+    }
+    serial_bind(job->serial);
+    while (job->frames_run < end && !farm_verdict(job)) {
+        uint8_t mask = 0;
+        if (session->movie) {
+            mask = gb_movie_next(session->movie);
+        } else if (job->frames_run < job->movie_length) {
+            mask = job->movie[job->frames_run];
+        }
+        input_set_mask(mask);
+
+        // Only checkpoint frames are drawn. A frame with the LCD off
+        // draws nothing, and shows white.
+        bool checkpoint = job->checkpoint_frames &&
+                          (job->frames_run + 1) % job->checkpoint_frames == 0;
+        if (checkpoint) {
+            memset(ppu_framebuffer, 0, sizeof(ppu_framebuffer));
+            ppu_render = true;
+        }
+        gb_run_frame();
+        job->frames_run++;
+
+        if (checkpoint) {
+            ppu_render = false;
+            apu_sync();
+            uint64_t *hashes = &job->checkpoints[(job->frames_run / job->checkpoint_frames - 1) * 2];
+            hashes[0] = gb_hash(ppu_framebuffer, sizeof(ppu_framebuffer), 0);
+            hashes[1] = gb_hash(memory, MEMORY_SIZE, 0);
+        }
+    }
+
+    serial_bind(NULL);
+
+    bool done = job->frames_run >= job->frames || farm_verdict(job);
+    if (done) {
+        farm_finish_job(session);
+    } else if (!gb_instance_deactivate()) {
+        job->failed = true;
+        farm_finish_job(session);
+        done = true;
+    }
+
+    job->seconds += farm_seconds() - start;
+    return done;
+}
+
+static void *farm_worker(void *arg) {
+    Farm_Worker *worker = arg;
+    Farm *farm = worker->farm;
+    Farm_Deque *own = &farm->deques[worker->index];
+
+    for (;;) {
+        uint32_t job;
+        bool found = deque_pop_tail(own, &job);
+
+        // Sweep the other workers once. Anything not found is already
+        // running on its owner, which will finish it.
+        for (int i = 1; !found && i < farm->threads; i++) {
+            found = deque_steal_head(&farm->deques[(worker->index + i) % farm->threads], &job);
+        }
+        if (!found) {
+            break;
+        }
+
+        if (!farm_run_slice(farm, job)) {
+            deque_push_tail(own, job);
+        }
+        sched_yield();
+    }
+
+    gb_instance_release();
+    return NULL;
+}
+
+// Runs every job to completion on threads workers and returns the wall
+// time taken, or a negative value if the pool could not be set up.
+// Results are stored in the jobs.
+double farm_run(Farm_Job *jobs, uint32_t count, int threads, uint32_t slice_frames) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (slice_frames == 0) {
+        slice_frames = FARM_SLICE_FRAMES;
+    }
+
+    Farm farm = { jobs, NULL, NULL, threads, slice_frames };
+    farm.sessions = calloc(count, sizeof(Farm_Session));
+    farm.deques = calloc(threads, sizeof(Farm_Deque));
+    pthread_t *handles = calloc(threads, sizeof(pthread_t));
+    Farm_Worker *workers = calloc(threads, sizeof(Farm_Worker));
+    uint32_t *items = calloc((size_t)threads * (count ? count : 1), sizeof(uint32_t));
+    double elapsed = -1;
+
+    if (!farm.sessions || !farm.deques || !handles || !workers || !items) {
+        goto done;
+    }
+
+    // Deal the jobs out in contiguous blocks, one per worker
+    for (int i = 0; i < threads; i++) {
+        Farm_Deque *deque = &farm.deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->items = &items[(size_t)i * (count ? count : 1)];
+        deque->capacity = count ? count : 1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        jobs[i].failed = false;
+        jobs[i].frames_run = 0;
+        jobs[i].seconds = 0;
+        deque_push_tail(&farm.deques[(uint64_t)i * threads / count], i);
+    }
+
+    double start = farm_seconds();
+    int started = 0;
+    for (; started < threads; started++) {
+        workers[started].farm = &farm;
+        workers[started].index = started;
+        if (pthread_create(&handles[started], NULL, farm_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        farm_worker(&(Farm_Worker){ &farm, 0 });
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    elapsed = farm_seconds() - start;
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&farm.deques[i].lock);
+    }
+
+done:
+    free(items);
+    free(workers);
+    free(handles);
+    free(farm.deques);
+    free(farm.sessions);
+    return elapsed;
+}
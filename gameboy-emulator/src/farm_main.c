@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "gameboy.h"
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-j <threads>] [--slice <frames>] <job_list>\n", program);
+    printf("  -j <threads>       Worker threads (default: one per CPU)\n");
+    printf("  --slice <frames>   Frames a job runs before yielding (default: %d)\n",
+           FARM_SLICE_FRAMES);
+    printf("Each line of the job list is \"<frames> <movie|-> <rom_file>\";\n");
+    printf("a movie is run-length encoded or holds one joypad mask byte per frame.\n");
+    printf("'#' starts a comment.\n");
+}
+
+// Parses the job list into a growing array. Returns the job count, or -1
+// on error.
+static int read_job_list(const char *filename, Farm_Job **jobs) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("Failed to open job list: %s\n", filename);
+        return -1;
+    }
+
+    char line[4096];
+    int count = 0;
+    int capacity = 0;
+    int line_number = 0;
+    *jobs = NULL;
+
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        unsigned frames;
+        char movie[4096];
+        int rom_start;
+        if (sscanf(line, " %u %4095s %n", &frames, movie, &rom_start) != 2 ||
+            line[rom_start] == '\0') {
+            if (strspn(line, " \t") != strlen(line)) {
+                printf("%s:%d: expected <frames> <movie|-> <rom_file>\n", filename, line_number);
+                fclose(file);
+                return -1;
+            }
+            continue;
+        }
+
+        // The ROM path runs to the end of the line and may contain spaces
+        char *rom = line + rom_start;
+        size_t length = strlen(rom);
+        while (length > 0 && (rom[length - 1] == ' ' || rom[length - 1] == '\t')) {
+            rom[--length] = '\0';
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            Farm_Job *grown = realloc(*jobs, capacity * sizeof(Farm_Job));
+            if (!grown) {
+                fclose(file);
+                return -1;
+            }
+            *jobs = grown;
+        }
+
+        Farm_Job *job = &(*jobs)[count++];
+        memset(job, 0, sizeof(*job));
+        job->rom_file = strdup(rom);
+        job->movie_file = strcmp(movie, "-") == 0 ? NULL : strdup(movie);
+        job->frames = frames;
+    }
+
+    fclose(file);
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    const char *job_list = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int slice_frames = FARM_SLICE_FRAMES;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc) {
+            slice_frames = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !job_list) {
+            job_list = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!job_list || threads < 1 || slice_frames < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    Farm_Job *jobs;
+    int count = read_job_list(job_list, &jobs);
+    if (count < 0) {
+        return 1;
+    }
+
+    // Jobs share nothing on disk: battery RAM stays in memory
+    gb_quiet = true;
+    gb_battery_saves = false;
+
+    // Nobody hears the jobs, so skip the sound they would make
+    gb_apu_lazy = true;
+
+    printf("Running %d jobs on %d threads\n", count, threads);
+    double elapsed = farm_run(jobs, count, threads, slice_frames);
+    if (elapsed < 0) {
+        printf("Failed to start the worker pool\n");
+        return 1;
+    }
+
+    uint64_t total_frames = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        Farm_Job *job = &jobs[i];
+        total_frames += job->frames_run;
+        failed += job->failed;
+        printf("%4d %-6s %8u frames %8.3f s  %s\n", i, job->failed ? "FAIL" : "ok",
+               job->frames_run, job->seconds, job->rom_file);
+    }
+
+    printf("%d jobs, %d failed, %llu frames in %.3f s (%.0f frames/s)\n",
+           count, failed, (unsigned long long)total_frames, elapsed,
+           elapsed > 0 ? total_frames / elapsed : 0);
+
+    for (int i = 0; i < count; i++) {
+        free((char *)jobs[i].rom_file);
+        free((char *)jobs[i].movie_file);
+    }
+    free(jobs);
+    return failed ? 1 : 0;
+}
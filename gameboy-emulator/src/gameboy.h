@@ -8,6 +8,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// Emulator state is per thread, so each thread can run its own instance
+#define GB_LOCAL _Thread_local
+
+// Clock cycles in one frame (154 lines of 456 cycles)
+#define FRAME_CYCLES 70224
+
+// Screen size in pixels
+#define SCREEN_WIDTH 160
+#define SCREEN_HEIGHT 144
+
 // Memory map constants
 #define MEMORY_SIZE 0x10000
 #define ROM_BANK_SIZE 0x4000
@@ -16,67 +26,526 @@
 #define WRAM_START 0xC000
 #define WRAM_SIZE 0x2000
 
+// Memory is tracked in 4KB pages for copy-on-write instance snapshots
+#define PAGE_SIZE 0x1000
+#define MEMORY_PAGES (MEMORY_SIZE / PAGE_SIZE)
+#define MEMORY_PAGES_ALL 0xFFFF
+#define CART_RAM_MAX 0x20000
+#define CART_RAM_PAGES (CART_RAM_MAX / PAGE_SIZE)
+#define CART_RAM_PAGES_ALL 0xFFFFFFFF
+
 // Function declarations
 void init_memory();
 void init_cpu();
 void init_ppu();
 void init_timer();
 void init_input();
-bool load_cartridge(const char* filename);
-void execute_cpu_cycle();
-void update_ppu();
-void update_timer();
-void handle_input();
+bool load_cartridge(const char* filename, bool battery_saves);
+uint8_t execute_cpu_cycle();
+void update_ppu(uint8_t cycles);
+void update_timer(uint8_t cycles);
 
 // Memory functions
 uint8_t memory_read(uint16_t address);
 void memory_write(uint16_t address, uint8_t value);
 void memory_init();
+const uint8_t *memory_page_pointer(uint16_t address);
+void memory_bind(uint8_t *buffer);
+extern GB_LOCAL uint16_t memory_dirty; // Pages of memory[] written since the last snapshot
+
+// DMA functions
+extern GB_LOCAL bool dma_active;
+void dma_init();
+void dma_start(uint8_t page);
+void dma_complete(uint32_t late);
+
+// Scheduler
+typedef enum {
+    EVENT_DMA_END,
+    EVENT_SERIAL_END,
+    EVENT_APU_FRAME,
+    EVENT_COUNT
+} Event_Type;
+
+typedef struct {
+    uint64_t cycles;                 // Clock cycles since power on
+    uint64_t next_event;             // Earliest pending deadline
+    uint64_t deadlines[EVENT_COUNT]; // UINT64_MAX when not scheduled
+} Scheduler_State;
+
+extern GB_LOCAL Scheduler_State scheduler;
+void scheduler_init();
+void scheduler_schedule(Event_Type event, uint32_t delay);
+void scheduler_cancel(Event_Type event);
+void scheduler_advance(uint8_t cycles);
+uint32_t scheduler_cycles_to_event();
+
+// Serial functions
+#define SERIAL_CAPTURE_SIZE 4096
+
+typedef enum {
+    SERIAL_NO_VERDICT,
+    SERIAL_PASSED,
+    SERIAL_FAILED
+} Serial_Verdict;
+
+typedef struct {
+    char text[SERIAL_CAPTURE_SIZE];  // First bytes sent, NUL-terminated
+    uint32_t length;                 // Bytes sent, including any not kept
+    uint64_t tail;                   // Last eight bytes sent, newest lowest
+    Serial_Verdict verdict;          // From a test ROM's "Passed" or "Failed"
+} Serial_Capture;
+
+typedef struct Link Link;
+
+void serial_init();
+void serial_bind(Serial_Capture *capture);
+void serial_connect(Link *link);
+void serial_sync();
+void serial_write_control(uint8_t value);
+void serial_complete(uint32_t late);
+
+// Link cable functions
+typedef struct {
+    uint64_t cycles;                 // Sender's clock when it was sent
+    uint8_t type;
+    uint8_t byte;
+    uint16_t id;                     // Pairs a DATA with the READY it answers
+} Link_Message;
+
+typedef struct {
+    uint64_t transfers;              // Bytes exchanged with the partner
+    uint64_t sent;                   // Messages sent
+    uint64_t received;               // Messages received
+    uint64_t waits;                  // Round trips: times this side waited for the partner
+    uint64_t syscalls;               // System calls made by the transport
+} Link_Stats;
+
+// One end of a cable: how messages travel, then what this side knows
+// about the partner. Only the thread running this end touches it.
+struct Link {
+    bool (*send)(Link *link, const Link_Message *message);     // False if the partner is gone
+    bool (*receive)(Link *link, Link_Message *message);        // False if none is on hand
+    void (*flush)(Link *link);       // Sends anything held back
+    void (*fill)(Link *link, bool block);  // Fetches messages, waiting for some if block
+
+    int side;                        // 0 or 1, orders events at the same cycle
+    uint64_t partner_time;           // Partner's clock as of its last message
+    uint64_t time_sent;              // This side's clock as last reported
+    bool partner_closed;
+    bool partner_ready;              // Partner waits on the external clock
+    uint8_t ready_byte;
+    uint16_t ready_id;
+    uint64_t ready_time;
+    bool armed;                      // This side waits on the external clock
+    uint16_t arm_id;
+    bool data_pending;               // Partner has clocked a byte in
+    uint8_t data_byte;
+    uint64_t data_time;
+    Link_Stats stats;
+};
+
+typedef struct Link_Pipe Link_Pipe;
+
+typedef struct {
+    const char *rom_file;
+    Link *link;                      // Cable end, or NULL to run unlinked
+    Serial_Capture *serial;          // Receives serial output, or NULL
+    uint32_t frames;
+    // Results
+    bool failed;
+    double seconds;
+} Link_Player;
+
+uint8_t link_transfer(Link *link, uint8_t out, uint64_t cycles);
+void link_arm(Link *link, uint8_t byte, uint64_t cycles);
+void link_disarm(Link *link, uint64_t cycles);
+bool link_poll(Link *link, uint64_t cycles, uint8_t *in);
+void link_sync(Link *link, uint64_t cycles);
+void link_close(Link *link, uint64_t cycles);
+void link_stats(const Link *link, Link_Stats *stats);
+Link_Pipe *link_pipe_create();
+Link *link_pipe_end(Link_Pipe *pipe, int side);
+void link_pipe_free(Link_Pipe *pipe);
+Link *link_socket_listen(const char *path);
+Link *link_socket_connect(const char *path);
+void link_socket_close(Link *link);
+double link_run(Link_Player *players, int count);
 
 // CPU functions
 void cpu_init();
-void cpu_execute_instruction();
+uint8_t cpu_execute_instruction();
 uint8_t cpu_fetch_byte();
 uint16_t cpu_fetch_word();
+void cpu_request_interrupt(uint8_t interrupt);
+extern const uint8_t opcode_cycles[256];
 
 // Timer functions
+typedef struct {
+    uint16_t divider_cycles;
+    uint16_t timer_cycles;
+} Timer_State;
+
+extern GB_LOCAL Timer_State timer_state;
 void timer_init();
 void timer_update(uint16_t cycles);
+uint32_t timer_cycles_to_event();
 
 // Input functions
+typedef struct {
+    uint8_t buttons;    // A, B, Select, Start
+    uint8_t directions; // Right, Left, Up, Down
+} Input_State;
+
+extern GB_LOCAL Input_State input_state;
 void input_init();
-void input_update();
+uint8_t input_read();
+void input_write(uint8_t value);
 uint8_t input_get_joypad();
+void input_set_mask(uint8_t mask);
+uint8_t input_get_mask();
+
+// Terminal input functions
+typedef struct {
+    uint64_t polls;
+    uint64_t keys;             // Button presses read
+    uint64_t frames_measured;  // Frames that started with a fresh key
+    double latency_total;      // Seconds from reading a key to the end of its frame
+    double latency_max;
+    double interval_max;       // Longest time between polls
+} Term_Input_Stats;
+
+bool term_input_open();
+uint8_t term_input_poll();
+void term_input_close(Term_Input_Stats *stats);
+
+// Terminal video functions
+typedef struct {
+    uint64_t frames;           // Frames presented
+    uint64_t frames_skipped;   // Frames with no byte credit left
+    uint64_t rows_drawn;
+    uint64_t bytes;
+    uint64_t writes;
+} Term_Video_Stats;
+
+typedef struct Term_Video Term_Video;
+Term_Video *term_video_open(int fd, uint32_t rate);
+void term_video_present(Term_Video *video, const uint8_t *frame);
+void term_video_close(Term_Video *video, Term_Video_Stats *stats);
+
+// Input movie functions
+typedef struct GB_Movie GB_Movie;
+typedef struct GB_Movie_Recorder GB_Movie_Recorder;
+GB_Movie *gb_movie_open(const char *filename);
+uint8_t gb_movie_next(GB_Movie *movie);
+uint64_t gb_movie_frames(const GB_Movie *movie);
+void gb_movie_close(GB_Movie *movie);
+GB_Movie_Recorder *gb_movie_record(const char *filename);
+void gb_movie_record_frame(GB_Movie_Recorder *recorder, uint8_t mask);
+bool gb_movie_finish(GB_Movie_Recorder *recorder);
 
 // PPU functions
+typedef struct {
+    uint16_t cycles;
+    uint8_t mode;
+    uint8_t line;
+    uint32_t frames;    // Completed frames, counted at V-Blank entry
+} PPU_State;
+
+extern GB_LOCAL PPU_State ppu;
+extern GB_LOCAL uint8_t ppu_framebuffer[SCREEN_HEIGHT * SCREEN_WIDTH];
+extern GB_LOCAL bool ppu_render;     // Draw lines into ppu_framebuffer
 void ppu_init();
 void ppu_update(uint16_t cycles);
+uint32_t ppu_cycles_to_event();
+
+// APU functions
+typedef struct {
+    bool enabled;           // Channel on, as NR52 reports it
+    bool dac;
+    uint16_t length;        // Length counter; stops the channel at 0
+    uint8_t volume;         // Envelope volume, 0-15
+    uint8_t envelope_timer;
+    uint8_t position;       // Duty step or wave sample
+    uint16_t lfsr;          // Noise shift register
+    uint32_t countdown;     // Cycles to the next waveform step
+    bool sweep_enabled;     // Channel 1 frequency sweep
+    uint8_t sweep_timer;
+    uint16_t shadow;        // Frequency the sweep works from
+} APU_Channel;
+
+typedef struct {
+    APU_Channel channels[4];
+    uint8_t regs[0x17];     // NR10-NR52 as written
+    bool power;
+    uint8_t sequencer_step; // Frame sequencer step, 0-7
+    uint64_t sequencer_next; // Cycle of the next frame sequencer step
+    uint64_t time;          // Scheduler cycles the channels have run to
+} APU_State;
+
+typedef struct GB_Audio_Ring GB_Audio_Ring;
+
+#define APU_MAX_SAMPLE_RATE 96000
+
+extern GB_LOCAL APU_State apu;
+void apu_init();
+bool apu_bind(GB_Audio_Ring *ring);
+void apu_write(uint16_t address, uint8_t value);
+void apu_frame_sequencer(uint32_t late);
+void apu_sync();
+
+// Audio ring functions
+GB_Audio_Ring *gb_audio_ring_create(uint32_t sample_rate, uint32_t frames);
+void gb_audio_ring_free(GB_Audio_Ring *ring);
+uint32_t gb_audio_ring_sample_rate(const GB_Audio_Ring *ring);
+uint32_t gb_audio_ring_write(GB_Audio_Ring *ring, const int16_t *samples, uint32_t frames);
+uint32_t gb_audio_ring_read(GB_Audio_Ring *ring, int16_t *samples, uint32_t frames);
+uint32_t gb_audio_ring_available(const GB_Audio_Ring *ring);
+uint64_t gb_audio_ring_dropped(const GB_Audio_Ring *ring);
 
 // Cartridge functions
+typedef struct {
+    uint16_t rom_bank;
+    uint8_t ram_bank;
+    uint8_t mode;        // MBC1 banking mode
+    bool ram_enabled;
+} MBC_State;
+
 typedef struct {
     uint8_t *data;
     size_t size;
     char title[16];
     uint8_t type;
+    uint8_t mbc_type;    // 0 (none), 1, 3 or 5
+    bool battery;
+    bool saved;          // RAM is a mapping of the .sav file
+    uint8_t *ram;        // External RAM, mapped from the .sav file when battery-backed
+    size_t ram_size;
+    MBC_State mbc;
+    size_t rom0_offset;  // ROM offset of the 0x0000-0x3FFF bank, nonzero only in MBC1 mode 1
+    size_t rom_offset;   // ROM offset of the switchable bank
+    size_t ram_offset;   // RAM offset of the selected bank, SIZE_MAX if unmapped
 } Cartridge;
 
-extern Cartridge *current_cartridge;
-bool cartridge_load(const char *filename);
+extern GB_LOCAL Cartridge *current_cartridge;
+extern GB_LOCAL uint32_t cartridge_ram_dirty; // Cartridge RAM pages written since the last snapshot
+bool cartridge_load(const char *filename, bool battery_saves);
 void cartridge_free();
+void cartridge_destroy(Cartridge *cartridge);
 uint8_t cartridge_read(uint16_t address);
+void cartridge_write(uint16_t address, uint8_t value);
+uint8_t cartridge_ram_read(uint16_t address);
+void cartridge_ram_write(uint16_t address, uint8_t value);
+const uint8_t *cartridge_page_pointer(uint16_t address);
+const uint8_t *cartridge_ram_page_pointer(uint16_t address);
+void cartridge_set_banks(const MBC_State *mbc);
 
 // CPU state
+// Each register pair overlays its two 8-bit halves, so cpu.hl and cpu.h/cpu.l
+// name the same storage. The half order follows the host byte order.
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REGISTER_PAIR(hi, lo) union { struct { uint8_t hi, lo; }; uint16_t hi##lo; }
+#else
+#define REGISTER_PAIR(hi, lo) union { struct { uint8_t lo, hi; }; uint16_t hi##lo; }
+#endif
+
 typedef struct {
-    uint8_t a, f, b, c, d, e, h, l;
+    REGISTER_PAIR(a, f);
+    REGISTER_PAIR(b, c);
+    REGISTER_PAIR(d, e);
+    REGISTER_PAIR(h, l);
     uint16_t pc, sp;
     bool halted;
+    bool locked;             // Hung by an illegal opcode
     bool interrupts_enabled;
+    bool ei_pending;         // EI waits one instruction before enabling
 } CPU_State;
 
-extern CPU_State cpu;
+extern GB_LOCAL CPU_State cpu;
 
 // Memory
-extern uint8_t memory[MEMORY_SIZE];
+extern GB_LOCAL uint8_t *memory;
+
+// Emulator state other than memory
+typedef struct {
+    CPU_State cpu;
+    PPU_State ppu;
+    Timer_State timer;
+    Input_State input;
+    Scheduler_State scheduler;
+    APU_State apu;
+    MBC_State mbc;
+    bool dma_active;
+} Core_State;
+
+// Save state functions
+void core_state_save(Core_State *core);
+void core_state_load(const Core_State *core);
+size_t gb_state_size();
+void gb_state_save(void *buffer);
+bool gb_state_load(const void *buffer);
+
+// Emulator functions
+extern bool gb_quiet;            // Suppress informational output
+extern bool gb_battery_saves;    // Map battery RAM from .sav files
+extern bool gb_apu_lazy;         // Skip sound synthesis where no ring is bound
+bool gb_init(const char *rom_file);
+bool gb_load(const char *rom_file, bool battery_saves);
+uint8_t gb_step();
+uint32_t gb_run_frame();
+
+// Instance functions
+typedef struct GB_Instance GB_Instance;
+GB_Instance *gb_instance_create();
+GB_Instance *gb_instance_fork(GB_Instance *parent);
+bool gb_instance_activate(GB_Instance *instance);
+bool gb_instance_deactivate();
+bool gb_instance_release();
+bool gb_instance_sync(GB_Instance *instance);
+Cartridge *gb_instance_cartridge(const GB_Instance *instance);
+void gb_instance_free(GB_Instance *instance);
+
+// Arena functions
+typedef struct GB_Arena GB_Arena;
+GB_Arena *gb_arena_create(uint32_t capacity);
+void gb_arena_free(GB_Arena *arena);
+int gb_arena_add(GB_Arena *arena);
+uint32_t gb_arena_count(const GB_Arena *arena);
+void gb_arena_select(GB_Arena *arena, uint32_t slot);
+uint32_t gb_arena_frames(const GB_Arena *arena, uint32_t slot);
+uint64_t gb_arena_run_frames(GB_Arena *arena, uint32_t frames);
+void gb_arena_step(GB_Arena *arena, uint32_t instructions);
+
+// Lockstep functions
+typedef struct Lockstep Lockstep;
+
+typedef struct {
+    uint64_t vector_steps;        // Instructions issued to a group of lanes at once
+    uint64_t vector_instructions; // Lane instructions run in vector steps
+    uint64_t scalar_instructions; // Lane instructions run one lane at a time
+} Lockstep_Stats;
+
+Lockstep *lockstep_create(uint32_t lanes);
+void lockstep_free(Lockstep *ls);
+void lockstep_select(Lockstep *ls, uint32_t lane);
+void lockstep_set_input(Lockstep *ls, uint32_t lane, uint8_t mask);
+void lockstep_run_frame(Lockstep *ls);
+void lockstep_stats(const Lockstep *ls, Lockstep_Stats *stats);
+
+// Environment functions
+#define GB_ENV_GRAYSCALE  0x01  // Observations in 8-bit luminance instead of shades 0-3
+#define GB_ENV_DOWNSAMPLE 0x02  // Observations averaged down to 80x72
+
+typedef struct {
+    uint32_t flags;
+    uint32_t max_frames;                   // Episode length, 0 for no limit
+    uint32_t noop_max;                     // Most idle frames a reset runs
+    bool (*done)(const uint8_t *memory);   // Game-specific end of episode, or NULL
+    bool battery_saves;                    // Map battery RAM from the .sav file
+} GB_Env_Config;
+
+typedef struct {
+    const uint8_t *observation;  // gb_env_height() rows of gb_env_width() bytes
+    const uint8_t *ram;          // The memory map; WRAM at WRAM_START, HRAM at 0xFF80
+    bool done;
+} GB_Env_Step;
+
+bool gb_env_open(const char *rom_file, const GB_Env_Config *config);
+void gb_env_close();
+GB_Env_Step gb_env_reset(uint64_t seed);
+GB_Env_Step gb_env_step(uint8_t action, uint32_t frameskip);
+void gb_env_observe(uint32_t flags, uint8_t *out);
+uint32_t gb_env_width(uint32_t flags);
+uint32_t gb_env_height(uint32_t flags);
+uint32_t env_reset_frames(const GB_Env_Config *config, uint64_t seed);
+void env_run_frames(uint32_t frames);
+bool env_episode_done(const GB_Env_Config *config, uint32_t episode_frames);
+
+// Vector environment functions
+typedef struct GB_Vec_Env GB_Vec_Env;
+
+typedef struct {
+    const uint8_t *observations; // count x gb_env_height() x gb_env_width() tensor
+    const uint8_t *done;         // One flag per instance; finished ones are already reset
+} GB_Vec_Step;
+
+GB_Vec_Env *gb_vec_env_create(const char *rom_file, const GB_Env_Config *config,
+                              uint32_t count, int threads);
+void gb_vec_env_free(GB_Vec_Env *ve);
+uint32_t gb_vec_env_count(const GB_Vec_Env *ve);
+GB_Vec_Step gb_vec_env_reset(GB_Vec_Env *ve, uint64_t seed);
+GB_Vec_Step gb_vec_env_step(GB_Vec_Env *ve, const uint8_t *actions, uint32_t frameskip);
+void gb_vec_env_step_async(GB_Vec_Env *ve, const uint8_t *actions, uint32_t frameskip);
+GB_Vec_Step gb_vec_env_wait(GB_Vec_Env *ve);
+
+// Shared memory framebuffer functions
+typedef struct GB_Shm_Ring GB_Shm_Ring;
+GB_Shm_Ring *gb_shm_create(const char *name, uint32_t slots);
+GB_Shm_Ring *gb_shm_attach(const char *name);
+void gb_shm_close(GB_Shm_Ring *ring);
+void gb_shm_publish(GB_Shm_Ring *ring, const uint8_t *frame);
+uint64_t gb_shm_head(const GB_Shm_Ring *ring);
+uint32_t gb_shm_slots(const GB_Shm_Ring *ring);
+const uint8_t *gb_shm_frame(const GB_Shm_Ring *ring, uint64_t frame, uint64_t *sequence);
+bool gb_shm_still_valid(const GB_Shm_Ring *ring, uint64_t frame, uint64_t sequence);
+bool gb_shm_read(const GB_Shm_Ring *ring, uint64_t frame, uint8_t *out);
+
+// Background writer functions
+typedef enum {
+    WRITER_DROP,     // Drop data when every buffer is queued
+    WRITER_BLOCK     // Wait for the writer thread to free one
+} Writer_Policy;
+
+typedef struct {
+    uint64_t written;    // Buffers written
+    uint64_t dropped;    // Buffers refused under WRITER_DROP
+    uint64_t waits;      // Times the producer waited under WRITER_BLOCK
+    uint64_t writes;     // writev() calls
+    uint64_t bytes;      // Bytes written, header included
+} Writer_Stats;
+
+typedef struct Writer Writer;
+Writer *writer_open(const char *filename, const void *header, size_t header_length,
+                    size_t buffer_size, uint32_t buffers, Writer_Policy policy);
+uint8_t *writer_acquire(Writer *writer);
+void writer_submit(Writer *writer, uint8_t *buffer, size_t length);
+size_t writer_buffer_size(const Writer *writer);
+bool writer_close(Writer *writer, Writer_Stats *stats);
+bool writer_finish(Writer *writer, const void *header, size_t header_length, Writer_Stats *stats);
+
+// Rewind functions
+bool rewind_init(uint32_t interval, size_t ring_size);
+void rewind_free();
+void rewind_frame();
+bool rewind_step_back();
+uint32_t rewind_depth();
+
+// Farm functions
+#define FARM_SLICE_FRAMES 60
+
+typedef struct {
+    const char *rom_file;
+    const char *movie_file;  // Input movie played back, or NULL
+    const uint8_t *movie;    // Masks in memory, used without a movie_file
+    size_t movie_length;
+    uint32_t frames;
+    uint32_t checkpoint_frames;  // Hash the frame and memory this often, or 0
+    uint64_t *checkpoints;   // Frame and memory hash per checkpoint
+    Serial_Capture *serial;  // Receives serial output, or NULL
+    bool serial_stop;        // End the job once serial output gives a verdict
+    // Results
+    bool failed;
+    uint32_t frames_run;
+    double seconds;          // Time spent running this job
+} Farm_Job;
+
+double farm_run(Farm_Job *jobs, uint32_t count, int threads, uint32_t slice_frames);
+
+// Hash functions
+uint64_t gb_hash(const void *data, size_t length, uint64_t seed);
+
+// Benchmark functions
+int bench_run(const char *rom_file);
 
 // Flag register bits
 #define FLAG_Z 0x80  // Zero flag
@@ -84,4 +553,11 @@ extern uint8_t memory[MEMORY_SIZE];
 #define FLAG_H 0x20  // Half carry flag
 #define FLAG_C 0x10  // Carry flag
 
+// Interrupt bits (IE at 0xFFFF, IF at 0xFF0F)
+#define INT_VBLANK 0x01
+#define INT_STAT   0x02
+#define INT_TIMER  0x04
+#define INT_SERIAL 0x08
+#define INT_JOYPAD 0x10
+
 #endif // GAMEBOY_H
\ No newline at end of file
@@ -14,12 +14,7 @@
 #define DPAD_UP       0x04
 #define DPAD_DOWN     0x08
 
-typedef struct {
-    uint8_t buttons;    // A, B, Select, Start
-    uint8_t directions; // Right, Left, Up, Down
-} Input_State;
-
-Input_State input_state;
+GB_LOCAL Input_State input_state;
 
 void input_init() {
     input_state.buttons = 0x0F;    // All buttons released (high)
@@ -29,33 +24,56 @@ void input_init() {
     memory_write(JOYPAD_REG, 0xFF);
 }
 
-void input_update() {
-    // In a real implementation, this would check for actual key presses
-    // For now, we'll just maintain the current state
-    
-    uint8_t joypad = memory_read(JOYPAD_REG);
-    
-    // Check which button group is selected
-    if (!(joypad & 0x10)) {
-        // Direction keys selected
-        joypad = (joypad & 0xF0) | input_state.directions;
-    } else if (!(joypad & 0x20)) {
-        // Button keys selected  
-        joypad = (joypad & 0xF0) | input_state.buttons;
-    } else {
-        // No keys selected
-        joypad |= 0x0F;
+// Input lines as P1 shows them, low meaning pressed: the buttons, the
+// directions or both ANDed together, depending on which groups the
+// select bits (also low) pick
+static uint8_t input_lines(uint8_t select) {
+    uint8_t lines = 0x0F;
+    if (!(select & 0x10)) {
+        lines &= input_state.directions;
+    }
+    if (!(select & 0x20)) {
+        lines &= input_state.buttons;
+    }
+    return lines;
+}
+
+// P1 is not kept up to date in memory; it is put together when read.
+// Bits 6 and 7 are unused and read as 1.
+uint8_t input_read() {
+    uint8_t select = memory[JOYPAD_REG] & 0x30;
+    return 0xC0 | select | input_lines(select);
+}
+
+// Only the select bits can be written. Selecting a group in which a
+// button is held pulls its line low, which requests the interrupt too.
+void input_write(uint8_t value) {
+    uint8_t before = input_lines(memory[JOYPAD_REG]);
+    memory[JOYPAD_REG] = 0xCF | (value & 0x30);
+    if (before & ~input_lines(value)) {
+        cpu_request_interrupt(INT_JOYPAD);
     }
-    
-    memory_write(JOYPAD_REG, joypad);
 }
 
 uint8_t input_get_joypad() {
     return memory_read(JOYPAD_REG);
 }
 
-void handle_input() {
-    input_update();
+// Sets the held buttons from a mask with A, B, Select, Start in the low
+// nibble and Right, Left, Up, Down in the high nibble, 1 meaning pressed.
+// A selected line going low requests the joypad interrupt.
+void input_set_mask(uint8_t mask) {
+    uint8_t before = input_lines(memory[JOYPAD_REG]);
+    input_state.buttons = ~mask & 0x0F;
+    input_state.directions = (~mask >> 4) & 0x0F;
+    if (before & ~input_lines(memory[JOYPAD_REG])) {
+        cpu_request_interrupt(INT_JOYPAD);
+    }
+}
+
+// The held buttons as a mask for input_set_mask()
+uint8_t input_get_mask() {
+    return (~input_state.buttons & 0x0F) | (~input_state.directions & 0x0F) << 4;
 }
 
 void init_input() {
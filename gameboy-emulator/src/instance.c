@@ -0,0 +1,268 @@
+// instance.c - Suspended emulator instances with copy-on-write forking
+#include <string.h>
+#include "gameboy.h"
+
+// An instance keeps its memory as reference-counted 4KB pages. Forking
+// copies the page table and bumps the counts; a page is duplicated only
+// when an instance that shares it is suspended with that page written.
+//
+// Only one instance per thread runs at a time, in the live globals. Activating an
+// instance copies in just the pages that differ from what memory[] and
+// cartridge RAM already hold, which for siblings of a fork is the few
+// pages they have written since.
+typedef struct {
+    uint32_t refs;
+    uint8_t data[PAGE_SIZE];
+} GB_Page;
+
+struct GB_Instance {
+    Core_State core;
+    Cartridge *cartridge;
+    GB_Page *pages[MEMORY_PAGES];
+    GB_Page *ram_pages[CART_RAM_PAGES];
+};
+
+// Pages currently mirrored by memory[] and cartridge RAM. Each holds a
+// reference so a freed page cannot be mistaken for a new one.
+static GB_LOCAL GB_Page *resident_pages[MEMORY_PAGES];
+static GB_LOCAL GB_Page *resident_ram_pages[CART_RAM_PAGES];
+static GB_LOCAL Cartridge *resident_cartridge;
+static GB_LOCAL GB_Instance *active_instance;
+
+static GB_Page *page_new(const uint8_t *data, size_t size) {
+    GB_Page *page = malloc(sizeof(GB_Page));
+    if (page) {
+        page->refs = 1;
+        memcpy(page->data, data, size);
+    }
+    return page;
+}
+
+// Counts are atomic because instances run on different threads may
+// still share pages they were forked from
+static GB_Page *page_ref(GB_Page *page) {
+    if (page) __atomic_fetch_add(&page->refs, 1, __ATOMIC_RELAXED);
+    return page;
+}
+
+static void page_release(GB_Page *page) {
+    if (page && __atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(page);
+    }
+}
+
+static uint32_t page_refs(const GB_Page *page) {
+    return __atomic_load_n(&page->refs, __ATOMIC_ACQUIRE);
+}
+
+static int ram_page_count(const Cartridge *cartridge) {
+    return (cartridge->ram_size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static size_t ram_page_size(const Cartridge *cartridge, int index) {
+    size_t remaining = cartridge->ram_size - (size_t)index * PAGE_SIZE;
+    return remaining < PAGE_SIZE ? remaining : PAGE_SIZE;
+}
+
+static void resident_set(GB_Page **slot, GB_Page *page) {
+    page_ref(page);
+    page_release(*slot);
+    *slot = page;
+}
+
+// Writes the live state back into the active instance. Written pages
+// that are still shared with another instance are duplicated first.
+static bool instance_sync(GB_Instance *instance) {
+    core_state_save(&instance->core);
+
+    for (int i = 0; i < MEMORY_PAGES; i++) {
+        if (!(memory_dirty & (1 << i))) continue;
+
+        GB_Page *page = instance->pages[i];
+        // One reference is the instance's, one is resident_pages[i]
+        if (page_refs(page) > 2) {
+            GB_Page *copy = page_new(&memory[i * PAGE_SIZE], PAGE_SIZE);
+            if (!copy) return false;
+            page_release(page);
+            instance->pages[i] = copy;
+            resident_set(&resident_pages[i], copy);
+        } else {
+            memcpy(page->data, &memory[i * PAGE_SIZE], PAGE_SIZE);
+        }
+    }
+    memory_dirty = 0;
+
+    Cartridge *cartridge = instance->cartridge;
+    for (int i = 0; i < ram_page_count(cartridge); i++) {
+        if (!(cartridge_ram_dirty & (1u << i))) continue;
+
+        GB_Page *page = instance->ram_pages[i];
+        uint8_t *data = &cartridge->ram[i * PAGE_SIZE];
+        if (page_refs(page) > 2) {
+            GB_Page *copy = page_new(data, ram_page_size(cartridge, i));
+            if (!copy) return false;
+            page_release(page);
+            instance->ram_pages[i] = copy;
+            resident_set(&resident_ram_pages[i], copy);
+        } else {
+            memcpy(page->data, data, ram_page_size(cartridge, i));
+        }
+    }
+    cartridge_ram_dirty = 0;
+    return true;
+}
+
+// Captures the running emulator as a new instance, which becomes active
+GB_Instance *gb_instance_create() {
+    if (!current_cartridge) {
+        return NULL;
+    }
+    if (active_instance) {
+        instance_sync(active_instance);
+        active_instance = NULL;
+    }
+
+    GB_Instance *instance = calloc(1, sizeof(GB_Instance));
+    if (!instance) {
+        return NULL;
+    }
+    instance->cartridge = current_cartridge;
+    core_state_save(&instance->core);
+
+    for (int i = 0; i < MEMORY_PAGES; i++) {
+        instance->pages[i] = page_new(&memory[i * PAGE_SIZE], PAGE_SIZE);
+        if (!instance->pages[i]) goto fail;
+        resident_set(&resident_pages[i], instance->pages[i]);
+    }
+    for (int i = 0; i < ram_page_count(current_cartridge); i++) {
+        instance->ram_pages[i] = page_new(&current_cartridge->ram[i * PAGE_SIZE],
+                                          ram_page_size(current_cartridge, i));
+        if (!instance->ram_pages[i]) goto fail;
+        resident_set(&resident_ram_pages[i], instance->ram_pages[i]);
+    }
+
+    resident_cartridge = current_cartridge;
+    memory_dirty = 0;
+    cartridge_ram_dirty = 0;
+    active_instance = instance;
+    return instance;
+
+fail:
+    gb_instance_free(instance);
+    return NULL;
+}
+
+// Makes a child that shares every page with parent. No memory is copied.
+GB_Instance *gb_instance_fork(GB_Instance *parent) {
+    if (parent == active_instance && !instance_sync(parent)) {
+        return NULL;
+    }
+
+    GB_Instance *child = malloc(sizeof(GB_Instance));
+    if (!child) {
+        return NULL;
+    }
+    *child = *parent;
+
+    for (int i = 0; i < MEMORY_PAGES; i++) {
+        page_ref(child->pages[i]);
+    }
+    for (int i = 0; i < CART_RAM_PAGES; i++) {
+        page_ref(child->ram_pages[i]);
+    }
+    return child;
+}
+
+// Loads instance into the live globals, suspending the active one
+bool gb_instance_activate(GB_Instance *instance) {
+    if (instance == active_instance) {
+        return true;
+    }
+    if (active_instance && !instance_sync(active_instance)) {
+        return false;
+    }
+
+    // A different cartridge means none of the resident RAM pages apply
+    memory_bind(NULL);
+    Cartridge *cartridge = instance->cartridge;
+    current_cartridge = cartridge;
+    if (cartridge != resident_cartridge) {
+        for (int i = 0; i < CART_RAM_PAGES; i++) {
+            resident_set(&resident_ram_pages[i], NULL);
+        }
+        resident_cartridge = cartridge;
+    }
+
+    for (int i = 0; i < MEMORY_PAGES; i++) {
+        if (resident_pages[i] != instance->pages[i] || (memory_dirty & (1 << i))) {
+            memcpy(&memory[i * PAGE_SIZE], instance->pages[i]->data, PAGE_SIZE);
+            resident_set(&resident_pages[i], instance->pages[i]);
+        }
+    }
+    for (int i = 0; i < ram_page_count(cartridge); i++) {
+        if (resident_ram_pages[i] != instance->ram_pages[i] ||
+            (cartridge_ram_dirty & (1u << i))) {
+            memcpy(&cartridge->ram[i * PAGE_SIZE], instance->ram_pages[i]->data,
+                   ram_page_size(cartridge, i));
+            resident_set(&resident_ram_pages[i], instance->ram_pages[i]);
+        }
+    }
+
+    core_state_load(&instance->core);
+    memory_dirty = 0;
+    cartridge_ram_dirty = 0;
+    active_instance = instance;
+    return true;
+}
+
+// Suspends the active instance, leaving the live globals free for
+// gb_init to load another ROM
+bool gb_instance_deactivate() {
+    if (active_instance && !instance_sync(active_instance)) {
+        return false;
+    }
+    active_instance = NULL;
+    return true;
+}
+
+// Deactivates and drops this thread's references to the pages memory[]
+// mirrors, e.g. before the thread exits. The next activation here copies
+// every page in.
+bool gb_instance_release() {
+    bool ok = gb_instance_deactivate();
+    for (int i = 0; i < MEMORY_PAGES; i++) {
+        resident_set(&resident_pages[i], NULL);
+    }
+    for (int i = 0; i < CART_RAM_PAGES; i++) {
+        resident_set(&resident_ram_pages[i], NULL);
+    }
+    resident_cartridge = NULL;
+    return ok;
+}
+
+// Brings instance up to date with the live state if it is the active one
+bool gb_instance_sync(GB_Instance *instance) {
+    return instance != active_instance || instance_sync(instance);
+}
+
+// The cartridge the instance runs, which it does not own
+Cartridge *gb_instance_cartridge(const GB_Instance *instance) {
+    return instance->cartridge;
+}
+
+void gb_instance_free(GB_Instance *instance) {
+    if (!instance) {
+        return;
+    }
+    if (instance == active_instance) {
+        active_instance = NULL;
+    }
+
+    for (int i = 0; i < MEMORY_PAGES; i++) {
+        page_release(instance->pages[i]);
+    }
+    for (int i = 0; i < CART_RAM_PAGES; i++) {
+        page_release(instance->ram_pages[i]);
+    }
+    free(instance);
+}
@@ -0,0 +1,323 @@
+// link.c - Link cable between two emulators
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include "gameboy.h"
+
+// Each side runs freely on its own clock (scheduler cycles since power
+// on) and tells the other what it does as timestamped messages: READY
+// when it waits for a transfer on the external clock, CANCEL when it
+// stops waiting, DATA when it drives a transfer, TIME to say how far
+// it has got. Messages arrive in the order they were sent, so once the
+// partner's clock has passed t, everything it did before t is known.
+// Events at the same cycle on both sides count side 0's first.
+//
+// The two only wait for each other at transfers. The side driving the
+// clock waits at the end of each byte until it knows whether the
+// partner was ready by then. The side being clocked waits at each poll
+// until it knows whether a byte was driven into it before then.
+enum {
+    LINK_TIME,
+    LINK_READY,
+    LINK_CANCEL,
+    LINK_DATA,
+    LINK_CLOSE
+};
+
+#define LINK_QUEUE_SIZE 1024   // Messages per direction, a power of two
+
+static void link_send(Link *link, uint8_t type, uint8_t byte, uint16_t id, uint64_t cycles) {
+    Link_Message message = { cycles, type, byte, id };
+    if (!link->send(link, &message)) {
+        link->partner_closed = true;
+    }
+    link->stats.sent++;
+    if (cycles > link->time_sent) {
+        link->time_sent = cycles;
+    }
+}
+
+// True if the partner's event at theirs came before this side's at ours
+static bool link_before(const Link *link, uint64_t theirs, uint64_t ours) {
+    return link->side ? theirs <= ours : theirs < ours;
+}
+
+// True once every partner event before this side's at cycles is known
+static bool link_known(const Link *link, uint64_t cycles) {
+    return link->partner_time >= cycles + link->side || link->partner_closed;
+}
+
+// Applies every message that has arrived
+static void link_drain(Link *link) {
+    Link_Message message;
+    while (link->receive(link, &message)) {
+        link->stats.received++;
+        if (message.cycles > link->partner_time) {
+            link->partner_time = message.cycles;
+        }
+        switch (message.type) {
+            case LINK_READY:
+                link->partner_ready = true;
+                link->ready_byte = message.byte;
+                link->ready_id = message.id;
+                link->ready_time = message.cycles;
+                break;
+            case LINK_CANCEL:
+                link->partner_ready = false;
+                break;
+            case LINK_DATA:
+                // Only the answer to the current READY counts
+                if (link->armed && message.id == link->arm_id) {
+                    link->data_pending = true;
+                    link->data_byte = message.byte;
+                    link->data_time = message.cycles;
+                }
+                break;
+            case LINK_CLOSE:
+                link->partner_closed = true;
+                break;
+        }
+    }
+}
+
+// Blocks until the partner's clock reaches cycles or it disconnects.
+// Returns with the messages sent before then applied.
+static void link_wait_for(Link *link, uint64_t cycles) {
+    link_drain(link);
+    if (link_known(link, cycles)) {
+        return;
+    }
+
+    // Tell the partner how far this side is, or two waiting sides
+    // could each wait for the other
+    if (link->time_sent < cycles) {
+        link_send(link, LINK_TIME, 0, 0, cycles);
+    }
+    link->flush(link);
+    link->stats.waits++;
+    while (!link_known(link, cycles)) {
+        link->fill(link, true);
+        link_drain(link);
+    }
+}
+
+// Ends a byte driven by this side's clock at cycles: sends out and
+// returns what the partner had ready, or 0xFF if it was not waiting
+uint8_t link_transfer(Link *link, uint8_t out, uint64_t cycles) {
+    link_wait_for(link, cycles);
+
+    if (!link->partner_ready || !link_before(link, link->ready_time, cycles) || link->partner_closed) {
+        return 0xFF;
+    }
+    link->partner_ready = false;
+    link->stats.transfers++;
+    link_send(link, LINK_DATA, out, link->ready_id, cycles);
+    link->flush(link);
+    return link->ready_byte;
+}
+
+// This side waits for the partner's clock, with byte to send
+void link_arm(Link *link, uint8_t byte, uint64_t cycles) {
+    link->armed = true;
+    link->arm_id++;
+    link->data_pending = false;
+    link_send(link, LINK_READY, byte, link->arm_id, cycles);
+}
+
+void link_disarm(Link *link, uint64_t cycles) {
+    if (link->armed) {
+        link->armed = false;
+        link->data_pending = false;
+        link_send(link, LINK_CANCEL, 0, 0, cycles);
+    }
+}
+
+// Checks, at cycles, whether the partner has clocked a byte in. Stores
+// it in in and returns true if so.
+bool link_poll(Link *link, uint64_t cycles, uint8_t *in) {
+    link_wait_for(link, cycles);
+
+    if (!link->data_pending || !link_before(link, link->data_time, cycles)) {
+        return false;
+    }
+    link->armed = false;
+    link->data_pending = false;
+    link->stats.transfers++;
+    *in = link->data_byte;
+    return true;
+}
+
+// Reports this side's clock and picks up messages. Called once a frame,
+// so a partner waiting on this side is held up by a frame at most.
+void link_sync(Link *link, uint64_t cycles) {
+    link->fill(link, false);
+    link_drain(link);
+    if (link->time_sent < cycles) {
+        link_send(link, LINK_TIME, 0, 0, cycles);
+    }
+    link->flush(link);
+}
+
+// Tells the partner this side is gone, so it never waits on it again
+void link_close(Link *link, uint64_t cycles) {
+    link_send(link, LINK_CLOSE, 0, 0, cycles);
+    link->flush(link);
+}
+
+void link_stats(const Link *link, Link_Stats *stats) {
+    *stats = link->stats;
+}
+
+// In-process backend: a lock-free single-producer single-consumer ring
+// per direction. Each index is written by one side only, and each side
+// keeps a copy of the other's index so it reads the shared one only
+// when the copy says the ring is full or empty.
+typedef struct {
+    Link_Message slots[LINK_QUEUE_SIZE];
+    _Alignas(64) uint64_t head;     // Next slot to read, written by the consumer
+    _Alignas(64) uint64_t tail;     // Next slot to write, written by the producer
+} Link_Queue;
+
+typedef struct {
+    Link link;                      // First, so a Link * is a Pipe_End *
+    Link_Queue *in;
+    Link_Queue *out;
+    uint64_t out_head;              // Cached out->head
+    uint64_t in_tail;               // Cached in->tail
+} Pipe_End;
+
+struct Link_Pipe {
+    Pipe_End ends[2];
+    Link_Queue queues[2];
+};
+
+static bool pipe_send(Link *link, const Link_Message *message) {
+    Pipe_End *end = (Pipe_End *)link;
+    Link_Queue *queue = end->out;
+    uint64_t tail = queue->tail;
+
+    // A full ring means the partner is far behind; it drains every
+    // frame, so this waits a frame of its time at most
+    while (tail - end->out_head == LINK_QUEUE_SIZE) {
+        end->out_head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if (tail - end->out_head == LINK_QUEUE_SIZE) {
+            link->stats.syscalls++;
+            sched_yield();
+        }
+    }
+
+    queue->slots[tail % LINK_QUEUE_SIZE] = *message;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool pipe_receive(Link *link, Link_Message *message) {
+    Pipe_End *end = (Pipe_End *)link;
+    Link_Queue *queue = end->in;
+    uint64_t head = queue->head;
+
+    if (head == end->in_tail) {
+        end->in_tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if (head == end->in_tail) {
+            return false;
+        }
+    }
+
+    *message = queue->slots[head % LINK_QUEUE_SIZE];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Messages are visible as soon as they are sent
+static void pipe_flush(Link *link) {
+    (void)link;
+}
+
+static void pipe_fill(Link *link, bool block) {
+    if (block) {
+        link->stats.syscalls++;
+        sched_yield();
+    }
+}
+
+// Creates a cable with two ends, one for each emulator thread
+Link_Pipe *link_pipe_create() {
+    Link_Pipe *pipe = aligned_alloc(64, (sizeof(Link_Pipe) + 63) & ~(size_t)63);
+    if (!pipe) {
+        return NULL;
+    }
+    memset(pipe, 0, sizeof(Link_Pipe));
+
+    for (int side = 0; side < 2; side++) {
+        Pipe_End *end = &pipe->ends[side];
+        end->link.send = pipe_send;
+        end->link.receive = pipe_receive;
+        end->link.flush = pipe_flush;
+        end->link.fill = pipe_fill;
+        end->link.side = side;
+        end->out = &pipe->queues[side];
+        end->in = &pipe->queues[side ^ 1];
+    }
+    return pipe;
+}
+
+Link *link_pipe_end(Link_Pipe *pipe, int side) {
+    return &pipe->ends[side].link;
+}
+
+void link_pipe_free(Link_Pipe *pipe) {
+    free(pipe);
+}
+
+static double link_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *link_player_thread(void *arg) {
+    Link_Player *player = arg;
+    double start = link_seconds();
+
+    if (!gb_init(player->rom_file)) {
+        cartridge_free();
+        player->failed = true;
+        if (player->link) {
+            link_close(player->link, 0);
+        }
+        return NULL;
+    }
+
+    serial_bind(player->serial);
+    serial_connect(player->link);
+    for (uint32_t frame = 0; frame < player->frames; frame++) {
+        gb_run_frame();
+        serial_sync();
+    }
+    serial_connect(NULL);
+    serial_bind(NULL);
+    cartridge_free();
+
+    player->seconds = link_seconds() - start;
+    return NULL;
+}
+
+// Runs each player on a thread of its own until all are done. Returns
+// the wall time taken, or a negative value if a thread did not start.
+double link_run(Link_Player *players, int count) {
+    pthread_t threads[count];
+    double start = link_seconds();
+    int started = 0;
+
+    for (; started < count; started++) {
+        players[started].failed = false;
+        if (pthread_create(&threads[started], NULL, link_player_thread, &players[started]) != 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return started == count ? link_seconds() - start : -1;
+}
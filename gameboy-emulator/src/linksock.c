@@ -0,0 +1,204 @@
+// linksock.c - Link cable over a local UNIX socket
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "gameboy.h"
+
+// Messages are batched both ways. Sending only appends to a buffer that
+// goes out in one write when the protocol flushes, which it does once a
+// frame and before it waits for the partner. Receiving reads whatever
+// has arrived in one read into a buffer that the protocol then drains,
+// without a system call per message.
+#define SOCKET_MESSAGE_SIZE 12     // Cycles, type, byte, id
+#define SOCKET_BUFFER_SIZE  (256 * SOCKET_MESSAGE_SIZE)
+
+typedef struct {
+    Link link;                     // First, so a Link * is a Socket_End *
+    int fd;
+    uint8_t out[SOCKET_BUFFER_SIZE];
+    size_t out_length;
+    uint8_t in[SOCKET_BUFFER_SIZE];
+    size_t in_start;
+    size_t in_length;
+} Socket_End;
+
+// Fixed little-endian layout, so padding never goes over the wire
+static void socket_encode(uint8_t *p, const Link_Message *message) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = message->cycles >> (8 * i);
+    }
+    p[8] = message->type;
+    p[9] = message->byte;
+    p[10] = message->id;
+    p[11] = message->id >> 8;
+}
+
+static void socket_decode(const uint8_t *p, Link_Message *message) {
+    message->cycles = 0;
+    for (int i = 0; i < 8; i++) {
+        message->cycles |= (uint64_t)p[i] << (8 * i);
+    }
+    message->type = p[8];
+    message->byte = p[9];
+    message->id = p[10] | p[11] << 8;
+}
+
+static void socket_flush(Link *link) {
+    Socket_End *end = (Socket_End *)link;
+    size_t done = 0;
+
+    while (done < end->out_length && !link->partner_closed) {
+        link->stats.syscalls++;
+        ssize_t written = send(end->fd, end->out + done, end->out_length - done, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            link->partner_closed = true;
+            break;
+        }
+        done += written;
+    }
+    end->out_length = 0;
+}
+
+static bool socket_send(Link *link, const Link_Message *message) {
+    Socket_End *end = (Socket_End *)link;
+    if (end->out_length + SOCKET_MESSAGE_SIZE > SOCKET_BUFFER_SIZE) {
+        socket_flush(link);
+    }
+    socket_encode(end->out + end->out_length, message);
+    end->out_length += SOCKET_MESSAGE_SIZE;
+    return !link->partner_closed;
+}
+
+static bool socket_receive(Link *link, Link_Message *message) {
+    Socket_End *end = (Socket_End *)link;
+    if (end->in_length - end->in_start < SOCKET_MESSAGE_SIZE) {
+        return false;
+    }
+    socket_decode(end->in + end->in_start, message);
+    end->in_start += SOCKET_MESSAGE_SIZE;
+    return true;
+}
+
+// Reads what has arrived behind any partial message still buffered. A
+// closed socket reads as the partner leaving.
+static void socket_fill(Link *link, bool block) {
+    Socket_End *end = (Socket_End *)link;
+    if (link->partner_closed) {
+        return;
+    }
+
+    size_t left = end->in_length - end->in_start;
+    memmove(end->in, end->in + end->in_start, left);
+    end->in_start = 0;
+    end->in_length = left;
+
+    for (;;) {
+        link->stats.syscalls++;
+        ssize_t count = recv(end->fd, end->in + end->in_length, SOCKET_BUFFER_SIZE - end->in_length,
+                             block ? 0 : MSG_DONTWAIT);
+        if (count > 0) {
+            end->in_length += count;
+            return;
+        }
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        link->partner_closed = true;
+        return;
+    }
+}
+
+static Link *socket_end(int fd, int side) {
+    Socket_End *end = calloc(1, sizeof(Socket_End));
+    if (!end) {
+        close(fd);
+        return NULL;
+    }
+    end->fd = fd;
+    end->link.send = socket_send;
+    end->link.receive = socket_receive;
+    end->link.flush = socket_flush;
+    end->link.fill = socket_fill;
+    end->link.side = side;
+    return &end->link;
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *address) {
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        printf("Link socket path too long: %s\n", path);
+        return false;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+// Creates the socket path and waits for the other emulator to connect.
+// The listening side is side 0.
+Link *link_socket_listen(const char *path) {
+    struct sockaddr_un address;
+    if (!socket_address(path, &address)) {
+        return NULL;
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        return NULL;
+    }
+    unlink(path);
+    if (bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, 1) != 0) {
+        printf("Failed to listen on link socket: %s\n", path);
+        close(server);
+        return NULL;
+    }
+
+    int fd;
+    do {
+        fd = accept(server, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    close(server);
+    unlink(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    return socket_end(fd, 0);
+}
+
+// Connects to an emulator listening on path, as side 1
+Link *link_socket_connect(const char *path) {
+    struct sockaddr_un address;
+    if (!socket_address(path, &address)) {
+        return NULL;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        printf("Failed to connect to link socket: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    return socket_end(fd, 1);
+}
+
+// Closes the socket. Unplug the end with serial_connect(NULL) first so
+// the partner hears it go.
+void link_socket_close(Link *link) {
+    if (!link) {
+        return;
+    }
+    Socket_End *end = (Socket_End *)link;
+    close(end->fd);
+    free(end);
+}
@@ -0,0 +1,619 @@
+// lockstep.c - Lockstep execution of many lanes of the same ROM
+#include <string.h>
+#include "gameboy.h"
+
+// Interrupt registers
+#define IF_REG 0xFF0F
+#define IE_REG 0xFFFF
+
+// Lanes per SIMD vector
+#define LANE_VECTOR 16
+
+// Longest scalar run on one lane before the others get a turn
+#define SCALAR_RUN_MAX 64
+
+// Most cycles a lane may run ahead of its peripherals, so the deferred
+// cycles plus one more instruction fit the uint8_t update functions
+#define HORIZON_MAX (255 - 24)
+
+// Lanes share the ROM and start from one state, so they tend to sit at
+// the same PC. Each step picks the lane that is furthest behind and
+// gathers every lane at the same PC. If the instruction there only
+// touches registers, all of them execute it together on the
+// structure-of-arrays register file below, 16 lanes per vector.
+// Anything else, such as memory access, I/O or interrupts, runs on the
+// lane alone through gb_step(). Lanes are slots of an arena, so loading
+// one into the live globals is cheap.
+//
+// Vector steps do not run the PPU, timer and scheduler. Each lane
+// counts the cycles it owes them and settles up before its next scalar
+// instruction. A lane only takes vector steps while no peripheral event
+// falls within the cycles owed, so settling up in one go gives the
+// same result as updating after every instruction.
+typedef uint8_t Lane_Vector __attribute__((vector_size(LANE_VECTOR)));
+
+// Rows of the register file, in operand encoding order. F takes the
+// (HL) slot, which the vector path never sees as an operand.
+enum { ROW_B, ROW_C, ROW_D, ROW_E, ROW_H, ROW_L, ROW_F, ROW_A, ROW_COUNT };
+
+struct Lockstep {
+    uint32_t lanes;
+    uint32_t stride;       // Lanes rounded up to whole vectors
+    uint8_t *regs;         // ROW_COUNT rows of stride bytes
+    uint8_t *mask;         // 0xFF for lanes in the current vector step
+    uint16_t *pc;
+    uint16_t *sp;
+    uint16_t *pending;     // Cycles not yet run through the peripherals
+    uint16_t *horizon;     // Cycles before the next peripheral event; 0 forces scalar
+    size_t *rom0_offset;
+    size_t *rom_offset;
+    uint32_t *frame_cycles;
+    uint64_t *cycles;
+    bool *running;
+    uint32_t *frame_start;
+    GB_Arena *arena;       // Everything but the registers
+    const Cartridge *rom;  // Cartridge the lanes were cloned from
+    Lockstep_Stats stats;
+};
+
+// Opcodes that only read and write registers and PC
+static const uint8_t vector_opcodes[256] = {
+//  x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xA xB xC xD xE xF
+    1, 1, 0, 1, 1, 1, 1, 1, 0, 1, 0, 1, 1, 1, 1, 1, // 0x
+    0, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, // 1x
+    1, 1, 0, 1, 1, 1, 1, 0, 1, 1, 0, 1, 1, 1, 1, 1, // 2x
+    1, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 1, // 3x
+    1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // 4x
+    1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // 5x
+    1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // 6x
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 0, 1, // 7x
+    1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // 8x
+    1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // 9x
+    1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // Ax
+    1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // Bx
+    0, 0, 1, 1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, // Cx
+    0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, // Dx
+    0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 1, 0, // Ex
+    0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0  // Fx
+};
+
+static inline Lane_Vector splat(uint8_t value) {
+    return (Lane_Vector){0} + value;
+}
+
+static inline Lane_Vector *row(Lockstep *ls, int r, uint32_t i) {
+    return (Lane_Vector *)&ls->regs[r * ls->stride + i];
+}
+
+static inline uint8_t *lane_reg(Lockstep *ls, int r, uint32_t lane) {
+    return &ls->regs[r * ls->stride + lane];
+}
+
+static inline void store(Lane_Vector *dst, Lane_Vector value, Lane_Vector mask) {
+    *dst = (value & mask) | (*dst & ~mask);
+}
+
+// Cycles the lane's peripherals can go without an update
+static uint16_t lane_horizon() {
+    if (cpu.halted || cpu.locked || cpu.ei_pending || dma_active) {
+        return 0;
+    }
+    if (cpu.interrupts_enabled && (memory_read(IE_REG) & memory_read(IF_REG) & 0x1F)) {
+        return 0;
+    }
+
+    uint32_t horizon = HORIZON_MAX;
+    uint32_t ppu_horizon = ppu_cycles_to_event();
+    uint32_t timer_horizon = timer_cycles_to_event();
+    uint32_t scheduler_horizon = scheduler_cycles_to_event();
+    if (ppu_horizon < horizon) horizon = ppu_horizon;
+    if (timer_horizon < horizon) horizon = timer_horizon;
+    if (scheduler_horizon < horizon) horizon = scheduler_horizon;
+    return horizon;
+}
+
+// Loads lane into the live globals and settles the cycles it owes
+static void lane_enter(Lockstep *ls, uint32_t lane) {
+    gb_arena_select(ls->arena, lane);
+
+    cpu.a = *lane_reg(ls, ROW_A, lane);
+    cpu.f = *lane_reg(ls, ROW_F, lane);
+    cpu.b = *lane_reg(ls, ROW_B, lane);
+    cpu.c = *lane_reg(ls, ROW_C, lane);
+    cpu.d = *lane_reg(ls, ROW_D, lane);
+    cpu.e = *lane_reg(ls, ROW_E, lane);
+    cpu.h = *lane_reg(ls, ROW_H, lane);
+    cpu.l = *lane_reg(ls, ROW_L, lane);
+    cpu.pc = ls->pc[lane];
+    cpu.sp = ls->sp[lane];
+
+    uint8_t pending = ls->pending[lane];
+    if (pending) {
+        update_ppu(pending);
+        update_timer(pending);
+        scheduler_advance(pending);
+        ls->pending[lane] = 0;
+    }
+}
+
+// Stores the loaded lane's registers back into the register file
+static void lane_exit(Lockstep *ls, uint32_t lane) {
+    *lane_reg(ls, ROW_A, lane) = cpu.a;
+    *lane_reg(ls, ROW_F, lane) = cpu.f;
+    *lane_reg(ls, ROW_B, lane) = cpu.b;
+    *lane_reg(ls, ROW_C, lane) = cpu.c;
+    *lane_reg(ls, ROW_D, lane) = cpu.d;
+    *lane_reg(ls, ROW_E, lane) = cpu.e;
+    *lane_reg(ls, ROW_H, lane) = cpu.h;
+    *lane_reg(ls, ROW_L, lane) = cpu.l;
+    ls->pc[lane] = cpu.pc;
+    ls->sp[lane] = cpu.sp;
+    ls->horizon[lane] = lane_horizon();
+    ls->rom0_offset[lane] = current_cartridge->rom0_offset;
+    ls->rom_offset[lane] = current_cartridge->rom_offset;
+}
+
+// Runs lane on its own until it reaches an instruction the other lanes
+// can join in on
+static void lane_run_scalar(Lockstep *ls, uint32_t lane) {
+    lane_enter(ls, lane);
+
+    for (int n = 0; n < SCALAR_RUN_MAX; n++) {
+        uint8_t cycles = gb_step();
+        ls->cycles[lane] += cycles;
+        ls->frame_cycles[lane] += cycles;
+        ls->stats.scalar_instructions++;
+
+        if (ppu.frames != ls->frame_start[lane] || ls->frame_cycles[lane] >= FRAME_CYCLES) {
+            ls->running[lane] = false;
+            break;
+        }
+        if (cpu.pc < 0x8000 && !cpu.halted && !dma_active &&
+            vector_opcodes[cartridge_read(cpu.pc)]) {
+            break;
+        }
+    }
+
+    lane_exit(ls, lane);
+}
+
+// Code at pc as seen by lane, or NULL if it is not in ROM. Operands may
+// not cross a bank boundary.
+static const uint8_t *lane_code(Lockstep *ls, uint32_t lane, uint16_t pc) {
+    size_t offset;
+    if (pc < ROM_BANK_SIZE - 2) {
+        offset = ls->rom0_offset[lane] + pc;
+    } else if (pc >= ROM_BANK_SIZE && pc < 0x8000 - 2) {
+        offset = ls->rom_offset[lane] + (pc - ROM_BANK_SIZE);
+    } else {
+        return NULL;
+    }
+
+    if (offset + 3 > ls->rom->size) {
+        return NULL;
+    }
+    return &ls->rom->data[offset];
+}
+
+static void vector_alu(Lockstep *ls, uint8_t op, int src, uint8_t imm) {
+    for (uint32_t i = 0; i < ls->stride; i += LANE_VECTOR) {
+        Lane_Vector mask = *(Lane_Vector *)&ls->mask[i];
+        Lane_Vector a = *row(ls, ROW_A, i);
+        Lane_Vector v = src >= 0 ? *row(ls, src, i) : splat(imm);
+        Lane_Vector carry = (*row(ls, ROW_F, i) >> 4) & 1;
+        Lane_Vector result, flags;
+
+        switch (op) {
+            case 0: // ADD
+            case 1: // ADC
+            {
+                Lane_Vector carry_in = op == 1 ? carry : splat(0);
+                Lane_Vector sum = a + v;
+                result = sum + carry_in;
+                flags = (((Lane_Vector)(sum < a) | (Lane_Vector)(result < sum)) & FLAG_C) |
+                        ((Lane_Vector)((a & 0x0F) + (v & 0x0F) + carry_in > 0x0F) & FLAG_H);
+                break;
+            }
+
+            case 2: // SUB
+            case 3: // SBC
+            case 7: // CP
+            {
+                Lane_Vector carry_in = op == 3 ? carry : splat(0);
+                Lane_Vector difference = a - v;
+                result = difference - carry_in;
+                flags = FLAG_N |
+                        (((Lane_Vector)(a < v) | (Lane_Vector)(difference < carry_in)) & FLAG_C) |
+                        ((Lane_Vector)((a & 0x0F) < (v & 0x0F) + carry_in) & FLAG_H);
+                break;
+            }
+
+            case 4: // AND
+                result = a & v;
+                flags = splat(FLAG_H);
+                break;
+
+            case 5: // XOR
+                result = a ^ v;
+                flags = splat(0);
+                break;
+
+            default: // OR
+                result = a | v;
+                flags = splat(0);
+                break;
+        }
+
+        flags |= (Lane_Vector)(result == 0) & FLAG_Z;
+        if (op != 7) {
+            store(row(ls, ROW_A, i), result, mask);
+        }
+        store(row(ls, ROW_F, i), flags, mask);
+    }
+}
+
+// INC r and DEC r
+static void vector_inc_dec(Lockstep *ls, int reg, bool decrement) {
+    for (uint32_t i = 0; i < ls->stride; i += LANE_VECTOR) {
+        Lane_Vector mask = *(Lane_Vector *)&ls->mask[i];
+        Lane_Vector value = *row(ls, reg, i);
+        Lane_Vector flags = *row(ls, ROW_F, i) & FLAG_C;
+
+        if (decrement) {
+            flags |= FLAG_N | ((Lane_Vector)((value & 0x0F) == 0) & FLAG_H);
+            value -= 1;
+        } else {
+            value += 1;
+            flags |= (Lane_Vector)((value & 0x0F) == 0) & FLAG_H;
+        }
+        flags |= (Lane_Vector)(value == 0) & FLAG_Z;
+
+        store(row(ls, reg, i), value, mask);
+        store(row(ls, ROW_F, i), flags, mask);
+    }
+}
+
+// RLCA, RRCA, RLA, RRA
+static void vector_rotate_a(Lockstep *ls, uint8_t op) {
+    for (uint32_t i = 0; i < ls->stride; i += LANE_VECTOR) {
+        Lane_Vector mask = *(Lane_Vector *)&ls->mask[i];
+        Lane_Vector a = *row(ls, ROW_A, i);
+        Lane_Vector carry_in = (*row(ls, ROW_F, i) >> 4) & 1;
+        Lane_Vector carry_out = (op & 1) ? a & 1 : a >> 7;
+        Lane_Vector fill = op < 2 ? carry_out : carry_in;
+
+        a = (op & 1) ? (a >> 1) | (fill << 7) : (a << 1) | fill;
+        store(row(ls, ROW_A, i), a, mask);
+        store(row(ls, ROW_F, i), carry_out << 4, mask);
+    }
+}
+
+// 16-bit operations on BC, DE and HL, carrying between the byte rows
+static void vector_pair(Lockstep *ls, uint8_t opcode, const uint8_t *code) {
+    int pair = opcode >> 4;
+    int hi = pair * 2;
+    int lo = pair * 2 + 1;
+
+    for (uint32_t i = 0; i < ls->stride; i += LANE_VECTOR) {
+        Lane_Vector mask = *(Lane_Vector *)&ls->mask[i];
+        Lane_Vector high = *row(ls, hi, i);
+        Lane_Vector low = *row(ls, lo, i);
+
+        switch (opcode & 0x0F) {
+            case 0x01: // LD rr, d16
+                store(row(ls, lo, i), splat(code[1]), mask);
+                store(row(ls, hi, i), splat(code[2]), mask);
+                break;
+
+            case 0x03: // INC rr
+                low += 1;
+                store(row(ls, lo, i), low, mask);
+                store(row(ls, hi, i), high - (Lane_Vector)(low == 0), mask);
+                break;
+
+            case 0x0B: // DEC rr
+                store(row(ls, hi, i), high + (Lane_Vector)(low == 0), mask);
+                store(row(ls, lo, i), low - 1, mask);
+                break;
+
+            case 0x09: // ADD HL, rr
+            {
+                Lane_Vector h = *row(ls, ROW_H, i);
+                Lane_Vector l = *row(ls, ROW_L, i);
+                Lane_Vector new_l = l + low;
+                Lane_Vector carry = (Lane_Vector)(new_l < l) & 1;
+                Lane_Vector sum = h + high;
+                Lane_Vector new_h = sum + carry;
+                Lane_Vector flags = (*row(ls, ROW_F, i) & FLAG_Z) |
+                    (((Lane_Vector)(sum < h) | (Lane_Vector)(new_h < sum)) & FLAG_C) |
+                    ((Lane_Vector)((h & 0x0F) + (high & 0x0F) + carry > 0x0F) & FLAG_H);
+                store(row(ls, ROW_L, i), new_l, mask);
+                store(row(ls, ROW_H, i), new_h, mask);
+                store(row(ls, ROW_F, i), flags, mask);
+                break;
+            }
+        }
+    }
+}
+
+static void vector_execute(Lockstep *ls, const uint8_t *code) {
+    uint8_t opcode = code[0];
+
+    if (opcode >= 0x40 && opcode < 0x80) {
+        // LD r, r'
+        int dst = (opcode >> 3) & 0x07;
+        int src = opcode & 0x07;
+        for (uint32_t i = 0; i < ls->stride; i += LANE_VECTOR) {
+            store(row(ls, dst, i), *row(ls, src, i), *(Lane_Vector *)&ls->mask[i]);
+        }
+    } else if (opcode >= 0x80 && opcode < 0xC0) {
+        vector_alu(ls, (opcode >> 3) & 0x07, opcode & 0x07, 0);
+    } else if (opcode >= 0xC0) {
+        // ALU A, d8; jumps are handled per lane
+        if ((opcode & 0x07) == 0x06) {
+            vector_alu(ls, (opcode >> 3) & 0x07, -1, code[1]);
+        }
+    } else switch (opcode & 0x0F) {
+        case 0x01: case 0x03: case 0x09: case 0x0B:
+            vector_pair(ls, opcode, code);
+            break;
+
+        case 0x04: case 0x0C: // INC r
+            vector_inc_dec(ls, (opcode >> 3) & 0x07, false);
+            break;
+
+        case 0x05: case 0x0D: // DEC r
+            vector_inc_dec(ls, (opcode >> 3) & 0x07, true);
+            break;
+
+        case 0x06: case 0x0E: // LD r, d8
+            for (uint32_t i = 0; i < ls->stride; i += LANE_VECTOR) {
+                store(row(ls, (opcode >> 3) & 0x07, i), splat(code[1]),
+                      *(Lane_Vector *)&ls->mask[i]);
+            }
+            break;
+
+        case 0x07: case 0x0F:
+            if (opcode < 0x20) {
+                vector_rotate_a(ls, opcode >> 3);
+                break;
+            }
+            for (uint32_t i = 0; i < ls->stride; i += LANE_VECTOR) {
+                Lane_Vector mask = *(Lane_Vector *)&ls->mask[i];
+                Lane_Vector f = *row(ls, ROW_F, i);
+                switch (opcode) {
+                    case 0x2F: // CPL
+                        store(row(ls, ROW_A, i), ~*row(ls, ROW_A, i), mask);
+                        store(row(ls, ROW_F, i), f | (FLAG_N | FLAG_H), mask);
+                        break;
+                    case 0x37: // SCF
+                        store(row(ls, ROW_F, i), (f & FLAG_Z) | FLAG_C, mask);
+                        break;
+                    case 0x3F: // CCF
+                        store(row(ls, ROW_F, i), (f & (FLAG_Z | FLAG_C)) ^ FLAG_C, mask);
+                        break;
+                }
+            }
+            break;
+    }
+}
+
+// Instruction length for the vector opcodes
+static uint8_t vector_length(uint8_t opcode) {
+    switch (opcode) {
+        case 0x01: case 0x11: case 0x21: case 0xC2: case 0xC3: case 0xCA:
+        case 0xD2: case 0xDA:
+            return 3;
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+            return 2;
+        default:
+            if ((opcode < 0x40 && (opcode & 0x07) == 0x06) ||
+                (opcode >= 0xC0 && (opcode & 0x07) == 0x06)) {
+                return 2;
+            }
+            return 1;
+    }
+}
+
+// Moves each lane of the step past the instruction, taking branches per
+// lane, and charges its cycles
+static void vector_retire(Lockstep *ls, const uint8_t *code, uint16_t pc) {
+    uint8_t opcode = code[0];
+    uint16_t next = pc + vector_length(opcode);
+    uint8_t base_cycles = opcode_cycles[opcode];
+    bool conditional = (opcode & 0xE7) == 0x20 || (opcode & 0xE7) == 0xC2;
+    uint16_t target = next;
+
+    if (opcode == 0x18 || (opcode & 0xE7) == 0x20) {
+        target = next + (int8_t)code[1];
+    } else if (opcode == 0xC3 || (opcode & 0xE7) == 0xC2) {
+        target = code[1] | (code[2] << 8);
+    }
+
+    uint32_t count = 0;
+    for (uint32_t lane = 0; lane < ls->lanes; lane++) {
+        if (!ls->mask[lane]) continue;
+
+        uint8_t cycles = base_cycles;
+        uint16_t new_pc = target;
+        if (opcode == 0xE9) {
+            // JP (HL)
+            new_pc = (*lane_reg(ls, ROW_H, lane) << 8) | *lane_reg(ls, ROW_L, lane);
+        } else if (conditional) {
+            uint8_t f = *lane_reg(ls, ROW_F, lane);
+            bool flag = (opcode & 0x10) ? (f & FLAG_C) : (f & FLAG_Z);
+            if (flag == ((opcode & 0x08) != 0)) {
+                cycles += 4;
+            } else {
+                new_pc = next;
+            }
+        }
+
+        ls->pc[lane] = new_pc;
+        ls->pending[lane] += cycles;
+        ls->cycles[lane] += cycles;
+        ls->frame_cycles[lane] += cycles;
+        if (ls->frame_cycles[lane] >= FRAME_CYCLES) {
+            ls->running[lane] = false;
+        }
+        count++;
+    }
+
+    ls->stats.vector_steps++;
+    ls->stats.vector_instructions += count;
+}
+
+// Runs the instruction at lead's PC on every lane that can take it.
+// Returns false if lead has to run it alone.
+static bool vector_step(Lockstep *ls, uint32_t lead) {
+    uint16_t pc = ls->pc[lead];
+    const uint8_t *code = lane_code(ls, lead, pc);
+    if (!code || !vector_opcodes[code[0]]) {
+        return false;
+    }
+
+    // Worst case cost, with any branch taken
+    uint16_t cost = opcode_cycles[code[0]] + 4;
+    if (ls->pending[lead] + cost >= ls->horizon[lead]) {
+        return false;
+    }
+
+    // Lanes join only if they see the same bank in pc's window
+    size_t *offsets = pc >= ROM_BANK_SIZE ? ls->rom_offset : ls->rom0_offset;
+    size_t rom_offset = offsets[lead];
+    for (uint32_t lane = 0; lane < ls->lanes; lane++) {
+        bool join = ls->running[lane] && ls->pc[lane] == pc &&
+                    ls->pending[lane] + cost < ls->horizon[lane] &&
+                    offsets[lane] == rom_offset;
+        ls->mask[lane] = join ? 0xFF : 0x00;
+    }
+
+    vector_execute(ls, code);
+    vector_retire(ls, code, pc);
+    return true;
+}
+
+// Clones the running emulator into lanes independent copies that run in
+// lockstep. The active instance, if any, is suspended.
+Lockstep *lockstep_create(uint32_t lanes) {
+    if (!current_cartridge || lanes == 0) {
+        return NULL;
+    }
+
+    Lockstep *ls = calloc(1, sizeof(Lockstep));
+    if (!ls) {
+        return NULL;
+    }
+
+    ls->lanes = lanes;
+    ls->stride = (lanes + LANE_VECTOR - 1) / LANE_VECTOR * LANE_VECTOR;
+    ls->rom = current_cartridge;
+    ls->arena = gb_arena_create(lanes);
+
+    ls->regs = aligned_alloc(LANE_VECTOR, ROW_COUNT * ls->stride);
+    ls->mask = aligned_alloc(LANE_VECTOR, ls->stride);
+    ls->pc = calloc(lanes, sizeof(uint16_t));
+    ls->sp = calloc(lanes, sizeof(uint16_t));
+    ls->pending = calloc(lanes, sizeof(uint16_t));
+    ls->horizon = calloc(lanes, sizeof(uint16_t));
+    ls->rom0_offset = calloc(lanes, sizeof(size_t));
+    ls->rom_offset = calloc(lanes, sizeof(size_t));
+    ls->frame_cycles = calloc(lanes, sizeof(uint32_t));
+    ls->cycles = calloc(lanes, sizeof(uint64_t));
+    ls->running = calloc(lanes, sizeof(bool));
+    ls->frame_start = calloc(lanes, sizeof(uint32_t));
+
+    if (!ls->arena || !ls->regs || !ls->mask || !ls->pc || !ls->sp || !ls->pending ||
+        !ls->horizon || !ls->rom0_offset || !ls->rom_offset || !ls->frame_cycles ||
+        !ls->cycles || !ls->running || !ls->frame_start) {
+        lockstep_free(ls);
+        return NULL;
+    }
+    memset(ls->regs, 0, ROW_COUNT * ls->stride);
+    memset(ls->mask, 0, ls->stride);
+
+    for (uint32_t i = 0; i < lanes; i++) {
+        if (gb_arena_add(ls->arena) < 0) {
+            lockstep_free(ls);
+            return NULL;
+        }
+        // Every lane starts from the live registers
+        lane_exit(ls, i);
+    }
+    return ls;
+}
+
+// Frees the lanes and puts back the emulator state they were cloned from
+void lockstep_free(Lockstep *ls) {
+    if (!ls) {
+        return;
+    }
+
+    gb_arena_free(ls->arena);
+    free(ls->regs);
+    free(ls->mask);
+    free(ls->pc);
+    free(ls->sp);
+    free(ls->pending);
+    free(ls->horizon);
+    free(ls->rom0_offset);
+    free(ls->rom_offset);
+    free(ls->frame_cycles);
+    free(ls->cycles);
+    free(ls->running);
+    free(ls->frame_start);
+    free(ls);
+}
+
+// Loads lane into the live globals, so cpu, memory_read() and
+// gb_state_save() see it. Meant for inspection between frames.
+void lockstep_select(Lockstep *ls, uint32_t lane) {
+    lane_enter(ls, lane);
+    lane_exit(ls, lane);
+}
+
+// Sets the buttons lane holds from the next frame on (see input_set_mask)
+void lockstep_set_input(Lockstep *ls, uint32_t lane, uint8_t mask) {
+    lane_enter(ls, lane);
+    input_set_mask(mask);
+    lane_exit(ls, lane);
+}
+
+// Runs every lane for one frame, with the same end condition as
+// gb_run_frame()
+void lockstep_run_frame(Lockstep *ls) {
+    for (uint32_t i = 0; i < ls->lanes; i++) {
+        ls->frame_start[i] = gb_arena_frames(ls->arena, i);
+        ls->frame_cycles[i] = 0;
+        ls->running[i] = true;
+    }
+
+    for (;;) {
+        // Lanes that fell behind go first, so lanes that took different
+        // paths meet up again at the same PC
+        int lead = -1;
+        for (uint32_t i = 0; i < ls->lanes; i++) {
+            if (ls->running[i] && (lead < 0 || ls->cycles[i] < ls->cycles[lead])) {
+                lead = i;
+            }
+        }
+        if (lead < 0) {
+            break;
+        }
+
+        if (!vector_step(ls, lead)) {
+            // The lanes waiting at the same PC all need the same
+            // instruction run on their own, so take them in one pass
+            uint16_t pc = ls->pc[lead];
+            for (uint32_t i = 0; i < ls->lanes; i++) {
+                if (ls->running[i] && ls->pc[i] == pc) {
+                    lane_run_scalar(ls, i);
+                }
+            }
+        }
+    }
+}
+
+void lockstep_stats(const Lockstep *ls, Lockstep_Stats *stats) {
+    *stats = ls->stats;
+}
@@ -1,64 +1,448 @@
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <unistd.h>
 #include "gameboy.h"
 
+// Rewind history size
+#define REWIND_RING_SIZE (4 * 1024 * 1024)
+
+// Frames kept in the shared memory ring
+#define SHM_SLOTS 8
+
+// Frames the recorder can hold while the writer thread catches up
+#define RECORD_BUFFERS 120
+
+// Y4M stream of 8-bit grayscale frames at the Game Boy's 59.73 Hz
+// (4194304 / 70224 = 262144 / 4389)
+#define Y4M_HEADER "YUV4MPEG2 W160 H144 F262144:4389 Ip A1:1 Cmono\n"
+#define Y4M_FRAME  "FRAME\n"
+
+// Default cap on terminal output, enough for a busy screen at full
+// speed but not for a full redraw every frame
+#define TERM_VIDEO_RATE (1024 * 1024)
+
+// Audio dumped with --audio-out and hashed with --audio-hash: 16-bit
+// stereo at 48 kHz, drained from the ring once a video frame
+#define AUDIO_OUT_RATE      48000
+#define AUDIO_RING_FRAMES   8192      // About ten video frames of samples
+#define AUDIO_BUFFER_FRAMES 1024      // Stereo frames per writer buffer
+#define AUDIO_BUFFERS       128       // About 2 seconds of slack for the disk
+#define AUDIO_HASH_LINE     32        // "<frame> <hash>\n"
+#define AUDIO_HASH_BUFFERS  256
+#define WAV_HEADER_SIZE     44
+
 volatile bool running = true;
+volatile sig_atomic_t rewind_requested = 0;
 
 void signal_handler(int sig) {
     if (sig == SIGINT) {
         printf("\nShutting down emulator...\n");
         running = false;
+    } else if (sig == SIGUSR1) {
+        rewind_requested = 1;
+    }
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [--bench] [--rewind <frames>] [--shm <name>]\n"
+           "          [--record <file.y4m>] [--record-policy drop|block]\n"
+           "          [--link-listen <path> | --link-connect <path>] [--apu-lazy]\n"
+           "          [--audio-out <file.wav>] [--audio-hash <file>]\n"
+           "          [--movie-play <file>] [--movie-record <file>] [--term-input]\n"
+           "          [--term-video] [--term-video-rate <KB/s>] <rom_file>\n", program);
+    printf("Example: %s \"roms/Tetris (World) (Rev 1).gb\"\n", program);
+    printf("  --bench            Run headless and report core throughput\n");
+    printf("  --rewind <frames>  Keep rewind history, one snapshot every <frames>;\n");
+    printf("                     send SIGUSR1 to step back one snapshot\n");
+    printf("  --shm <name>       Publish frames to the shared memory ring <name>\n");
+    printf("  --record <file>    Record every frame as Y4M video\n");
+    printf("  --record-policy    When the disk falls behind: drop frames (default)\n");
+    printf("                     or block emulation\n");
+    printf("  --link-listen <path>   Wait for another emulator to plug into a link\n");
+    printf("                         cable at the UNIX socket <path>\n");
+    printf("  --link-connect <path>  Plug into the link cable of an emulator\n");
+    printf("                         listening at <path>\n");
+    printf("  --apu-lazy         Keep sound registers correct without synthesizing\n");
+    printf("  --audio-out <file> Stream sound to a WAV file, or raw PCM for other names\n");
+    printf("  --audio-hash <file>  Write a hash of each frame's samples to <file>\n");
+    printf("  --movie-play <file>    Take the joypad from an input movie\n");
+    printf("  --movie-record <file>  Record the joypad, frame by frame, as a movie\n");
+    printf("  --term-input       Play from the keyboard: arrows or WASD, Z/X for A/B,\n");
+    printf("                     Enter for Start, Space for Select\n");
+    printf("  --term-video       Draw the screen in this terminal (needs 160x72 and\n");
+    printf("                     24-bit color)\n");
+    printf("  --term-video-rate <KB/s>  Cap terminal output (default: %d, 0 for none)\n",
+           TERM_VIDEO_RATE / 1024);
+}
+
+static Writer *record_open(const char *filename, Writer_Policy policy) {
+    return writer_open(filename, Y4M_HEADER, sizeof(Y4M_HEADER) - 1,
+                       sizeof(Y4M_FRAME) - 1 + SCREEN_WIDTH * SCREEN_HEIGHT,
+                       RECORD_BUFFERS, policy);
+}
+
+// Converts the frame just drawn into a pooled buffer and queues it
+static void record_frame(Writer *recorder) {
+    uint8_t *buffer = writer_acquire(recorder);
+    if (!buffer) {
+        return;
+    }
+    memcpy(buffer, Y4M_FRAME, sizeof(Y4M_FRAME) - 1);
+    gb_env_observe(GB_ENV_GRAYSCALE, buffer + sizeof(Y4M_FRAME) - 1);
+    writer_submit(recorder, buffer, writer_buffer_size(recorder));
+}
+
+// Where sound goes when it is dumped or hashed
+typedef struct {
+    GB_Audio_Ring *ring;
+    int16_t samples[AUDIO_RING_FRAMES * 2];
+    Writer *out;                 // NULL when only hashing
+    bool wav;
+    uint64_t bytes;              // Sample bytes queued for the file
+    Writer *hashes;              // NULL when only dumping
+} Audio_Dump;
+
+static void put_le(uint8_t *p, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+// Canonical 44-byte header for 16-bit stereo PCM of data_bytes bytes.
+// Streams too long for the format keep the largest sizes it can hold.
+static void wav_header(uint8_t *header, uint32_t rate, uint64_t data_bytes) {
+    uint32_t data = data_bytes > UINT32_MAX - 36 ? UINT32_MAX - 36 : data_bytes;
+    memcpy(header, "RIFF", 4);
+    put_le(header + 4, 36 + data, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le(header + 16, 16, 4);          // Format chunk size
+    put_le(header + 20, 1, 2);           // PCM
+    put_le(header + 22, 2, 2);           // Channels
+    put_le(header + 24, rate, 4);
+    put_le(header + 28, rate * 4, 4);    // Bytes per second
+    put_le(header + 32, 4, 2);           // Bytes per stereo frame
+    put_le(header + 34, 16, 2);          // Bits per sample
+    memcpy(header + 36, "data", 4);
+    put_le(header + 40, data, 4);
+}
+
+static bool audio_has_suffix(const char *name, const char *suffix) {
+    size_t length = strlen(name), suffix_length = strlen(suffix);
+    return length >= suffix_length && strcasecmp(name + length - suffix_length, suffix) == 0;
+}
+
+static Audio_Dump *audio_open(const char *out_file, const char *hash_file) {
+    Audio_Dump *dump = calloc(1, sizeof(Audio_Dump));
+    if (!dump) {
+        return NULL;
+    }
+    dump->ring = gb_audio_ring_create(AUDIO_OUT_RATE, AUDIO_RING_FRAMES);
+    if (!dump->ring) {
+        free(dump);
+        return NULL;
+    }
+
+    if (out_file) {
+        uint8_t header[WAV_HEADER_SIZE];
+        dump->wav = audio_has_suffix(out_file, ".wav");
+        wav_header(header, AUDIO_OUT_RATE, 0);
+        dump->out = writer_open(out_file, header, dump->wav ? WAV_HEADER_SIZE : 0,
+                                AUDIO_BUFFER_FRAMES * 4, AUDIO_BUFFERS, WRITER_DROP);
+    }
+    // A hash file with gaps would never match its golden copy, so hash
+    // lines wait for the disk instead of being dropped
+    if (hash_file) {
+        dump->hashes = writer_open(hash_file, NULL, 0, AUDIO_HASH_LINE, AUDIO_HASH_BUFFERS,
+                                   WRITER_BLOCK);
+    }
+    if ((out_file && !dump->out) || (hash_file && !dump->hashes)) {
+        writer_close(dump->out, NULL);
+        writer_close(dump->hashes, NULL);
+        gb_audio_ring_free(dump->ring);
+        free(dump);
+        return NULL;
+    }
+    apu_bind(dump->ring);
+    return dump;
+}
+
+// Takes the samples made during the frame just finished. Sample buffers
+// that find the pool empty are dropped rather than waiting on the disk.
+static void audio_frame(Audio_Dump *dump, uint32_t frame) {
+    uint32_t frames = gb_audio_ring_read(dump->ring, dump->samples, AUDIO_RING_FRAMES);
+
+    if (dump->hashes) {
+        uint8_t *line = writer_acquire(dump->hashes);
+        if (line) {
+            uint64_t hash = gb_hash(dump->samples, frames * 4, 0);
+            int length = snprintf((char *)line, AUDIO_HASH_LINE, "%u %016llx\n",
+                                  frame, (unsigned long long)hash);
+            writer_submit(dump->hashes, line, length);
+        }
+    }
+
+    for (uint32_t done = 0; dump->out && done < frames; done += AUDIO_BUFFER_FRAMES) {
+        uint32_t count = frames - done < AUDIO_BUFFER_FRAMES ? frames - done : AUDIO_BUFFER_FRAMES;
+        uint8_t *buffer = writer_acquire(dump->out);
+        if (buffer) {
+            memcpy(buffer, dump->samples + done * 2, count * 4);
+            writer_submit(dump->out, buffer, count * 4);
+            dump->bytes += count * 4;
+        }
+    }
+}
+
+// Flushes both files and fills in the WAV sizes
+static void audio_close(Audio_Dump *dump, const char *out_file, const char *hash_file) {
+    apu_bind(NULL);
+    if (dump->out) {
+        uint8_t header[WAV_HEADER_SIZE];
+        Writer_Stats stats;
+        wav_header(header, AUDIO_OUT_RATE, dump->bytes);
+        bool ok = writer_finish(dump->out, header, dump->wav ? WAV_HEADER_SIZE : 0, &stats);
+        printf("Wrote %.1f s of audio to %s (%llu buffers dropped, %llu ring overruns)%s\n",
+               dump->bytes / (4.0 * AUDIO_OUT_RATE), out_file, (unsigned long long)stats.dropped,
+               (unsigned long long)gb_audio_ring_dropped(dump->ring), ok ? "" : ", write failed");
+    }
+    if (dump->hashes) {
+        Writer_Stats stats;
+        bool ok = writer_close(dump->hashes, &stats);
+        printf("Wrote %llu audio frame hashes to %s%s\n", (unsigned long long)stats.written,
+               hash_file, ok ? "" : ", write failed");
+    }
+    gb_audio_ring_free(dump->ring);
+    free(dump);
+}
+
+// Input changes only between frames, so a recorded movie replays the
+// same. Called as each frame starts. A movie being played overrides the
+// keyboard.
+static void next_input(GB_Movie *movie, GB_Movie_Recorder *movie_recorder, bool term_input) {
+    if (movie) {
+        input_set_mask(gb_movie_next(movie));
+    } else if (term_input) {
+        input_set_mask(term_input_poll());
+    }
+    if (movie_recorder) {
+        gb_movie_record_frame(movie_recorder, input_get_mask());
     }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <rom_file>\n", argv[0]);
-        printf("Example: %s \"roms/Tetris (World) (Rev 1).gb\"\n", argv[0]);
+    const char *rom_file = NULL;
+    bool bench = false;
+    int rewind_interval = 0;
+    const char *shm_name = NULL;
+    const char *record_file = NULL;
+    Writer_Policy record_policy = WRITER_DROP;
+    const char *link_listen = NULL;
+    const char *link_connect = NULL;
+    const char *audio_out = NULL;
+    const char *audio_hash = NULL;
+    const char *movie_play = NULL;
+    const char *movie_record = NULL;
+    bool term_input = false;
+    bool term_video = false;
+    long term_video_rate = TERM_VIDEO_RATE;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            rewind_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_file = argv[++i];
+        } else if (strcmp(argv[i], "--record-policy") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "drop") == 0 || strcmp(argv[i + 1], "block") == 0)) {
+            record_policy = strcmp(argv[++i], "block") == 0 ? WRITER_BLOCK : WRITER_DROP;
+        } else if (strcmp(argv[i], "--link-listen") == 0 && i + 1 < argc) {
+            link_listen = argv[++i];
+        } else if (strcmp(argv[i], "--link-connect") == 0 && i + 1 < argc) {
+            link_connect = argv[++i];
+        } else if (strcmp(argv[i], "--audio-out") == 0 && i + 1 < argc) {
+            audio_out = argv[++i];
+        } else if (strcmp(argv[i], "--audio-hash") == 0 && i + 1 < argc) {
+            audio_hash = argv[++i];
+        } else if (strcmp(argv[i], "--movie-play") == 0 && i + 1 < argc) {
+            movie_play = argv[++i];
+        } else if (strcmp(argv[i], "--movie-record") == 0 && i + 1 < argc) {
+            movie_record = argv[++i];
+        } else if (strcmp(argv[i], "--term-video") == 0) {
+            term_video = true;
+        } else if (strcmp(argv[i], "--term-video-rate") == 0 && i + 1 < argc) {
+            term_video_rate = atol(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "--term-input") == 0) {
+            term_input = true;
+        } else if (strcmp(argv[i], "--apu-lazy") == 0) {
+            gb_apu_lazy = true;
+        } else if (argv[i][0] != '-' && !rom_file) {
+            rom_file = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!rom_file || (link_listen && link_connect) || term_video_rate < 0 || term_video_rate > UINT32_MAX) {
+        print_usage(argv[0]);
         return 1;
     }
 
-    // Set up signal handler for graceful shutdown
+    // Headless benchmark mode
+    if (bench) {
+        return bench_run(rom_file);
+    }
+
+    // Set up signal handlers for graceful shutdown and rewind
     signal(SIGINT, signal_handler);
+    signal(SIGUSR1, signal_handler);
 
     printf("Simple Game Boy Emulator\n");
-    printf("Loading ROM: %s\n", argv[1]);
-
-    // Initialize emulator components
-    init_memory();
-    init_cpu();
-    init_ppu();
-    init_timer();
-    init_input();
-
-    // Load the ROM
-    if (!load_cartridge(argv[1])) {
-        printf("Failed to load ROM: %s\n", argv[1]);
+    printf("Loading ROM: %s\n", rom_file);
+
+    // Initialize emulator components and load the ROM
+    if (!gb_init(rom_file)) {
+        return 1;
+    }
+
+    if (rewind_interval > 0 && !rewind_init(rewind_interval, REWIND_RING_SIZE)) {
+        printf("Failed to allocate rewind history\n");
+        cartridge_free();
         return 1;
     }
 
+    GB_Shm_Ring *shm = NULL;
+    if (shm_name) {
+        shm = gb_shm_create(shm_name, SHM_SLOTS);
+        if (!shm) {
+            rewind_free();
+            cartridge_free();
+            return 1;
+        }
+        ppu_render = true;
+    }
+
+    Writer *recorder = NULL;
+    if (record_file) {
+        recorder = record_open(record_file, record_policy);
+        if (!recorder) {
+            gb_shm_close(shm);
+            rewind_free();
+            cartridge_free();
+            return 1;
+        }
+        ppu_render = true;
+    }
+
+    Audio_Dump *audio = NULL;
+    if (audio_out || audio_hash) {
+        audio = audio_open(audio_out, audio_hash);
+        if (!audio) {
+            writer_close(recorder, NULL);
+            gb_shm_close(shm);
+            rewind_free();
+            cartridge_free();
+            return 1;
+        }
+    }
+
+    // Playing and recording at once converts a movie to the run-length format
+    GB_Movie *movie = NULL;
+    GB_Movie_Recorder *movie_recorder = NULL;
+    if ((movie_play && !(movie = gb_movie_open(movie_play))) ||
+        (movie_record && !(movie_recorder = gb_movie_record(movie_record)))) {
+        gb_movie_close(movie);
+        if (audio) {
+            audio_close(audio, audio_out, audio_hash);
+        }
+        writer_close(recorder, NULL);
+        gb_shm_close(shm);
+        rewind_free();
+        cartridge_free();
+        return 1;
+    }
+
+    Link *link = NULL;
+    if (link_listen || link_connect) {
+        if (link_listen) {
+            printf("Waiting for a link partner on %s...\n", link_listen);
+            link = link_socket_listen(link_listen);
+        } else {
+            link = link_socket_connect(link_connect);
+        }
+        if (!link) {
+            gb_movie_close(movie);
+            gb_movie_finish(movie_recorder);
+            if (audio) {
+                audio_close(audio, audio_out, audio_hash);
+            }
+            writer_close(recorder, NULL);
+            gb_shm_close(shm);
+            rewind_free();
+            cartridge_free();
+            return 1;
+        }
+        serial_connect(link);
+    }
+
+    if (term_input && !term_input_open()) {
+        printf("--term-input needs a terminal on stdin; ignoring it\n");
+        term_input = false;
+    }
+
     printf("ROM loaded successfully. Starting emulation...\n");
     printf("Press Ctrl+C to stop the emulator.\n");
 
+    Term_Video *video = NULL;
+    if (term_video) {
+        video = term_video_open(STDOUT_FILENO, term_video_rate);
+        ppu_render = true;
+    }
+
     // Main emulation loop
     uint64_t instruction_count = 0;
+    uint32_t last_frame = ppu.frames;
+    next_input(movie, movie_recorder, term_input);
     while (running) {
-        // Execute CPU instructions
-        execute_cpu_cycle();
+        // Execute an instruction and update PPU, input, timer and events
+        gb_step();
         instruction_count++;
 
-        // Update PPU
-        update_ppu();
-
-        // Handle input
-        handle_input();
+        // Record rewind history and publish the picture once per frame
+        if (ppu.frames != last_frame) {
+            last_frame = ppu.frames;
+            rewind_frame();
+            serial_sync();
+            if (shm) {
+                gb_shm_publish(shm, ppu_framebuffer);
+            }
+            if (recorder) {
+                record_frame(recorder);
+            }
+            if (audio) {
+                audio_frame(audio, ppu.frames);
+            }
+            if (video) {
+                term_video_present(video, ppu_framebuffer);
+            }
+            next_input(movie, movie_recorder, term_input);
+        }
 
-        // Update timer
-        update_timer();
+        if (rewind_requested) {
+            rewind_requested = 0;
+            if (rewind_step_back()) {
+                last_frame = ppu.frames;
+                printf("Rewound to frame %u (%u snapshots left)\n", ppu.frames, rewind_depth());
+            }
+        }
 
-        // Simple throttling - print status every 10000 instructions
-        if (instruction_count % 10000 == 0) {
+        // Simple throttling - print status every 10000 instructions,
+        // unless it would scroll away a picture in the terminal
+        if (instruction_count % 10000 == 0 && !video) {
             printf("Instructions executed: %llu, PC: 0x%04X, A: 0x%02X\n", 
                    instruction_count, cpu.pc, cpu.a);
         }
@@ -70,6 +454,55 @@ int main(int argc, char *argv[]) {
     }
 
     // Cleanup
+    if (video) {
+        Term_Video_Stats stats;
+        term_video_close(video, &stats);
+        printf("Terminal video: %llu frames (%llu skipped for bandwidth), %llu rows drawn, "
+               "%.1f KB/frame in %llu writes\n",
+               (unsigned long long)stats.frames, (unsigned long long)stats.frames_skipped,
+               (unsigned long long)stats.rows_drawn,
+               stats.frames ? stats.bytes / 1024.0 / stats.frames : 0.0,
+               (unsigned long long)stats.writes);
+    }
+    if (term_input) {
+        Term_Input_Stats stats;
+        term_input_close(&stats);
+        printf("Keyboard: %llu presses; read to end of frame %.1f ms mean, %.1f ms max; "
+               "up to %.1f ms between polls\n",
+               (unsigned long long)stats.keys,
+               stats.frames_measured ? 1000 * stats.latency_total / stats.frames_measured : 0.0,
+               1000 * stats.latency_max, 1000 * stats.interval_max);
+    }
+    if (link) {
+        Link_Stats stats;
+        serial_connect(NULL);
+        link_stats(link, &stats);
+        link_socket_close(link);
+        printf("Link: %llu bytes exchanged, %llu round trips, %llu messages sent, %llu syscalls\n",
+               (unsigned long long)stats.transfers, (unsigned long long)stats.waits,
+               (unsigned long long)stats.sent, (unsigned long long)stats.syscalls);
+    }
+    if (movie) {
+        printf("Input movie %s holds %llu frames\n", movie_play,
+               (unsigned long long)gb_movie_frames(movie));
+        gb_movie_close(movie);
+    }
+    if (movie_recorder && !gb_movie_finish(movie_recorder)) {
+        printf("Failed to write movie file: %s\n", movie_record);
+    }
+    if (audio) {
+        audio_close(audio, audio_out, audio_hash);
+    }
+    if (recorder) {
+        Writer_Stats stats;
+        bool ok = writer_close(recorder, &stats);
+        printf("Recorded %llu frames to %s (%llu dropped, %llu MB in %llu writes)%s\n",
+               (unsigned long long)stats.written, record_file,
+               (unsigned long long)stats.dropped, (unsigned long long)(stats.bytes >> 20),
+               (unsigned long long)stats.writes, ok ? "" : ", write failed");
+    }
+    gb_shm_close(shm);
+    rewind_free();
     cartridge_free();
     printf("Emulator stopped. Total instructions executed: %llu\n", instruction_count);
     
@@ -1,40 +1,136 @@
 // memory.c - Memory management for Game Boy emulator
 #include "gameboy.h"
 
-uint8_t memory[MEMORY_SIZE];
+#define JOYPAD_REG 0xFF00
+#define DMA_REG 0xFF46
+#define SC_REG  0xFF02
+
+// Sound registers and wave RAM
+#define APU_START 0xFF10
+#define APU_END   0xFF3F
+#define NR52_REG  0xFF26
+
+// The thread's own memory. memory points here except while a lockstep
+// lane, which keeps its own, is loaded.
+static GB_LOCAL uint8_t memory_buffer[MEMORY_SIZE];
+GB_LOCAL uint8_t *memory;
+GB_LOCAL uint16_t memory_dirty;
 
 void memory_init() {
+    memory = memory_buffer;
     for (int i = 0; i < MEMORY_SIZE; i++) {
         memory[i] = 0;
     }
+    memory_dirty = MEMORY_PAGES_ALL;
+    dma_init();
 }
 
 uint8_t memory_read(uint16_t address) {
+    // During OAM DMA the CPU only sees I/O registers and HRAM
+    if (dma_active && address < 0xFF00) {
+        return 0xFF;
+    }
+
     // ROM area (0x0000-0x7FFF) - read from cartridge
     if (address < 0x8000) {
         return cartridge_read(address);
     }
+
+    // External RAM (0xA000-0xBFFF) lives on the cartridge
+    if (address >= 0xA000 && address < 0xC000) {
+        return cartridge_ram_read(address);
+    }
     
+    // P1 depends on the buttons held, so it is made up on each read
+    if (address == JOYPAD_REG) {
+        return input_read();
+    }
+
+    // A lazy APU works out which channels are still on when asked
+    if (address == NR52_REG) {
+        apu_sync();
+    }
+
     // Other areas read from memory array
     return memory[address];
 }
 
 void memory_write(uint16_t address, uint8_t value) {
-    // ROM area is read-only, ignore writes
+    if (dma_active && address < 0xFF00) {
+        return;
+    }
+
+    // ROM area is read-only; writes there program the cartridge MBC
     if (address < 0x8000) {
+        cartridge_write(address, value);
+        return;
+    }
+
+    if (address >= 0xA000 && address < 0xC000) {
+        cartridge_ram_write(address, value);
         return;
     }
     
+    memory_dirty |= 1 << (address >> 12);
+
     // Echo RAM (0xE000-0xFDFF) mirrors WRAM (0xC000-0xDDFF)
     if (address >= 0xE000 && address < 0xFE00) {
         memory[address] = value;
         memory[address - 0x2000] = value; // Mirror to WRAM
+        memory_dirty |= 1 << ((address - 0x2000) >> 12);
+        return;
+    }
+
+    if (address == JOYPAD_REG) {
+        input_write(value);
+        return;
+    }
+
+    if (address == DMA_REG) {
+        memory[address] = value;
+        dma_start(value);
+        return;
+    }
+
+    if (address == SC_REG) {
+        memory[address] = value;
+        serial_write_control(value);
+        return;
+    }
+
+    if (address >= APU_START && address <= APU_END) {
+        apu_write(address, value);
         return;
     }
     
     memory[address] = value;
 }
 
+// Resolves the 256-byte page holding address to a host pointer, for bulk
+// copies that would otherwise go through memory_read byte by byte
+const uint8_t *memory_page_pointer(uint16_t address) {
+    address &= 0xFF00;
+
+    if (address < 0x8000) {
+        return cartridge_page_pointer(address);
+    }
+
+    if (address >= 0xA000 && address < 0xC000) {
+        return cartridge_ram_page_pointer(address);
+    }
+
+    // 0xE000 and up reads back WRAM through the echo mapping
+    if (address >= 0xE000) {
+        address -= 0x2000;
+    }
+    return &memory[address];
+}
+
+// Points memory at buffer, or back at the thread's own memory for NULL
+void memory_bind(uint8_t *buffer) {
+    memory = buffer ? buffer : memory_buffer;
+}
+
 void init_memory() {
     memory_init();
-}
\ No newline at end of file
+}
@@ -0,0 +1,236 @@
+// movie.c - Run-length encoded input movies
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gameboy.h"
+
+// A movie is a 16-byte header, "GBMV", a version and the frame count
+// (both little-endian), followed by one run per change of input: the
+// run length as an unsigned LEB128 varint, then the joypad mask held
+// for it. An hour of play is usually a few kilobytes.
+//
+// Files without the header are the older raw format, one mask byte per
+// frame, and play back just the same.
+#define MOVIE_MAGIC       "GBMV"
+#define MOVIE_VERSION     1
+#define MOVIE_HEADER_SIZE 16
+
+struct GB_Movie {
+    const uint8_t *data;       // The mapped file
+    size_t size;
+    const uint8_t *next;       // Next run, or next mask of a raw movie
+    const uint8_t *end;
+    bool raw;
+    uint64_t frames;
+    uint8_t mask;              // Mask of the current run
+    uint64_t left;             // Frames left in the current run
+};
+
+struct GB_Movie_Recorder {
+    FILE *file;
+    uint64_t frames;
+    uint8_t mask;              // Mask of the run being built
+    uint64_t run;              // Its length so far
+};
+
+static uint64_t movie_get_le(const uint8_t *p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static void movie_put_le(uint8_t *p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+// Reads a varint at *p, no further than end. Returns false if it is cut
+// short or does not fit 64 bits.
+static bool movie_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Walks every run once, so playback can trust the encoding
+static bool movie_check(const GB_Movie *movie) {
+    const uint8_t *p = movie->next;
+    uint64_t frames = 0;
+    while (p < movie->end) {
+        uint64_t run;
+        if (!movie_varint(&p, movie->end, &run) || run == 0 || p == movie->end ||
+            run > movie->frames - frames) {
+            return false;
+        }
+        p++;
+        frames += run;
+    }
+    return frames == movie->frames;
+}
+
+// Maps a movie for playback, in either format
+GB_Movie *gb_movie_open(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open movie file: %s\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    GB_Movie *movie = calloc(1, sizeof(GB_Movie));
+    if (!movie) {
+        close(fd);
+        return NULL;
+    }
+    movie->size = st.st_size;
+    if (movie->size > 0) {
+        void *data = mmap(NULL, movie->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("Failed to map movie file: %s\n", filename);
+            close(fd);
+            free(movie);
+            return NULL;
+        }
+        madvise(data, movie->size, MADV_SEQUENTIAL);
+        movie->data = data;
+    }
+    close(fd);
+
+    movie->next = movie->data;
+    movie->end = movie->data + movie->size;
+    if (movie->size >= MOVIE_HEADER_SIZE && memcmp(movie->data, MOVIE_MAGIC, 4) == 0) {
+        movie->frames = movie_get_le(movie->data + 8, 8);
+        movie->next += MOVIE_HEADER_SIZE;
+        if (movie_get_le(movie->data + 4, 4) != MOVIE_VERSION || !movie_check(movie)) {
+            printf("Unsupported or corrupt movie file: %s\n", filename);
+            gb_movie_close(movie);
+            return NULL;
+        }
+    } else {
+        movie->raw = true;
+        movie->frames = movie->size;
+    }
+    return movie;
+}
+
+// Starts the next run. Past the end every button stays released.
+static void movie_next_run(GB_Movie *movie) {
+    if (movie->next == movie->end) {
+        movie->mask = 0;
+        movie->left = UINT64_MAX;
+    } else if (movie->raw) {
+        // Equal masks in a row make one run here too
+        const uint8_t *start = movie->next;
+        movie->mask = *start;
+        while (movie->next < movie->end && *movie->next == movie->mask) {
+            movie->next++;
+        }
+        movie->left = movie->next - start;
+    } else {
+        movie_varint(&movie->next, movie->end, &movie->left);
+        movie->mask = *movie->next++;
+    }
+}
+
+// Mask for the next frame. Only the first frame of a run decodes
+// anything; the rest count down.
+uint8_t gb_movie_next(GB_Movie *movie) {
+    if (movie->left == 0) {
+        movie_next_run(movie);
+    }
+    movie->left--;
+    return movie->mask;
+}
+
+uint64_t gb_movie_frames(const GB_Movie *movie) {
+    return movie->frames;
+}
+
+void gb_movie_close(GB_Movie *movie) {
+    if (!movie) {
+        return;
+    }
+    if (movie->size > 0) {
+        munmap((void *)movie->data, movie->size);
+    }
+    free(movie);
+}
+
+static void movie_write_header(GB_Movie_Recorder *recorder) {
+    uint8_t header[MOVIE_HEADER_SIZE] = MOVIE_MAGIC;
+    movie_put_le(header + 4, MOVIE_VERSION, 4);
+    movie_put_le(header + 8, recorder->frames, 8);
+    fwrite(header, 1, sizeof(header), recorder->file);
+}
+
+// Creates filename for a movie in the run-length format
+GB_Movie_Recorder *gb_movie_record(const char *filename) {
+    GB_Movie_Recorder *recorder = calloc(1, sizeof(GB_Movie_Recorder));
+    if (!recorder) {
+        return NULL;
+    }
+    recorder->file = fopen(filename, "wb");
+    if (!recorder->file) {
+        printf("Failed to create movie file: %s\n", filename);
+        free(recorder);
+        return NULL;
+    }
+    movie_write_header(recorder);
+    return recorder;
+}
+
+static void movie_write_run(GB_Movie_Recorder *recorder) {
+    uint8_t run[11];
+    int length = 0;
+    uint64_t value = recorder->run;
+    do {
+        run[length++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+    run[length++] = recorder->mask;
+    fwrite(run, 1, length, recorder->file);
+}
+
+// Adds a frame held with mask. Runs are written when the input changes,
+// through stdio's buffer, so most frames only count.
+void gb_movie_record_frame(GB_Movie_Recorder *recorder, uint8_t mask) {
+    if (mask != recorder->mask && recorder->run > 0) {
+        movie_write_run(recorder);
+        recorder->run = 0;
+    }
+    recorder->mask = mask;
+    recorder->run++;
+    recorder->frames++;
+}
+
+// Writes the last run and the frame count and closes the file. Returns
+// false if anything failed to write.
+bool gb_movie_finish(GB_Movie_Recorder *recorder) {
+    if (!recorder) {
+        return true;
+    }
+    if (recorder->run > 0) {
+        movie_write_run(recorder);
+    }
+    bool ok = fseek(recorder->file, 0, SEEK_SET) == 0;
+    movie_write_header(recorder);
+    ok = !ferror(recorder->file) && ok;
+    ok = fclose(recorder->file) == 0 && ok;
+    free(recorder);
+    return ok;
+}
@@ -8,20 +8,30 @@
 #define SCX  0xFF43  // Scroll X
 #define LY   0xFF44  // LCD Y-Coordinate
 #define LYC  0xFF45  // LY Compare
+#define BGP  0xFF47  // Background palette
+#define OBP0 0xFF48  // Sprite palette 0
+#define OBP1 0xFF49  // Sprite palette 1
+#define WY   0xFF4A  // Window Y
+#define WX   0xFF4B  // Window X + 7
 
-// PPU state
-typedef struct {
-    uint16_t cycles;
-    uint8_t mode;
-    uint8_t line;
-} PPU_State;
+#define OAM_START   0xFE00
+#define LINE_SPRITES 10      // Sprites the hardware shows on one line
 
-PPU_State ppu;
+GB_LOCAL PPU_State ppu;
+
+// Shades (0 white to 3 black) of the last frame drawn. Lines are only
+// drawn while ppu_render is set, as nothing headless looks at them.
+GB_LOCAL uint8_t ppu_framebuffer[SCREEN_HEIGHT * SCREEN_WIDTH];
+GB_LOCAL bool ppu_render;
+
+// Length of each mode in clock cycles (V-Blank per line)
+static const uint16_t mode_cycles[4] = { 204, 456, 80, 172 };
 
 void ppu_init() {
     ppu.cycles = 0;
     ppu.mode = 0;
     ppu.line = 0;
+    ppu.frames = 0;
     
     // Initialize PPU registers
     memory_write(LCDC, 0x91); // LCD on, background on
@@ -30,6 +40,117 @@ void ppu_init() {
     memory_write(SCX, 0x00);
     memory_write(LY, 0x00);
     memory_write(LYC, 0x00);
+    memory_write(BGP, 0xFC);
+    memory_write(OBP0, 0xFF);
+    memory_write(OBP1, 0xFF);
+}
+
+// Color index (0-3) of pixel x of row y in a tile, given the address of
+// its first row
+static inline uint8_t tile_pixel(uint16_t tile_address, uint8_t x, uint8_t y) {
+    const uint8_t *row = &memory[tile_address + y * 2];
+    uint8_t bit = 7 - x;
+    return ((row[0] >> bit) & 1) | (((row[1] >> bit) & 1) << 1);
+}
+
+// Background and window tiles come from 0x8000 with unsigned indices,
+// or from 0x9000 with signed ones
+static inline uint16_t bg_tile_address(uint8_t lcdc, uint8_t tile) {
+    return lcdc & 0x10 ? 0x8000 + tile * 16 : 0x9000 + (int8_t)tile * 16;
+}
+
+// Draws one visible line from VRAM and OAM as they are at the end of
+// its pixel transfer
+static void ppu_render_line(uint8_t line) {
+    uint8_t lcdc = memory[LCDC];
+    uint8_t *out = &ppu_framebuffer[line * SCREEN_WIDTH];
+    uint8_t colors[SCREEN_WIDTH] = {0};   // Background color indices, for sprite priority
+
+    if (lcdc & 0x01) {
+        const uint8_t *bg_map = &memory[lcdc & 0x08 ? 0x9C00 : 0x9800];
+        const uint8_t *window_map = &memory[lcdc & 0x40 ? 0x9C00 : 0x9800];
+        uint8_t y = line + memory[SCY];
+        uint8_t scx = memory[SCX];
+        int window_x = (lcdc & 0x20) && line >= memory[WY] ? memory[WX] - 7 : SCREEN_WIDTH;
+        uint8_t window_y = line - memory[WY];
+
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint8_t tile;
+            uint8_t px, py;
+            if (x >= window_x) {
+                px = x - window_x;
+                py = window_y;
+                tile = window_map[(py / 8) * 32 + px / 8];
+            } else {
+                px = x + scx;
+                py = y;
+                tile = bg_map[(py / 8) * 32 + px / 8];
+            }
+            colors[x] = tile_pixel(bg_tile_address(lcdc, tile), px & 7, py & 7);
+        }
+    }
+
+    uint8_t bgp = memory[BGP];
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+        out[x] = (bgp >> (colors[x] * 2)) & 3;
+    }
+
+    if (!(lcdc & 0x02)) {
+        return;
+    }
+
+    // The first ten sprites in OAM order that cross the line
+    const uint8_t *oam = &memory[OAM_START];
+    uint8_t height = lcdc & 0x04 ? 16 : 8;
+    uint8_t sprites[LINE_SPRITES];
+    int count = 0;
+    for (int i = 0; i < 40 && count < LINE_SPRITES; i++) {
+        int row = line - (oam[i * 4] - 16);
+        if (row >= 0 && row < height) {
+            sprites[count++] = i;
+        }
+    }
+
+    // Lower X wins, then lower OAM index; order by priority with an
+    // insertion sort
+    for (int i = 1; i < count; i++) {
+        uint8_t sprite = sprites[i];
+        int j = i - 1;
+        for (; j >= 0 && oam[sprites[j] * 4 + 1] > oam[sprite * 4 + 1]; j--) {
+            sprites[j + 1] = sprites[j];
+        }
+        sprites[j + 1] = sprite;
+    }
+
+    // A sprite pixel claims its position even when hidden behind the
+    // background, so lower priority sprites never show through
+    bool claimed[SCREEN_WIDTH] = {false};
+    for (int i = 0; i < count; i++) {
+        const uint8_t *sprite = &oam[sprites[i] * 4];
+        uint8_t attributes = sprite[3];
+        uint8_t row = line - (sprite[0] - 16);
+        if (attributes & 0x40) {
+            row = height - 1 - row;
+        }
+        uint8_t tile = height == 16 ? sprite[2] & 0xFE : sprite[2];
+        uint16_t tile_address = 0x8000 + tile * 16;
+        uint8_t palette = memory[attributes & 0x10 ? OBP1 : OBP0];
+
+        for (int px = 0; px < 8; px++) {
+            int x = sprite[1] - 8 + px;
+            if (x < 0 || x >= SCREEN_WIDTH || claimed[x]) {
+                continue;
+            }
+            uint8_t color = tile_pixel(tile_address, attributes & 0x20 ? 7 - px : px, row);
+            if (color == 0) {
+                continue;
+            }
+            claimed[x] = true;
+            if (!(attributes & 0x80) || colors[x] == 0) {
+                out[x] = (palette >> (color * 2)) & 3;
+            }
+        }
+    }
 }
 
 void ppu_update(uint16_t cycles) {
@@ -48,13 +169,15 @@ void ppu_update(uint16_t cycles) {
     
     switch (ppu.mode) {
         case 0: // H-Blank
-            if (ppu.cycles >= 204) {
-                ppu.cycles -= 204;
+            if (ppu.cycles >= mode_cycles[0]) {
+                ppu.cycles -= mode_cycles[0];
                 ppu.line++;
                 
                 if (ppu.line == 144) {
                     // Enter V-Blank
                     ppu.mode = 1;
+                    ppu.frames++;
+                    cpu_request_interrupt(INT_VBLANK);
                 } else {
                     // Next line
                     ppu.mode = 2;
@@ -65,8 +188,8 @@ void ppu_update(uint16_t cycles) {
             break;
             
         case 1: // V-Blank
-            if (ppu.cycles >= 456) {
-                ppu.cycles -= 456;
+            if (ppu.cycles >= mode_cycles[1]) {
+                ppu.cycles -= mode_cycles[1];
                 ppu.line++;
                 
                 if (ppu.line > 153) {
@@ -80,16 +203,19 @@ void ppu_update(uint16_t cycles) {
             break;
             
         case 2: // OAM Scan
-            if (ppu.cycles >= 80) {
-                ppu.cycles -= 80;
+            if (ppu.cycles >= mode_cycles[2]) {
+                ppu.cycles -= mode_cycles[2];
                 ppu.mode = 3;
             }
             break;
             
         case 3: // Pixel Transfer
-            if (ppu.cycles >= 172) {
-                ppu.cycles -= 172;
+            if (ppu.cycles >= mode_cycles[3]) {
+                ppu.cycles -= mode_cycles[3];
                 ppu.mode = 0;
+                if (ppu_render) {
+                    ppu_render_line(ppu.line);
+                }
             }
             break;
     }
@@ -100,8 +226,21 @@ void ppu_update(uint16_t cycles) {
     memory_write(STAT, stat);
 }
 
-void update_ppu() {
-    ppu_update(4); // Assume 4 cycles per instruction for simplicity
+// Cycles until the next mode change. Until then ppu_update only counts
+// cycles, so any number of calls adding up to fewer cycles has the same
+// effect as one.
+uint32_t ppu_cycles_to_event() {
+    if (!(memory_read(LCDC) & 0x80)) {
+        return UINT32_MAX;
+    }
+    if (ppu.cycles >= mode_cycles[ppu.mode]) {
+        return 0;
+    }
+    return mode_cycles[ppu.mode] - ppu.cycles;
+}
+
+void update_ppu(uint8_t cycles) {
+    ppu_update(cycles);
 }
 
 void init_ppu() {
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "gameboy.h"
+
+// Frames each ROM runs, and how often its picture and memory are hashed
+#define REGRESS_FRAMES     600
+#define REGRESS_CHECKPOINT 60
+
+// Frame limit for ROMs judged by their serial output
+#define REGRESS_SERIAL_FRAMES 7200
+
+// Joypad masks (see input_set_mask)
+#define SCRIPT_A     0x01
+#define SCRIPT_START 0x08
+
+typedef struct {
+    char rom[256];
+    uint32_t frame;
+    uint64_t frame_hash;
+    uint64_t memory_hash;
+} Golden_Entry;
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-j <threads>] [--frames <n>] [--checkpoint <n>] [--update]\n"
+           "          <rom_dir> <golden_file>\n", program);
+    printf("       %s --serial [-j <threads>] [--frames <n>] <rom_dir>\n", program);
+    printf("  -j <threads>       Worker threads (default: one per CPU)\n");
+    printf("  --frames <n>       Frames each ROM runs (default: %d)\n", REGRESS_FRAMES);
+    printf("  --checkpoint <n>   Frames between hashes (default: %d)\n", REGRESS_CHECKPOINT);
+    printf("  --update           Write the hashes to the golden file instead of checking\n");
+    printf("  --serial           Judge ROMs by the \"Passed\" or \"Failed\" they send over\n");
+    printf("                     the serial port, stopping each as soon as it does\n");
+    printf("                     (default frame limit: %d)\n", REGRESS_SERIAL_FRAMES);
+}
+
+// The same input for every ROM: Start for 5 frames every 2 seconds and
+// A for 2 frames in 16, enough to get past most title screens
+static uint8_t *make_script(uint32_t frames) {
+    uint8_t *script = malloc(frames ? frames : 1);
+    if (!script) {
+        return NULL;
+    }
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        script[frame] = (frame % 120 >= 60 && frame % 120 < 65 ? SCRIPT_START : 0) |
+                        (frame % 16 < 2 ? SCRIPT_A : 0);
+    }
+    return script;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Lists the .gb and .gbc files of a directory in name order. Returns the
+// count, or -1 on error.
+static int list_roms(const char *directory, char ***names) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        printf("Failed to open ROM directory: %s\n", directory);
+        return -1;
+    }
+
+    int count = 0;
+    int capacity = 0;
+    *names = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *dot = strrchr(entry->d_name, '.');
+        if (!dot || (strcmp(dot, ".gb") != 0 && strcmp(dot, ".gbc") != 0)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(*names, capacity * sizeof(char *));
+            if (!grown) {
+                closedir(dir);
+                return -1;
+            }
+            *names = grown;
+        }
+        (*names)[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(*names, count, sizeof(char *), compare_names);
+    return count;
+}
+
+// Reads "<rom> <frame> <frame hash> <memory hash>" lines. A missing file
+// reads as empty, so the first run reports every ROM as new.
+static int read_golden(const char *filename, Golden_Entry **entries) {
+    *entries = NULL;
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        return 0;
+    }
+
+    char line[512];
+    int count = 0;
+    int capacity = 0;
+    while (fgets(line, sizeof(line), file)) {
+        Golden_Entry entry;
+        unsigned long long frame_hash, memory_hash;
+        if (line[0] == '#' ||
+            sscanf(line, "%255s %u %llx %llx", entry.rom, &entry.frame, &frame_hash, &memory_hash) != 4) {
+            continue;
+        }
+        entry.frame_hash = frame_hash;
+        entry.memory_hash = memory_hash;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            Golden_Entry *grown = realloc(*entries, capacity * sizeof(Golden_Entry));
+            if (!grown) {
+                break;
+            }
+            *entries = grown;
+        }
+        (*entries)[count++] = entry;
+    }
+    fclose(file);
+    return count;
+}
+
+static const Golden_Entry *find_golden(const Golden_Entry *entries, int count,
+                                       const char *rom, uint32_t frame) {
+    for (int i = 0; i < count; i++) {
+        if (entries[i].frame == frame && strcmp(entries[i].rom, rom) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static bool write_golden(const char *filename, char **names, const Farm_Job *jobs, int count,
+                         uint32_t checkpoints, uint32_t checkpoint_frames) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        printf("Failed to write golden file: %s\n", filename);
+        return false;
+    }
+
+    fprintf(file, "# rom frame frame_hash memory_hash\n");
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].failed) {
+            continue;
+        }
+        for (uint32_t c = 0; c < checkpoints; c++) {
+            fprintf(file, "%s %u %016llx %016llx\n", names[i], (c + 1) * checkpoint_frames,
+                    (unsigned long long)jobs[i].checkpoints[c * 2],
+                    (unsigned long long)jobs[i].checkpoints[c * 2 + 1]);
+        }
+    }
+    return fclose(file) == 0;
+}
+
+// Compares one ROM's hashes with the golden ones and prints its verdict.
+// Returns true if they all match.
+static bool check_rom(const char *name, const Farm_Job *job, const Golden_Entry *golden,
+                      int golden_count, uint32_t checkpoints, uint32_t checkpoint_frames) {
+    if (job->failed) {
+        printf("FAIL %s: did not run\n", name);
+        return false;
+    }
+
+    for (uint32_t c = 0; c < checkpoints; c++) {
+        uint32_t frame = (c + 1) * checkpoint_frames;
+        const uint64_t *hashes = &job->checkpoints[c * 2];
+        const Golden_Entry *entry = find_golden(golden, golden_count, name, frame);
+
+        if (!entry) {
+            printf("NEW  %s: no golden hashes for frame %u\n", name, frame);
+            return false;
+        }
+        if (entry->frame_hash != hashes[0] || entry->memory_hash != hashes[1]) {
+            printf("FAIL %s: frame %u %s differs (golden %016llx, got %016llx)\n", name, frame,
+                   entry->frame_hash != hashes[0] ? "picture" : "memory",
+                   (unsigned long long)(entry->frame_hash != hashes[0] ? entry->frame_hash
+                                                                      : entry->memory_hash),
+                   (unsigned long long)(entry->frame_hash != hashes[0] ? hashes[0] : hashes[1]));
+            return false;
+        }
+    }
+    printf("ok   %s\n", name);
+    return true;
+}
+
+// Prints one ROM's serial verdict. Returns true if it passed.
+static bool check_serial(const char *name, const Farm_Job *job) {
+    if (job->failed) {
+        printf("FAIL %s: did not run\n", name);
+        return false;
+    }
+
+    const Serial_Capture *capture = job->serial;
+    if (capture->verdict == SERIAL_PASSED) {
+        printf("ok   %s: passed after %u frames\n", name, job->frames_run);
+        return true;
+    }
+    if (capture->verdict == SERIAL_FAILED) {
+        printf("FAIL %s: failed after %u frames\n", name, job->frames_run);
+    } else {
+        printf("FAIL %s: no verdict in %u frames\n", name, job->frames_run);
+    }
+    if (capture->length > 0) {
+        printf("%s\n", capture->text);
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    const char *rom_dir = NULL;
+    const char *golden_file = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int frames = 0;
+    int checkpoint_frames = REGRESS_CHECKPOINT;
+    bool update = false;
+    bool serial = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--update") == 0) {
+            update = true;
+        } else if (strcmp(argv[i], "--serial") == 0) {
+            serial = true;
+        } else if (argv[i][0] != '-' && !rom_dir) {
+            rom_dir = argv[i];
+        } else if (argv[i][0] != '-' && !golden_file) {
+            golden_file = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (frames == 0) {
+        frames = serial ? REGRESS_SERIAL_FRAMES : REGRESS_FRAMES;
+    }
+    if (!rom_dir || !golden_file == !serial || (serial && update) ||
+        threads < 1 || frames < 1 || checkpoint_frames < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    char **names;
+    int count = list_roms(rom_dir, &names);
+    if (count < 0) {
+        return 1;
+    }
+
+    uint32_t checkpoints = serial ? 0 : frames / checkpoint_frames;
+    uint8_t *script = make_script(frames);
+    Farm_Job *jobs = calloc(count ? count : 1, sizeof(Farm_Job));
+    Serial_Capture *captures = calloc(count ? count : 1, sizeof(Serial_Capture));
+    if (!script || !jobs || !captures) {
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        char *path = malloc(strlen(rom_dir) + strlen(names[i]) + 2);
+        sprintf(path, "%s/%s", rom_dir, names[i]);
+        jobs[i].rom_file = path;
+        jobs[i].movie = script;
+        jobs[i].movie_length = frames;
+        jobs[i].frames = frames;
+        if (serial) {
+            jobs[i].serial = &captures[i];
+            jobs[i].serial_stop = true;
+        } else {
+            jobs[i].checkpoint_frames = checkpoint_frames;
+        }
+        jobs[i].checkpoints = calloc(checkpoints ? checkpoints * 2 : 1, sizeof(uint64_t));
+    }
+
+    // Runs must not depend on, or change, anything on disk
+    gb_quiet = true;
+    gb_battery_saves = false;
+
+    // Nothing listens, and checkpoints hash the same either way
+    gb_apu_lazy = true;
+
+    double elapsed = farm_run(jobs, count, threads, FARM_SLICE_FRAMES);
+    if (elapsed < 0) {
+        printf("Failed to start the worker pool\n");
+        return 1;
+    }
+
+    int failed = 0;
+    if (serial) {
+        for (int i = 0; i < count; i++) {
+            if (!check_serial(names[i], &jobs[i])) {
+                failed++;
+            }
+        }
+    } else if (update) {
+        for (int i = 0; i < count; i++) {
+            if (jobs[i].failed) {
+                printf("FAIL %s: did not run\n", names[i]);
+                failed++;
+            }
+        }
+        if (!write_golden(golden_file, names, jobs, count, checkpoints, checkpoint_frames)) {
+            return 1;
+        }
+        printf("Wrote %u checkpoints for %d ROMs to %s\n", checkpoints, count - failed, golden_file);
+    } else {
+        Golden_Entry *golden;
+        int golden_count = read_golden(golden_file, &golden);
+        for (int i = 0; i < count; i++) {
+            if (!check_rom(names[i], &jobs[i], golden, golden_count, checkpoints, checkpoint_frames)) {
+                failed++;
+            }
+        }
+        free(golden);
+    }
+
+    printf("%d ROMs, %d failed, %s%d frames each in %.3f s on %d threads\n",
+           count, failed, serial ? "at most " : "", frames, elapsed, threads);
+
+    for (int i = 0; i < count; i++) {
+        free((char *)jobs[i].rom_file);
+        free(jobs[i].checkpoints);
+        free(names[i]);
+    }
+    free(jobs);
+    free(captures);
+    free(names);
+    free(script);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,253 @@
+// rewind.c - Rewind history of XOR-delta compressed save states
+#include <string.h>
+#include "gameboy.h"
+
+// Each ring entry is the XOR of a snapshot with the one before it,
+// run-length encoded as (zero run, literal length, literal bytes)
+// tokens. Between frames most of the state is unchanged, so entries are
+// mostly a handful of short tokens. Applying the newest entry to the
+// latest snapshot yields the previous snapshot.
+#define RUN_MAX 0xFFFF
+
+typedef struct {
+    uint8_t *ring;
+    size_t ring_size;
+    size_t head;            // Where the next entry is written
+    size_t *offsets;        // Entry offsets, oldest at index first
+    uint32_t *lengths;
+    uint32_t max_entries;
+    uint32_t first;
+    uint32_t count;
+    uint8_t *current;       // Latest snapshot
+    uint8_t *scratch;
+    uint8_t *encoded;       // Staging area for a new entry
+    size_t encoded_size;
+    size_t state_size;
+    bool have_snapshot;
+    uint32_t interval;      // Frames between snapshots
+    uint32_t frames;        // Frames since the last snapshot
+} Rewind_Buffer;
+
+static GB_LOCAL Rewind_Buffer rewind_buffer;
+
+bool rewind_init(uint32_t interval, size_t ring_size) {
+    Rewind_Buffer *rb = &rewind_buffer;
+
+    rb->state_size = gb_state_size();
+    rb->ring_size = ring_size;
+    // An unchanged state encodes to a couple of tokens, which bounds the
+    // number of entries that can share the ring
+    rb->max_entries = ring_size / 16 + 1;
+    rb->ring = malloc(ring_size);
+    rb->offsets = malloc(rb->max_entries * sizeof(size_t));
+    rb->lengths = malloc(rb->max_entries * sizeof(uint32_t));
+    rb->current = malloc(rb->state_size);
+    rb->scratch = malloc(rb->state_size);
+    // Worst case: every byte changed, plus a token per maximal run
+    rb->encoded_size = rb->state_size + 8 * (rb->state_size / RUN_MAX + 2);
+    rb->encoded = malloc(rb->encoded_size);
+
+    if (!rb->ring || !rb->offsets || !rb->lengths || !rb->current ||
+        !rb->scratch || !rb->encoded) {
+        rewind_free();
+        return false;
+    }
+
+    rb->head = 0;
+    rb->first = 0;
+    rb->count = 0;
+    rb->have_snapshot = false;
+    rb->interval = interval ? interval : 1;
+    rb->frames = 0;
+    return true;
+}
+
+void rewind_free() {
+    Rewind_Buffer *rb = &rewind_buffer;
+
+    free(rb->ring);
+    free(rb->offsets);
+    free(rb->lengths);
+    free(rb->current);
+    free(rb->scratch);
+    free(rb->encoded);
+    memset(rb, 0, sizeof(*rb));
+}
+
+static void put_u16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+}
+
+static uint16_t get_u16(const uint8_t *in) {
+    return in[0] | (in[1] << 8);
+}
+
+// Encodes a XOR b into out and returns the encoded length
+static size_t delta_encode(const uint8_t *a, const uint8_t *b, size_t size, uint8_t *out) {
+    size_t pos = 0;
+    size_t length = 0;
+
+    while (pos < size) {
+        // Skip unchanged bytes, a word at a time where possible
+        size_t zeros = 0;
+        while (pos + 8 <= size && zeros + 8 <= RUN_MAX) {
+            uint64_t x, y;
+            memcpy(&x, a + pos, 8);
+            memcpy(&y, b + pos, 8);
+            if (x != y) break;
+            pos += 8;
+            zeros += 8;
+        }
+        while (pos < size && zeros < RUN_MAX && a[pos] == b[pos]) {
+            pos++;
+            zeros++;
+        }
+
+        size_t start = pos;
+        while (pos < size && pos - start < RUN_MAX && a[pos] != b[pos]) {
+            pos++;
+        }
+        size_t literals = pos - start;
+
+        if (zeros == 0 && literals == 0) {
+            continue;
+        }
+
+        put_u16(out + length, zeros);
+        put_u16(out + length + 2, literals);
+        length += 4;
+        for (size_t i = 0; i < literals; i++) {
+            out[length + i] = a[start + i] ^ b[start + i];
+        }
+        length += literals;
+    }
+    return length;
+}
+
+// XORs an encoded delta into state
+static void delta_apply(uint8_t *state, const uint8_t *delta, size_t length) {
+    size_t pos = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        pos += get_u16(delta + i);
+        uint16_t literals = get_u16(delta + i + 2);
+        i += 4;
+        for (uint16_t j = 0; j < literals; j++) {
+            state[pos + j] ^= delta[i + j];
+        }
+        pos += literals;
+        i += literals;
+    }
+}
+
+static void rewind_drop_oldest() {
+    Rewind_Buffer *rb = &rewind_buffer;
+
+    rb->first = (rb->first + 1) % rb->max_entries;
+    rb->count--;
+    if (rb->count == 0) {
+        rb->head = 0;
+    }
+}
+
+// Finds room for an entry of length bytes, evicting the oldest entries
+// as needed. Entries never straddle the end of the ring.
+static bool rewind_reserve(size_t length) {
+    Rewind_Buffer *rb = &rewind_buffer;
+
+    if (length > rb->ring_size) {
+        return false;
+    }
+
+    for (;;) {
+        if (rb->count == rb->max_entries) {
+            rewind_drop_oldest();
+            continue;
+        }
+        if (rb->count == 0) {
+            rb->head = 0;
+            return true;
+        }
+
+        // Used bytes run from the oldest entry to head, wrapping at the
+        // ring end when the newest entry sits below the oldest
+        size_t tail = rb->offsets[rb->first];
+        size_t newest = rb->offsets[(rb->first + rb->count - 1) % rb->max_entries];
+        if (newest >= tail) {
+            if (rb->head + length <= rb->ring_size) {
+                return true;
+            }
+            // Wrapped entries stay strictly below the oldest one, so
+            // head never catches up with it
+            if (length < tail) {
+                rb->head = 0;
+                return true;
+            }
+        } else if (rb->head + length < tail) {
+            return true;
+        }
+        rewind_drop_oldest();
+    }
+}
+
+// Called once per emulated frame; takes a snapshot every interval frames
+void rewind_frame() {
+    Rewind_Buffer *rb = &rewind_buffer;
+
+    if (!rb->ring || ++rb->frames < rb->interval) {
+        return;
+    }
+    rb->frames = 0;
+
+    if (!rb->have_snapshot) {
+        gb_state_save(rb->current);
+        rb->have_snapshot = true;
+        return;
+    }
+
+    gb_state_save(rb->scratch);
+
+    size_t length = delta_encode(rb->scratch, rb->current, rb->state_size, rb->encoded);
+    if (!rewind_reserve(length)) {
+        // Larger than the whole ring; restart history from this frame
+        rb->count = 0;
+        rb->head = 0;
+    } else {
+        memcpy(rb->ring + rb->head, rb->encoded, length);
+
+        uint32_t index = (rb->first + rb->count) % rb->max_entries;
+        rb->offsets[index] = rb->head;
+        rb->lengths[index] = length;
+        rb->count++;
+        rb->head += length;
+    }
+
+    uint8_t *swap = rb->current;
+    rb->current = rb->scratch;
+    rb->scratch = swap;
+}
+
+// Steps back to the previous snapshot. Returns false when the history
+// is exhausted.
+bool rewind_step_back() {
+    Rewind_Buffer *rb = &rewind_buffer;
+
+    if (!rb->ring || rb->count == 0) {
+        return false;
+    }
+
+    uint32_t index = (rb->first + rb->count - 1) % rb->max_entries;
+    delta_apply(rb->current, rb->ring + rb->offsets[index], rb->lengths[index]);
+    rb->head = rb->offsets[index];
+    rb->count--;
+    rb->frames = 0;
+
+    return gb_state_load(rb->current);
+}
+
+// Number of snapshots that can currently be stepped back through
+uint32_t rewind_depth() {
+    return rewind_buffer.count;
+}
@@ -0,0 +1,66 @@
+// scheduler.c - Cycle-based event scheduling
+#include "gameboy.h"
+
+GB_LOCAL Scheduler_State scheduler;
+
+// Indexed by Event_Type
+static void (*const event_handlers[EVENT_COUNT])(uint32_t late) = {
+    dma_complete,
+    serial_complete,
+    apu_frame_sequencer,
+};
+
+static void scheduler_update_next() {
+    scheduler.next_event = UINT64_MAX;
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        if (scheduler.deadlines[i] < scheduler.next_event) {
+            scheduler.next_event = scheduler.deadlines[i];
+        }
+    }
+}
+
+void scheduler_init() {
+    scheduler.cycles = 0;
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        scheduler.deadlines[i] = UINT64_MAX;
+    }
+    scheduler.next_event = UINT64_MAX;
+}
+
+void scheduler_schedule(Event_Type event, uint32_t delay) {
+    scheduler.deadlines[event] = scheduler.cycles + delay;
+    if (scheduler.deadlines[event] < scheduler.next_event) {
+        scheduler.next_event = scheduler.deadlines[event];
+    }
+}
+
+void scheduler_cancel(Event_Type event) {
+    scheduler.deadlines[event] = UINT64_MAX;
+    scheduler_update_next();
+}
+
+// Cycles until the earliest pending event is due
+uint32_t scheduler_cycles_to_event() {
+    uint64_t remaining = scheduler.next_event - scheduler.cycles;
+    return remaining > UINT32_MAX ? UINT32_MAX : remaining;
+}
+
+void scheduler_advance(uint8_t cycles) {
+    scheduler.cycles += cycles;
+
+    // Fire due events in deadline order. Handlers receive how late they
+    // run so periodic events can reschedule without drift.
+    while (scheduler.cycles >= scheduler.next_event) {
+        int event = 0;
+        for (int i = 1; i < EVENT_COUNT; i++) {
+            if (scheduler.deadlines[i] < scheduler.deadlines[event]) {
+                event = i;
+            }
+        }
+
+        uint32_t late = scheduler.cycles - scheduler.deadlines[event];
+        scheduler.deadlines[event] = UINT64_MAX;
+        scheduler_update_next();
+        event_handlers[event](late);
+    }
+}
@@ -0,0 +1,129 @@
+// serial.c - Serial port (0xFF01-0xFF02) transfers and output capture
+#include <string.h>
+#include "gameboy.h"
+
+#define SB 0xFF01  // Serial transfer data
+#define SC 0xFF02  // Serial transfer control
+
+// Eight bits at 8192 Hz on the internal clock
+#define SERIAL_CYCLES (8 * 512)
+
+// How often a transfer on the external clock checks for the partner's
+// byte, one bit time
+#define SERIAL_POLL_CYCLES 512
+
+// Where transmitted bytes go. Output belongs to whoever runs the
+// emulator, not to its state, so it is bound per thread like memory.
+static GB_LOCAL Serial_Capture *serial_capture;
+
+// The link cable plugged in, if any
+static GB_LOCAL Link *serial_link;
+
+void serial_init() {
+    memory_write(SB, 0x00);
+    memory_write(SC, 0x7E);
+}
+
+void serial_bind(Serial_Capture *capture) {
+    serial_capture = capture;
+}
+
+// Plugs a cable end in, or unplugs with NULL. Unplugging tells the
+// partner, which then sees this side as never ready.
+void serial_connect(Link *link) {
+    if (serial_link) {
+        link_close(serial_link, scheduler.cycles);
+    }
+    serial_link = link;
+    if (link && (memory[SC] & 0x81) == 0x80) {
+        link_arm(link, memory[SB], scheduler.cycles);
+        scheduler_schedule(EVENT_SERIAL_END, SERIAL_POLL_CYCLES);
+    }
+}
+
+// Lets a linked partner know how far this side has run. Call once a
+// frame while linked.
+void serial_sync() {
+    if (serial_link) {
+        link_sync(serial_link, scheduler.cycles);
+    }
+}
+
+// A transfer starts when SC is written with bit 7 set. On the internal
+// clock it completes one byte time later; on the external clock it
+// waits for a partner, and with none connected it never completes.
+void serial_write_control(uint8_t value) {
+    if ((value & 0x81) == 0x81) {
+        if (serial_link) {
+            link_disarm(serial_link, scheduler.cycles);
+        }
+        scheduler_schedule(EVENT_SERIAL_END, SERIAL_CYCLES);
+    } else if ((value & 0x80) && serial_link) {
+        link_arm(serial_link, memory[SB], scheduler.cycles);
+        scheduler_schedule(EVENT_SERIAL_END, SERIAL_POLL_CYCLES);
+    } else {
+        if (serial_link) {
+            link_disarm(serial_link, scheduler.cycles);
+        }
+        scheduler_cancel(EVENT_SERIAL_END);
+    }
+}
+
+// True if the last bytes sent spell out pattern
+static bool tail_matches(uint64_t tail, const char *pattern) {
+    size_t length = strlen(pattern);
+    for (size_t i = 0; i < length; i++) {
+        if (((tail >> (8 * (length - 1 - i))) & 0xFF) != (uint8_t)pattern[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Test ROMs in the style of blargg's end their report with "Passed" or
+// "Failed"; the first of either is the verdict
+static void serial_capture_byte(Serial_Capture *capture, uint8_t byte) {
+    if (capture->length < SERIAL_CAPTURE_SIZE - 1) {
+        capture->text[capture->length] = byte;
+        capture->text[capture->length + 1] = '\0';
+    }
+    capture->length++;
+    capture->tail = (capture->tail << 8) | byte;
+
+    if (capture->verdict == SERIAL_NO_VERDICT) {
+        if (tail_matches(capture->tail, "Passed")) {
+            capture->verdict = SERIAL_PASSED;
+        } else if (tail_matches(capture->tail, "Failed")) {
+            capture->verdict = SERIAL_FAILED;
+        }
+    }
+}
+
+// Ends a transfer on the internal clock, or checks on one on the
+// external clock. With nothing connected, the bits shifted in are all
+// ones.
+void serial_complete(uint32_t late) {
+    uint64_t now = scheduler.cycles - late;
+    uint8_t byte = memory[SB];
+    uint8_t in = 0xFF;
+
+    if (memory[SC] & 0x01) {
+        if (serial_link) {
+            in = link_transfer(serial_link, byte, now);
+        }
+    } else if (!serial_link || !link_poll(serial_link, now, &in)) {
+        if (serial_link) {
+            scheduler_schedule(EVENT_SERIAL_END, SERIAL_POLL_CYCLES);
+        }
+        return;
+    }
+
+    memory[SB] = in;
+    memory[SC] &= 0x7F;
+    memory_dirty |= 1 << (SB >> 12);
+    cpu_request_interrupt(INT_SERIAL);
+
+    if (serial_capture) {
+        serial_capture_byte(serial_capture, byte);
+    }
+}
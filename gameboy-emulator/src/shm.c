@@ -0,0 +1,212 @@
+// shm.c - Framebuffer ring in POSIX shared memory
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gameboy.h"
+
+// The ring is a header followed by slot_count slots, each a cache line
+// of slot header and then the frame's shades. Frame n goes to slot
+// n % slot_count, so the emulator overwrites the oldest frame and never
+// waits for readers.
+//
+// Each slot is a sequence lock: the publisher makes the sequence odd,
+// writes the frame and makes it even again. A reader notes the sequence
+// before using a slot in place and checks it is unchanged afterwards;
+// if not, the publisher lapped it and the frame is gone.
+#define SHM_MAGIC   0x4D485347 // "GSHM"
+#define SHM_VERSION 1
+#define SHM_LINE    64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t slot_count;
+    uint32_t slot_size;      // Bytes from one slot to the next
+    uint64_t head;           // Frames published; the newest is head - 1
+} Shm_Header;
+
+typedef struct {
+    uint64_t sequence;       // Odd while the slot is being written
+    uint64_t frame;          // Frame number the slot holds
+} Shm_Slot;
+
+struct GB_Shm_Ring {
+    char *name;              // Set for the publisher, which unlinks it
+    uint8_t *base;
+    size_t size;
+    Shm_Header *header;
+};
+
+static Shm_Slot *shm_slot(const GB_Shm_Ring *ring, uint64_t frame) {
+    uint32_t index = frame % ring->header->slot_count;
+    return (Shm_Slot *)(ring->base + SHM_LINE + (size_t)index * ring->header->slot_size);
+}
+
+static uint8_t *shm_pixels(Shm_Slot *slot) {
+    return (uint8_t *)slot + SHM_LINE;
+}
+
+// Creates the ring name (a POSIX shm name such as "/gameboy") with
+// slots frames, replacing any stale ring of the same name
+GB_Shm_Ring *gb_shm_create(const char *name, uint32_t slots) {
+    if (slots == 0) {
+        return NULL;
+    }
+
+    uint32_t frame_size = SCREEN_WIDTH * SCREEN_HEIGHT;
+    uint32_t slot_size = SHM_LINE + (frame_size + SHM_LINE - 1) / SHM_LINE * SHM_LINE;
+    size_t size = SHM_LINE + (size_t)slots * slot_size;
+
+    GB_Shm_Ring *ring = calloc(1, sizeof(GB_Shm_Ring));
+    if (!ring) {
+        return NULL;
+    }
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("Failed to create shared memory: %s\n", name);
+        free(ring);
+        return NULL;
+    }
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        free(ring);
+        return NULL;
+    }
+
+    ring->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring->base == MAP_FAILED) {
+        shm_unlink(name);
+        free(ring);
+        return NULL;
+    }
+
+    ring->name = strdup(name);
+    ring->size = size;
+    ring->header = (Shm_Header *)ring->base;
+    ring->header->width = SCREEN_WIDTH;
+    ring->header->height = SCREEN_HEIGHT;
+    ring->header->slot_count = slots;
+    ring->header->slot_size = slot_size;
+    ring->header->version = SHM_VERSION;
+    // Readers check the magic last, once the rest of the header is there
+    __atomic_store_n(&ring->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+// Maps an existing ring read-only. Returns NULL if there is none or it
+// has a different layout.
+GB_Shm_Ring *gb_shm_attach(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < SHM_LINE) {
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    // A damaged header must not lead shm_slot() to divide by zero or
+    // read a frame past the end of its slot
+    const Shm_Header *header = (const Shm_Header *)base;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        header->version != SHM_VERSION ||
+        header->width != SCREEN_WIDTH || header->height != SCREEN_HEIGHT ||
+        header->slot_count == 0 || header->slot_size < SHM_LINE + SCREEN_WIDTH * SCREEN_HEIGHT ||
+        SHM_LINE + (size_t)header->slot_count * header->slot_size > (size_t)st.st_size) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    GB_Shm_Ring *ring = calloc(1, sizeof(GB_Shm_Ring));
+    if (!ring) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    ring->base = base;
+    ring->size = st.st_size;
+    ring->header = (Shm_Header *)base;
+    return ring;
+}
+
+// Unmaps the ring. The publisher also removes the name; readers that
+// are still attached keep their mapping.
+void gb_shm_close(GB_Shm_Ring *ring) {
+    if (!ring) {
+        return;
+    }
+    munmap(ring->base, ring->size);
+    if (ring->name) {
+        shm_unlink(ring->name);
+        free(ring->name);
+    }
+    free(ring);
+}
+
+// Copies a frame of shades into the next slot
+void gb_shm_publish(GB_Shm_Ring *ring, const uint8_t *frame) {
+    uint64_t number = ring->header->head;
+    Shm_Slot *slot = shm_slot(ring, number);
+    uint64_t sequence = slot->sequence;
+
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->frame, number, __ATOMIC_RELAXED);
+    memcpy(shm_pixels(slot), frame, SCREEN_WIDTH * SCREEN_HEIGHT);
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->header->head, number + 1, __ATOMIC_RELEASE);
+}
+
+// Number of frames published so far
+uint64_t gb_shm_head(const GB_Shm_Ring *ring) {
+    return __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+}
+
+uint32_t gb_shm_slots(const GB_Shm_Ring *ring) {
+    return ring->header->slot_count;
+}
+
+// Returns frame in place, or NULL if its slot no longer (or does not
+// yet) hold it. The pixels may be overwritten while they are read, so
+// pass sequence to gb_shm_still_valid() once done with them.
+const uint8_t *gb_shm_frame(const GB_Shm_Ring *ring, uint64_t frame, uint64_t *sequence) {
+    Shm_Slot *slot = shm_slot(ring, frame);
+    uint64_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if ((before & 1) || __atomic_load_n(&slot->frame, __ATOMIC_RELAXED) != frame) {
+        return NULL;
+    }
+    *sequence = before;
+    return shm_pixels(slot);
+}
+
+// True if frame was not overwritten since gb_shm_frame() returned it
+bool gb_shm_still_valid(const GB_Shm_Ring *ring, uint64_t frame, uint64_t sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&shm_slot(ring, frame)->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+// Copies frame into out. Returns false if it was overwritten first.
+bool gb_shm_read(const GB_Shm_Ring *ring, uint64_t frame, uint8_t *out) {
+    uint64_t sequence;
+    const uint8_t *pixels = gb_shm_frame(ring, frame, &sequence);
+    if (!pixels) {
+        return false;
+    }
+    memcpy(out, pixels, SCREEN_WIDTH * SCREEN_HEIGHT);
+    return gb_shm_still_valid(ring, frame, sequence);
+}
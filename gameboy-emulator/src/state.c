@@ -0,0 +1,92 @@
+// state.c - Save state serialization
+#include <string.h>
+#include "gameboy.h"
+
+#define STATE_MAGIC   0x53424721 // "!GBS"
+#define STATE_VERSION 6
+
+// Fixed layout of a save state. Cartridge RAM, whose size depends on the
+// cartridge, follows the structure. Bump STATE_VERSION whenever a field
+// or a member of the embedded state structures changes.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;       // Total size, including cartridge RAM
+    uint32_t ram_size;
+    Core_State core;
+    uint8_t memory[MEMORY_SIZE];
+} Save_State;
+
+void core_state_save(Core_State *core) {
+    // A lazy APU catches up first, so a given moment always saves the same
+    apu_sync();
+    core->cpu = cpu;
+    core->ppu = ppu;
+    core->timer = timer_state;
+    core->input = input_state;
+    core->scheduler = scheduler;
+    core->apu = apu;
+    core->mbc = current_cartridge ? current_cartridge->mbc : (MBC_State){0};
+    core->dma_active = dma_active;
+}
+
+void core_state_load(const Core_State *core) {
+    cpu = core->cpu;
+    ppu = core->ppu;
+    timer_state = core->timer;
+    input_state = core->input;
+    scheduler = core->scheduler;
+    apu = core->apu;
+    cartridge_set_banks(&core->mbc);
+    dma_active = core->dma_active;
+    apu_sync();
+}
+
+static size_t cartridge_ram_size() {
+    return current_cartridge ? current_cartridge->ram_size : 0;
+}
+
+size_t gb_state_size() {
+    return sizeof(Save_State) + cartridge_ram_size();
+}
+
+// Writes the emulator state into buffer, which must hold gb_state_size()
+// bytes. Nothing is allocated, so states can be taken at a high rate.
+void gb_state_save(void *buffer) {
+    Save_State *state = buffer;
+    size_t ram_size = cartridge_ram_size();
+
+    state->magic = STATE_MAGIC;
+    state->version = STATE_VERSION;
+    state->size = sizeof(Save_State) + ram_size;
+    state->ram_size = ram_size;
+    core_state_save(&state->core);
+    memcpy(state->memory, memory, MEMORY_SIZE);
+
+    if (ram_size) {
+        memcpy(state + 1, current_cartridge->ram, ram_size);
+    }
+}
+
+// Restores a state written by gb_state_save() for the loaded cartridge.
+// Returns false, leaving the emulator untouched, if the state does not
+// match this build or cartridge.
+bool gb_state_load(const void *buffer) {
+    const Save_State *state = buffer;
+    size_t ram_size = cartridge_ram_size();
+
+    if (state->magic != STATE_MAGIC || state->version != STATE_VERSION ||
+        state->ram_size != ram_size || state->size != sizeof(Save_State) + ram_size) {
+        return false;
+    }
+
+    core_state_load(&state->core);
+    memcpy(memory, state->memory, MEMORY_SIZE);
+    memory_dirty = MEMORY_PAGES_ALL;
+
+    if (ram_size) {
+        memcpy(current_cartridge->ram, state + 1, ram_size);
+        cartridge_ram_dirty = CART_RAM_PAGES_ALL;
+    }
+    return true;
+}
@@ -0,0 +1,192 @@
+// terminal.c - Keyboard input from a raw mode terminal
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include "gameboy.h"
+
+// Terminals send key presses but never releases, so a key holds its
+// button for a few frames and the terminal's auto-repeat keeps it held.
+// Hold longer than the repeat interval (about 30 Hz) but not so long
+// that a tap reads as a long press.
+#define TERM_HOLD_FRAMES 6
+#define TERM_PENDING     8      // Bytes of an escape sequence split across reads
+
+// Mask bits, as input_set_mask() takes them
+#define TERM_A      0x01
+#define TERM_B      0x02
+#define TERM_SELECT 0x04
+#define TERM_START  0x08
+#define TERM_RIGHT  0x10
+#define TERM_LEFT   0x20
+#define TERM_UP     0x40
+#define TERM_DOWN   0x80
+
+// There is one terminal per process, so this is not per thread
+static struct {
+    bool open;
+    struct termios saved;
+    uint8_t hold[8];            // Frames left for each mask bit
+    uint8_t pending[TERM_PENDING];
+    size_t pending_length;
+    double read_time;           // When the keys behind the last frame were read
+    double poll_time;
+    bool measuring;
+    Term_Input_Stats stats;
+} term;
+
+static double term_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void term_restore() {
+    if (term.open) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &term.saved);
+        term.open = false;
+    }
+}
+
+// Puts the terminal on stdin into raw mode: no line buffering, no echo
+// and reads that return at once. Ctrl+C still raises SIGINT. Returns
+// false if stdin is not a terminal.
+bool term_input_open() {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &term.saved) != 0) {
+        return false;
+    }
+
+    struct termios raw = term.saved;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) {
+        return false;
+    }
+
+    term.open = true;
+    memset(&term.stats, 0, sizeof(term.stats));
+    atexit(term_restore);
+    return true;
+}
+
+static void term_press(uint8_t bits) {
+    for (int i = 0; i < 8; i++) {
+        if (bits & (1 << i)) {
+            term.hold[i] = TERM_HOLD_FRAMES;
+        }
+    }
+}
+
+// Arrows or WASD for the pad, Z and X (or J and K) for A and B, Enter
+// for Start and Space or Backspace for Select
+static uint8_t term_key(uint8_t key) {
+    switch (key) {
+        case 'z': case 'Z': case 'j': case 'J': return TERM_A;
+        case 'x': case 'X': case 'k': case 'K': return TERM_B;
+        case '\r': case '\n':                   return TERM_START;
+        case ' ': case 0x7F: case 0x08:         return TERM_SELECT;
+        case 'w': case 'W':                     return TERM_UP;
+        case 's': case 'S':                     return TERM_DOWN;
+        case 'a': case 'A':                     return TERM_LEFT;
+        case 'd': case 'D':                     return TERM_RIGHT;
+    }
+    return 0;
+}
+
+static uint8_t term_arrow(uint8_t final) {
+    switch (final) {
+        case 'A': return TERM_UP;
+        case 'B': return TERM_DOWN;
+        case 'C': return TERM_RIGHT;
+        case 'D': return TERM_LEFT;
+    }
+    return 0;
+}
+
+// Maps the bytes in buffer to buttons. Arrows come as ESC [ x or ESC O
+// x; a sequence cut off at the end is kept until more bytes arrive.
+static uint8_t term_parse(const uint8_t *buffer, size_t length) {
+    uint8_t pressed = 0;
+    size_t i = 0;
+    while (i < length) {
+        if (buffer[i] != 0x1B) {
+            pressed |= term_key(buffer[i++]);
+            continue;
+        }
+        if (length - i < 3) {
+            if (length - i == 1 || buffer[i + 1] == '[' || buffer[i + 1] == 'O') {
+                break;
+            }
+            i++;
+            continue;
+        }
+        if (buffer[i + 1] == '[' || buffer[i + 1] == 'O') {
+            pressed |= term_arrow(buffer[i + 2]);
+            i += 3;
+        } else {
+            i++;
+        }
+    }
+
+    term.pending_length = length - i < TERM_PENDING ? length - i : 0;
+    memmove(term.pending, buffer + i, term.pending_length);
+    return pressed;
+}
+
+// Called once a frame, as it starts. Reads whatever the terminal has
+// sent without waiting and returns the buttons held, as a mask for
+// input_set_mask(). A key read here first shows when the frame it
+// starts has been emulated, which is when the next call happens, so
+// that is where its latency is taken. A key can also wait up to one
+// poll interval before it is read; the longest interval is kept too.
+uint8_t term_input_poll() {
+    double now = term_seconds();
+    if (term.stats.polls > 0 && now - term.poll_time > term.stats.interval_max) {
+        term.stats.interval_max = now - term.poll_time;
+    }
+    term.poll_time = now;
+    if (term.measuring) {
+        double latency = now - term.read_time;
+        term.stats.latency_total += latency;
+        if (latency > term.stats.latency_max) {
+            term.stats.latency_max = latency;
+        }
+        term.stats.frames_measured++;
+        term.measuring = false;
+    }
+
+    uint8_t buffer[256 + TERM_PENDING];
+    size_t length = term.pending_length;
+    memcpy(buffer, term.pending, length);
+    ssize_t count = read(STDIN_FILENO, buffer + length, sizeof(buffer) - length);
+    term.stats.polls++;
+    if (count > 0) {
+        length += count;
+        uint8_t pressed = term_parse(buffer, length);
+        if (pressed) {
+            term_press(pressed);
+            term.stats.keys += __builtin_popcount(pressed);
+            term.read_time = now;
+            term.measuring = true;
+        }
+    }
+
+    uint8_t mask = 0;
+    for (int i = 0; i < 8; i++) {
+        if (term.hold[i] > 0) {
+            mask |= 1 << i;
+            term.hold[i]--;
+        }
+    }
+    return mask;
+}
+
+// Puts the terminal back as it was. stats may be NULL.
+void term_input_close(Term_Input_Stats *stats) {
+    if (stats) {
+        *stats = term.stats;
+    }
+    term_restore();
+}
@@ -0,0 +1,191 @@
+// termvideo.c - Framebuffer drawn on a terminal with half blocks
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "gameboy.h"
+
+// Each character cell shows two pixels stacked, the upper half block
+// in the top pixel's color over a background in the bottom pixel's, so
+// the screen takes 160x72 cells. Only cells that changed since the last
+// frame presented are drawn, as one span per row from the first change
+// to the last. Colors are sent only when they differ from the cell
+// before. The whole frame goes out in a single write.
+//
+// With a byte rate set, rows are drawn while there is credit for them
+// and the rest stay dirty for the next frame, starting where this one
+// stopped, so a slow link shows a screen that catches up rather than a
+// backlog that grows.
+#define TERM_ROWS        (SCREEN_HEIGHT / 2)
+#define TERM_CELL_MAX    48     // Two color changes and a block
+#define TERM_ROW_MAX     (16 + SCREEN_WIDTH * TERM_CELL_MAX)
+#define TERM_BURST       4      // Credit saved up for at most 1/4 second
+#define TERM_NO_COLOR    0xFF
+
+// Shades 0-3, lightest first, in the greens of the original screen
+static const uint8_t term_palette[4][3] = {
+    { 224, 248, 208 }, { 136, 192, 112 }, { 52, 104, 86 }, { 8, 24, 32 }
+};
+
+struct Term_Video {
+    int fd;
+    uint32_t rate;                          // Bytes per second, or 0 for no cap
+    double credit;                          // Bytes that may still be sent
+    double last_time;
+    uint32_t next_row;                      // Where drawing resumes
+    uint8_t fg, bg;                         // Colors the terminal has set
+    uint8_t shown[TERM_ROWS][SCREEN_WIDTH]; // Top shade << 2 | bottom shade
+    char *out;
+    size_t length;
+    Term_Video_Stats stats;
+};
+
+static double term_video_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void term_video_write(Term_Video *video) {
+    size_t done = 0;
+    while (done < video->length) {
+        ssize_t written = write(video->fd, video->out + done, video->length - done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += written;
+    }
+    video->stats.bytes += done;
+    video->stats.writes++;
+    video->length = 0;
+}
+
+static void term_video_puts(Term_Video *video, const char *text) {
+    size_t length = strlen(text);
+    memcpy(video->out + video->length, text, length);
+    video->length += length;
+}
+
+static void term_video_color(Term_Video *video, bool background, uint8_t shade) {
+    const uint8_t *rgb = term_palette[shade];
+    video->length += sprintf(video->out + video->length, "\x1b[%d;2;%d;%d;%dm",
+                             background ? 48 : 38, rgb[0], rgb[1], rgb[2]);
+}
+
+// Draws the cells of row that differ from what is shown. Returns false,
+// leaving the row alone, if there are none.
+static bool term_video_row(Term_Video *video, const uint8_t *frame, uint32_t row) {
+    uint8_t cells[SCREEN_WIDTH];
+    const uint8_t *top = frame + row * 2 * SCREEN_WIDTH;
+    const uint8_t *bottom = top + SCREEN_WIDTH;
+    int first = -1, last = -1;
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+        cells[x] = (top[x] & 3) << 2 | (bottom[x] & 3);
+        if (cells[x] != video->shown[row][x]) {
+            if (first < 0) {
+                first = x;
+            }
+            last = x;
+        }
+    }
+    if (first < 0) {
+        return false;
+    }
+
+    video->length += sprintf(video->out + video->length, "\x1b[%u;%dH", row + 1, first + 1);
+    for (int x = first; x <= last; x++) {
+        uint8_t upper = cells[x] >> 2, lower = cells[x] & 3;
+        if (lower != video->bg) {
+            term_video_color(video, true, lower);
+            video->bg = lower;
+        }
+        // A cell in one color is a space, whatever the foreground
+        if (upper == lower) {
+            video->out[video->length++] = ' ';
+            continue;
+        }
+        if (upper != video->fg) {
+            term_video_color(video, false, upper);
+            video->fg = upper;
+        }
+        term_video_puts(video, "\xe2\x96\x80");
+    }
+    memcpy(&video->shown[row][first], &cells[first], last - first + 1);
+    return true;
+}
+
+// Takes over the terminal on fd: alternate screen, no cursor. rate caps
+// the output in bytes per second, 0 for none.
+Term_Video *term_video_open(int fd, uint32_t rate) {
+    Term_Video *video = calloc(1, sizeof(Term_Video));
+    if (!video) {
+        return NULL;
+    }
+    video->out = malloc(TERM_ROWS * TERM_ROW_MAX);
+    if (!video->out) {
+        free(video);
+        return NULL;
+    }
+    video->fd = fd;
+    video->rate = rate;
+    video->credit = rate / TERM_BURST;
+    video->last_time = term_video_seconds();
+    video->fg = video->bg = TERM_NO_COLOR;
+    memset(video->shown, TERM_NO_COLOR, sizeof(video->shown));
+
+    term_video_puts(video, "\x1b[?1049h\x1b[?25l\x1b[2J");
+    term_video_write(video);
+    return video;
+}
+
+// Draws what changed in frame, a SCREEN_WIDTH x SCREEN_HEIGHT array of
+// shades, as far as the rate allows
+void term_video_present(Term_Video *video, const uint8_t *frame) {
+    if (video->rate) {
+        double now = term_video_seconds();
+        video->credit += (now - video->last_time) * video->rate;
+        if (video->credit > video->rate / TERM_BURST) {
+            video->credit = video->rate / TERM_BURST;
+        }
+        video->last_time = now;
+        if (video->credit <= 0) {
+            video->stats.frames_skipped++;
+            return;
+        }
+    }
+
+    // Once out of credit, a frame still gets the row it started; the
+    // overdraft comes out of the next frames' credit
+    uint32_t row = video->next_row;
+    for (uint32_t i = 0; i < TERM_ROWS; i++, row = (row + 1) % TERM_ROWS) {
+        if (video->rate && video->length > 0 && video->length >= video->credit) {
+            break;
+        }
+        if (term_video_row(video, frame, row)) {
+            video->stats.rows_drawn++;
+        }
+    }
+    video->next_row = row;
+    video->credit -= video->length;
+    video->stats.frames++;
+    if (video->length > 0) {
+        term_video_write(video);
+    }
+}
+
+// Gives the terminal back as it was. stats may be NULL.
+void term_video_close(Term_Video *video, Term_Video_Stats *stats) {
+    if (!video) {
+        return;
+    }
+    term_video_puts(video, "\x1b[0m\x1b[?25h\x1b[?1049l");
+    term_video_write(video);
+    if (stats) {
+        *stats = video->stats;
+    }
+    free(video->out);
+    free(video);
+}
@@ -1,12 +1,7 @@
 // timer.c - Timer functionality for Game Boy emulator
 #include "gameboy.h"
 
-typedef struct {
-    uint16_t divider_cycles;
-    uint16_t timer_cycles;
-} Timer_State;
-
-Timer_State timer_state;
+GB_LOCAL Timer_State timer_state;
 
 void timer_init() {
     timer_state.divider_cycles = 0;
@@ -19,10 +14,20 @@ void timer_init() {
     memory_write(0xFF07, 0x00); // TAC
 }
 
+// Timer frequencies based on TAC bits 0-1
+static uint16_t timer_threshold(uint8_t tac) {
+    switch (tac & 0x03) {
+        case 0: return 1024; // 4096 Hz
+        case 1: return 16;   // 262144 Hz
+        case 2: return 64;   // 65536 Hz
+        default: return 256; // 16384 Hz
+    }
+}
+
 void timer_update(uint16_t cycles) {
     // Update DIV register (increments at 16384 Hz)
     timer_state.divider_cycles += cycles;
-    if (timer_state.divider_cycles >= 256) {
+    while (timer_state.divider_cycles >= 256) {
         timer_state.divider_cycles -= 256;
         uint8_t div = memory_read(0xFF04);
         memory_write(0xFF04, div + 1);
@@ -32,24 +37,16 @@ void timer_update(uint16_t cycles) {
     uint8_t tac = memory_read(0xFF07);
     if (tac & 0x04) { // Timer enabled
         timer_state.timer_cycles += cycles;
+        uint16_t threshold = timer_threshold(tac);
         
-        // Timer frequencies based on TAC bits 0-1
-        uint16_t threshold;
-        switch (tac & 0x03) {
-            case 0: threshold = 1024; break; // 4096 Hz
-            case 1: threshold = 16;   break; // 262144 Hz
-            case 2: threshold = 64;   break; // 65536 Hz
-            case 3: threshold = 256;  break; // 16384 Hz
-        }
-        
-        if (timer_state.timer_cycles >= threshold) {
+        while (timer_state.timer_cycles >= threshold) {
             timer_state.timer_cycles -= threshold;
             
             uint8_t tima = memory_read(0xFF05);
             if (tima == 0xFF) {
                 // Timer overflow
                 memory_write(0xFF05, memory_read(0xFF06)); // Reset to TMA
-                // TODO: Trigger timer interrupt
+                cpu_request_interrupt(INT_TIMER);
             } else {
                 memory_write(0xFF05, tima + 1);
             }
@@ -57,8 +54,21 @@ void timer_update(uint16_t cycles) {
     }
 }
 
-void update_timer() {
-    timer_update(4); // Assume 4 cycles per instruction
+// Cycles until TIMA overflows and requests an interrupt
+uint32_t timer_cycles_to_event() {
+    uint8_t tac = memory_read(0xFF07);
+    if (!(tac & 0x04)) {
+        return UINT32_MAX;
+    }
+    uint16_t threshold = timer_threshold(tac);
+    if (timer_state.timer_cycles >= threshold) {
+        return 0;
+    }
+    return threshold - timer_state.timer_cycles + threshold * (0xFF - memory_read(0xFF05));
+}
+
+void update_timer(uint8_t cycles) {
+    timer_update(cycles);
 }
 
 void init_timer() {
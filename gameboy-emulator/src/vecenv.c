@@ -0,0 +1,315 @@
+// vecenv.c - Batches of environments stepped on a thread pool
+#include <string.h>
+#include <pthread.h>
+#include "gameboy.h"
+
+// Each worker thread loads the ROM into its own emulator and keeps a
+// contiguous slice of the instances in an arena. A step hands every
+// worker the same command; each runs its slice and writes observations
+// straight into the shared count x height x width tensor, so the batch
+// needs no gathering.
+//
+// There are two tensors. A step writes into the one the previous step
+// did not, so in asynchronous mode the trainer reads batch N while the
+// workers produce batch N + 1.
+typedef enum {
+    VEC_RESET,
+    VEC_STEP
+} Vec_Command;
+
+typedef struct {
+    GB_Vec_Env *ve;
+    pthread_t thread;
+    uint32_t first;            // Slice of instances owned by this worker
+    uint32_t count;
+} Vec_Worker;
+
+struct GB_Vec_Env {
+    GB_Env_Config config;
+    const char *rom_file;
+    uint32_t count;
+    uint32_t observation_size;
+    uint8_t *observations[2];
+    uint8_t *done[2];
+    uint8_t *actions;          // Copied at launch, so callers may reuse theirs
+    uint32_t *episode_frames;
+    uint64_t *seeds;           // Seed of each instance's next reset
+
+    int threads;
+    Vec_Worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    uint64_t generation;       // Bumped for each command
+    int pending;               // Workers still busy with the command
+    bool stopping;
+    bool failed;               // A worker could not set up
+
+    Vec_Command command;
+    uint32_t frameskip;
+    int buffer;                // Tensor the current command writes
+};
+
+// Restores an instance to power on and runs its idle frames
+static void vec_reset_slot(GB_Vec_Env *ve, const uint8_t *start, uint32_t index) {
+    gb_state_load(start);
+    ve->episode_frames[index] = 0;
+    memset(ppu_framebuffer, 0, sizeof(ppu_framebuffer));
+    input_set_mask(0);
+    env_run_frames(env_reset_frames(&ve->config, ve->seeds[index]));
+    ve->seeds[index] += ve->count;
+}
+
+// Runs the current command over the worker's slice. A finished episode
+// is reset at once, and its done flag reports the episode that ended.
+static void vec_run_slice(Vec_Worker *worker, GB_Arena *arena, const uint8_t *start) {
+    GB_Vec_Env *ve = worker->ve;
+    uint8_t *observations = ve->observations[ve->buffer];
+    uint8_t *done = ve->done[ve->buffer];
+
+    for (uint32_t slot = 0; slot < worker->count; slot++) {
+        uint32_t index = worker->first + slot;
+        gb_arena_select(arena, slot);
+
+        if (ve->command == VEC_RESET) {
+            vec_reset_slot(ve, start, index);
+            done[index] = 0;
+        } else {
+            input_set_mask(ve->actions[index]);
+            env_run_frames(ve->frameskip);
+            ve->episode_frames[index] += ve->frameskip;
+            done[index] = env_episode_done(&ve->config, ve->episode_frames[index]);
+            if (done[index]) {
+                vec_reset_slot(ve, start, index);
+            }
+        }
+        gb_env_observe(ve->config.flags, &observations[(size_t)index * ve->observation_size]);
+    }
+}
+
+static void vec_finish(GB_Vec_Env *ve) {
+    if (--ve->pending == 0) {
+        pthread_cond_broadcast(&ve->finished);
+    }
+}
+
+static void *vec_worker(void *arg) {
+    Vec_Worker *worker = arg;
+    GB_Vec_Env *ve = worker->ve;
+    GB_Arena *arena = NULL;
+    uint8_t *start = NULL;
+
+    bool ok = gb_load(ve->rom_file, ve->config.battery_saves);
+    if (ok) {
+        start = malloc(gb_state_size());
+        arena = gb_arena_create(worker->count);
+        ok = start && arena;
+    }
+    if (ok) {
+        gb_state_save(start);
+        for (uint32_t slot = 0; ok && slot < worker->count; slot++) {
+            ok = gb_arena_add(arena) >= 0;
+        }
+    }
+
+    pthread_mutex_lock(&ve->lock);
+    if (!ok) {
+        ve->failed = true;
+    }
+    uint64_t seen = ve->generation;
+    vec_finish(ve);
+
+    for (;;) {
+        while (ve->generation == seen && !ve->stopping) {
+            pthread_cond_wait(&ve->work, &ve->lock);
+        }
+        if (ve->stopping) {
+            break;
+        }
+        seen = ve->generation;
+        pthread_mutex_unlock(&ve->lock);
+
+        if (ok) {
+            vec_run_slice(worker, arena, start);
+        }
+
+        pthread_mutex_lock(&ve->lock);
+        vec_finish(ve);
+    }
+    pthread_mutex_unlock(&ve->lock);
+
+    gb_arena_free(arena);
+    free(start);
+    cartridge_free();
+    return NULL;
+}
+
+// Hands the workers a command writing into the other tensor
+static void vec_launch(GB_Vec_Env *ve, Vec_Command command) {
+    gb_vec_env_wait(ve);
+
+    pthread_mutex_lock(&ve->lock);
+    ve->command = command;
+    ve->buffer ^= 1;
+    ve->pending = ve->threads;
+    ve->generation++;
+    pthread_cond_broadcast(&ve->work);
+    pthread_mutex_unlock(&ve->lock);
+}
+
+static void vec_stop(GB_Vec_Env *ve, int started) {
+    pthread_mutex_lock(&ve->lock);
+    ve->stopping = true;
+    pthread_cond_broadcast(&ve->work);
+    pthread_mutex_unlock(&ve->lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(ve->workers[i].thread, NULL);
+    }
+}
+
+static void vec_free_buffers(GB_Vec_Env *ve) {
+    for (int i = 0; i < 2; i++) {
+        free(ve->observations[i]);
+        free(ve->done[i]);
+    }
+    free(ve->actions);
+    free(ve->episode_frames);
+    free(ve->seeds);
+    free(ve->workers);
+    free(ve);
+}
+
+static void vec_destroy(GB_Vec_Env *ve) {
+    pthread_mutex_destroy(&ve->lock);
+    pthread_cond_destroy(&ve->work);
+    pthread_cond_destroy(&ve->finished);
+    vec_free_buffers(ve);
+}
+
+// Creates count environments on threads workers (at most one per
+// instance). Each worker loads rom_file itself, so the caller's
+// emulator is left alone.
+GB_Vec_Env *gb_vec_env_create(const char *rom_file, const GB_Env_Config *config,
+                              uint32_t count, int threads) {
+    if (count == 0) {
+        return NULL;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if ((uint32_t)threads > count) {
+        threads = count;
+    }
+
+    GB_Vec_Env *ve = calloc(1, sizeof(GB_Vec_Env));
+    if (!ve) {
+        return NULL;
+    }
+
+    ve->config = *config;
+    ve->rom_file = rom_file;
+    ve->count = count;
+    ve->threads = threads;
+    ve->observation_size = gb_env_width(config->flags) * gb_env_height(config->flags);
+    // Observations are whole cache lines in both sizes, so workers never
+    // write the same line of an aligned tensor
+    size_t tensor_size = ((size_t)count * ve->observation_size + 63) & ~(size_t)63;
+    for (int i = 0; i < 2; i++) {
+        ve->observations[i] = aligned_alloc(64, tensor_size);
+        ve->done[i] = calloc(count, 1);
+    }
+    ve->actions = calloc(count, 1);
+    ve->episode_frames = calloc(count, sizeof(uint32_t));
+    ve->seeds = calloc(count, sizeof(uint64_t));
+    ve->workers = calloc(threads, sizeof(Vec_Worker));
+
+    if (!ve->observations[0] || !ve->observations[1] || !ve->done[0] || !ve->done[1] ||
+        !ve->actions || !ve->episode_frames || !ve->seeds || !ve->workers) {
+        vec_free_buffers(ve);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ve->lock, NULL);
+    pthread_cond_init(&ve->work, NULL);
+    pthread_cond_init(&ve->finished, NULL);
+
+    // Workers report in once set up, like the end of a command
+    ve->pending = threads;
+    int started = 0;
+    for (; started < threads; started++) {
+        Vec_Worker *worker = &ve->workers[started];
+        worker->ve = ve;
+        worker->first = (uint64_t)count * started / threads;
+        worker->count = (uint64_t)count * (started + 1) / threads - worker->first;
+        if (pthread_create(&worker->thread, NULL, vec_worker, worker) != 0) {
+            break;
+        }
+    }
+
+    if (started < threads) {
+        pthread_mutex_lock(&ve->lock);
+        ve->pending -= threads - started;
+        pthread_mutex_unlock(&ve->lock);
+        ve->failed = true;
+    }
+    gb_vec_env_wait(ve);
+
+    if (ve->failed) {
+        vec_stop(ve, started);
+        vec_destroy(ve);
+        return NULL;
+    }
+    return ve;
+}
+
+void gb_vec_env_free(GB_Vec_Env *ve) {
+    if (!ve) {
+        return;
+    }
+    gb_vec_env_wait(ve);
+    vec_stop(ve, ve->threads);
+    vec_destroy(ve);
+}
+
+uint32_t gb_vec_env_count(const GB_Vec_Env *ve) {
+    return ve->count;
+}
+
+// Waits for the command in flight and returns its batch. The tensor
+// stays valid until the second launch after it.
+GB_Vec_Step gb_vec_env_wait(GB_Vec_Env *ve) {
+    pthread_mutex_lock(&ve->lock);
+    while (ve->pending > 0) {
+        pthread_cond_wait(&ve->finished, &ve->lock);
+    }
+    pthread_mutex_unlock(&ve->lock);
+
+    GB_Vec_Step step = { ve->observations[ve->buffer], ve->done[ve->buffer] };
+    return step;
+}
+
+// Resets every instance; instance i uses seed + i, and each later reset
+// of it moves on by count
+GB_Vec_Step gb_vec_env_reset(GB_Vec_Env *ve, uint64_t seed) {
+    gb_vec_env_wait(ve);
+    for (uint32_t i = 0; i < ve->count; i++) {
+        ve->seeds[i] = seed + i;
+    }
+    vec_launch(ve, VEC_RESET);
+    return gb_vec_env_wait(ve);
+}
+
+// Starts a step of every instance, with one action per instance, and
+// returns at once. Collect the batch with gb_vec_env_wait().
+void gb_vec_env_step_async(GB_Vec_Env *ve, const uint8_t *actions, uint32_t frameskip) {
+    gb_vec_env_wait(ve);
+    memcpy(ve->actions, actions, ve->count);
+    ve->frameskip = frameskip ? frameskip : 1;
+    vec_launch(ve, VEC_STEP);
+}
+
+GB_Vec_Step gb_vec_env_step(GB_Vec_Env *ve, const uint8_t *actions, uint32_t frameskip) {
+    gb_vec_env_step_async(ve, actions, frameskip);
+    return gb_vec_env_wait(ve);
+}
@@ -0,0 +1,247 @@
+// writer.c - Background file writer with a preallocated buffer pool
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "gameboy.h"
+
+// The producer fills buffers from a fixed pool and queues them; a
+// thread of the writer's own gathers everything queued into one
+// writev() and hands the buffers back. When the pool runs dry the
+// producer either drops its data or waits, as the policy says.
+#define WRITER_GATHER 64       // Most buffers written in one call, well under IOV_MAX
+
+struct Writer {
+    int fd;
+    Writer_Policy policy;
+    uint8_t *pool;
+    size_t buffer_size;
+    uint32_t buffers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t freed;
+    pthread_t thread;
+    uint32_t *free_list;
+    uint32_t free_count;
+    uint32_t *queue;           // Buffer indices in submission order
+    size_t *lengths;           // Bytes used, by buffer index
+    uint32_t queue_head;
+    uint32_t queue_count;
+    bool closing;
+    bool failed;
+    Writer_Stats stats;
+};
+
+// Writes every byte of iov, resuming after short writes
+static bool write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+static void *writer_thread(void *arg) {
+    Writer *writer = arg;
+    struct iovec iov[WRITER_GATHER];
+    uint32_t taken[WRITER_GATHER];
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queue_count == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->queued, &writer->lock);
+        }
+        if (writer->queue_count == 0) {
+            break;
+        }
+
+        int count = 0;
+        size_t bytes = 0;
+        while (writer->queue_count > 0 && count < WRITER_GATHER) {
+            uint32_t index = writer->queue[writer->queue_head];
+            writer->queue_head = (writer->queue_head + 1) % writer->buffers;
+            writer->queue_count--;
+            taken[count] = index;
+            iov[count].iov_base = writer->pool + index * writer->buffer_size;
+            iov[count].iov_len = writer->lengths[index];
+            bytes += writer->lengths[index];
+            count++;
+        }
+        bool failed = writer->failed;
+        pthread_mutex_unlock(&writer->lock);
+
+        // After a failure buffers are only recycled, so the producer
+        // never stalls on a dead file
+        bool ok = failed || write_all(writer->fd, iov, count);
+
+        pthread_mutex_lock(&writer->lock);
+        if (!ok) {
+            writer->failed = true;
+        } else if (!failed) {
+            writer->stats.written += count;
+            writer->stats.bytes += bytes;
+            writer->stats.writes++;
+        }
+        for (int i = 0; i < count; i++) {
+            writer->free_list[writer->free_count++] = taken[i];
+        }
+        pthread_cond_signal(&writer->freed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+static void writer_free(Writer *writer) {
+    free(writer->pool);
+    free(writer->free_list);
+    free(writer->queue);
+    free(writer->lengths);
+    free(writer);
+}
+
+// Creates filename, writes header to it and starts the writer thread
+// with buffers buffers of buffer_size bytes
+Writer *writer_open(const char *filename, const void *header, size_t header_length,
+                    size_t buffer_size, uint32_t buffers, Writer_Policy policy) {
+    Writer *writer = calloc(1, sizeof(Writer));
+    if (!writer) {
+        return NULL;
+    }
+
+    writer->policy = policy;
+    writer->buffer_size = buffer_size;
+    writer->buffers = buffers;
+    writer->pool = malloc(buffer_size * buffers);
+    writer->free_list = malloc(buffers * sizeof(uint32_t));
+    writer->queue = malloc(buffers * sizeof(uint32_t));
+    writer->lengths = malloc(buffers * sizeof(size_t));
+    if (!writer->pool || !writer->free_list || !writer->queue || !writer->lengths) {
+        writer_free(writer);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < buffers; i++) {
+        writer->free_list[i] = buffers - 1 - i;
+    }
+    writer->free_count = buffers;
+
+    writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+        printf("Failed to create output file: %s\n", filename);
+        writer_free(writer);
+        return NULL;
+    }
+
+    struct iovec iov = { (void *)header, header_length };
+    if (!write_all(writer->fd, &iov, header_length ? 1 : 0)) {
+        printf("Failed to write output file: %s\n", filename);
+        close(writer->fd);
+        writer_free(writer);
+        return NULL;
+    }
+    writer->stats.bytes = header_length;
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->freed, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->queued);
+        pthread_cond_destroy(&writer->freed);
+        close(writer->fd);
+        writer_free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Takes a free buffer of writer_buffer_size() bytes. Returns NULL, and
+// counts a drop, if there is none under WRITER_DROP.
+uint8_t *writer_acquire(Writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->free_count == 0 && writer->policy == WRITER_BLOCK) {
+        writer->stats.waits++;
+        pthread_cond_wait(&writer->freed, &writer->lock);
+    }
+
+    uint8_t *buffer = NULL;
+    if (writer->free_count > 0) {
+        uint32_t index = writer->free_list[--writer->free_count];
+        buffer = writer->pool + index * writer->buffer_size;
+    } else {
+        writer->stats.dropped++;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return buffer;
+}
+
+// Queues the first length bytes of a buffer from writer_acquire()
+void writer_submit(Writer *writer, uint8_t *buffer, size_t length) {
+    uint32_t index = (buffer - writer->pool) / writer->buffer_size;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->lengths[index] = length;
+    writer->queue[(writer->queue_head + writer->queue_count) % writer->buffers] = index;
+    writer->queue_count++;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+size_t writer_buffer_size(const Writer *writer) {
+    return writer->buffer_size;
+}
+
+// Writes out everything queued, stops the thread and closes the file.
+// Returns false if any write failed. stats may be NULL.
+bool writer_close(Writer *writer, Writer_Stats *stats) {
+    return writer_finish(writer, NULL, 0, stats);
+}
+
+// Like writer_close(), but once the data is out writes header over the
+// start of the file, for formats whose header gives the length of what
+// follows. header_length should match the header writer_open() wrote.
+bool writer_finish(Writer *writer, const void *header, size_t header_length, Writer_Stats *stats) {
+    if (!writer) {
+        return true;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = true;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    if (!writer->failed && header_length > 0 &&
+        pwrite(writer->fd, header, header_length, 0) != (ssize_t)header_length) {
+        writer->failed = true;
+    }
+    bool ok = !writer->failed && close(writer->fd) == 0;
+    if (writer->failed) {
+        close(writer->fd);
+    }
+    if (stats) {
+        *stats = writer->stats;
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->queued);
+    pthread_cond_destroy(&writer->freed);
+    writer_free(writer);
+    return ok;
+}
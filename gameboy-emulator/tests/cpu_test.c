@@ -0,0 +1,329 @@
+// cpu_test.c - Single-step CPU tests against stored vectors
+#include <string.h>
+#include "gameboy.h"
+
+// Each vector file is a JSON array of tests, one instruction each:
+//   {"name": "...", "initial": state, "final": state, "cycles": n}
+// where a state holds the registers by name, "ime", "ei" (EI pending),
+// "halt" and "ram", a list of [address, value] pairs. The CPU runs
+// against a flat 64 KB of RAM rather than the memory map, so a test sees
+// only the bytes its initial state lists and every other byte is zero.
+// tests/gen_cpu_vectors.py writes the vectors in tests/cpu.
+#define TEST_RAM_MAX      32
+#define TEST_NAME_MAX     64
+#define TEST_REPORT_MAX   4       // Failures shown per file
+
+enum {
+    FIELD_PC, FIELD_SP, FIELD_A, FIELD_B, FIELD_C, FIELD_D, FIELD_E, FIELD_F,
+    FIELD_H, FIELD_L, FIELD_IME, FIELD_EI, FIELD_HALT, FIELD_COUNT
+};
+
+static const char *const field_names[FIELD_COUNT] = {
+    "pc", "sp", "a", "b", "c", "d", "e", "f", "h", "l", "ime", "ei", "halt"
+};
+
+typedef struct {
+    uint32_t fields[FIELD_COUNT];
+    uint32_t ram_count;
+    uint16_t ram_address[TEST_RAM_MAX];
+    uint8_t ram_value[TEST_RAM_MAX];
+} Test_State;
+
+typedef struct {
+    char name[TEST_NAME_MAX];
+    Test_State initial;
+    Test_State final;
+    uint32_t cycles;
+} Test_Case;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    bool error;
+} Json;
+
+static uint8_t ram[0x10000];
+
+uint8_t memory_read(uint16_t address) {
+    return ram[address];
+}
+
+void memory_write(uint16_t address, uint8_t value) {
+    ram[address] = value;
+}
+
+static void json_space(Json *json) {
+    while (json->p < json->end && strchr(" \t\r\n", *json->p)) {
+        json->p++;
+    }
+}
+
+// Consumes c if it comes next
+static bool json_accept(Json *json, char c) {
+    json_space(json);
+    if (json->p < json->end && *json->p == c) {
+        json->p++;
+        return true;
+    }
+    return false;
+}
+
+static void json_expect(Json *json, char c) {
+    if (!json_accept(json, c)) {
+        json->error = true;
+    }
+}
+
+static uint32_t json_number(Json *json) {
+    json_space(json);
+    uint32_t value = 0;
+    const char *start = json->p;
+    while (json->p < json->end && *json->p >= '0' && *json->p <= '9') {
+        value = value * 10 + (*json->p++ - '0');
+    }
+    if (json->p == start) {
+        json->error = true;
+    }
+    return value;
+}
+
+// Reads a string without escapes, which the vectors never need
+static void json_string(Json *json, char *out, size_t size) {
+    json_expect(json, '"');
+    size_t length = 0;
+    while (!json->error && json->p < json->end && *json->p != '"') {
+        if (length + 1 < size) {
+            out[length++] = *json->p;
+        }
+        json->p++;
+    }
+    out[length] = '\0';
+    json_expect(json, '"');
+}
+
+static void parse_state(Json *json, Test_State *state) {
+    memset(state, 0, sizeof(*state));
+    json_expect(json, '{');
+    do {
+        char key[16];
+        json_string(json, key, sizeof(key));
+        json_expect(json, ':');
+
+        if (strcmp(key, "ram") == 0) {
+            json_expect(json, '[');
+            while (!json->error && !json_accept(json, ']')) {
+                if (state->ram_count == TEST_RAM_MAX) {
+                    json->error = true;
+                    break;
+                }
+                json_expect(json, '[');
+                state->ram_address[state->ram_count] = json_number(json);
+                json_expect(json, ',');
+                state->ram_value[state->ram_count] = json_number(json);
+                json_expect(json, ']');
+                state->ram_count++;
+                json_accept(json, ',');
+            }
+            continue;
+        }
+
+        int field = 0;
+        while (field < FIELD_COUNT && strcmp(key, field_names[field]) != 0) {
+            field++;
+        }
+        if (field == FIELD_COUNT) {
+            json->error = true;
+            return;
+        }
+        state->fields[field] = json_number(json);
+    } while (!json->error && json_accept(json, ','));
+    json_expect(json, '}');
+}
+
+static void parse_test(Json *json, Test_Case *test) {
+    memset(test, 0, sizeof(*test));
+    json_expect(json, '{');
+    do {
+        char key[16];
+        json_string(json, key, sizeof(key));
+        json_expect(json, ':');
+
+        if (strcmp(key, "name") == 0) {
+            json_string(json, test->name, sizeof(test->name));
+        } else if (strcmp(key, "initial") == 0) {
+            parse_state(json, &test->initial);
+        } else if (strcmp(key, "final") == 0) {
+            parse_state(json, &test->final);
+        } else if (strcmp(key, "cycles") == 0) {
+            test->cycles = json_number(json);
+        } else {
+            json->error = true;
+        }
+    } while (!json->error && json_accept(json, ','));
+    json_expect(json, '}');
+}
+
+static void cpu_load(const uint32_t *fields) {
+    cpu.pc = fields[FIELD_PC];
+    cpu.sp = fields[FIELD_SP];
+    cpu.a = fields[FIELD_A];
+    cpu.b = fields[FIELD_B];
+    cpu.c = fields[FIELD_C];
+    cpu.d = fields[FIELD_D];
+    cpu.e = fields[FIELD_E];
+    cpu.f = fields[FIELD_F];
+    cpu.h = fields[FIELD_H];
+    cpu.l = fields[FIELD_L];
+    cpu.interrupts_enabled = fields[FIELD_IME];
+    cpu.ei_pending = fields[FIELD_EI];
+    cpu.halted = fields[FIELD_HALT];
+    cpu.locked = false;
+}
+
+static void cpu_store(uint32_t *fields) {
+    fields[FIELD_PC] = cpu.pc;
+    fields[FIELD_SP] = cpu.sp;
+    fields[FIELD_A] = cpu.a;
+    fields[FIELD_B] = cpu.b;
+    fields[FIELD_C] = cpu.c;
+    fields[FIELD_D] = cpu.d;
+    fields[FIELD_E] = cpu.e;
+    fields[FIELD_F] = cpu.f;
+    fields[FIELD_H] = cpu.h;
+    fields[FIELD_L] = cpu.l;
+    fields[FIELD_IME] = cpu.interrupts_enabled;
+    fields[FIELD_EI] = cpu.ei_pending;
+    fields[FIELD_HALT] = cpu.halted;
+}
+
+// Runs one test. Returns true if it passed; otherwise the differences
+// are printed when report is set.
+static bool run_test(const Test_Case *test, bool report) {
+    memset(ram, 0, sizeof(ram));
+    for (uint32_t i = 0; i < test->initial.ram_count; i++) {
+        ram[test->initial.ram_address[i]] = test->initial.ram_value[i];
+    }
+    cpu_load(test->initial.fields);
+
+    uint32_t cycles = cpu_execute_instruction();
+
+    bool passed = true;
+    uint32_t fields[FIELD_COUNT];
+    cpu_store(fields);
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        if (fields[i] != test->final.fields[i]) {
+            if (report) {
+                printf("  %s: %s is %u, expected %u\n", test->name, field_names[i],
+                       fields[i], test->final.fields[i]);
+            }
+            passed = false;
+        }
+    }
+    if (cycles != test->cycles) {
+        if (report) {
+            printf("  %s: took %u cycles, expected %u\n", test->name, cycles, test->cycles);
+        }
+        passed = false;
+    }
+
+    // Clearing each expected byte leaves anything written elsewhere
+    for (uint32_t i = 0; i < test->final.ram_count; i++) {
+        uint16_t address = test->final.ram_address[i];
+        if (ram[address] != test->final.ram_value[i]) {
+            if (report) {
+                printf("  %s: [0x%04X] is 0x%02X, expected 0x%02X\n", test->name, address,
+                       ram[address], test->final.ram_value[i]);
+            }
+            passed = false;
+        }
+        ram[address] = 0;
+    }
+    for (uint32_t address = 0; address < sizeof(ram); address++) {
+        if (ram[address]) {
+            if (report) {
+                printf("  %s: stray write of 0x%02X to 0x%04X\n", test->name, ram[address],
+                       address);
+            }
+            passed = false;
+            break;
+        }
+    }
+    return passed;
+}
+
+static char *read_file(const char *filename, size_t *size) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = length > 0 ? malloc(length) : NULL;
+    if (data && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+// Runs every test in a vector file, adding to the totals. Returns false
+// if the file could not be read.
+static bool run_file(const char *filename, uint32_t *run, uint32_t *failed) {
+    size_t size;
+    char *data = read_file(filename, &size);
+    if (!data) {
+        printf("Failed to read vector file: %s\n", filename);
+        return false;
+    }
+
+    Json json = { data, data + size, false };
+    uint32_t file_failed = 0;
+    json_expect(&json, '[');
+    while (!json.error && !json_accept(&json, ']')) {
+        Test_Case test;
+        parse_test(&json, &test);
+        if (json.error) {
+            break;
+        }
+        if (!run_test(&test, false)) {
+            if (file_failed++ == 0) {
+                printf("%s:\n", filename);
+            }
+            if (file_failed <= TEST_REPORT_MAX) {
+                run_test(&test, true);
+            }
+        }
+        (*run)++;
+        json_accept(&json, ',');
+    }
+    free(data);
+
+    if (json.error) {
+        printf("Malformed vector file: %s\n", filename);
+        return false;
+    }
+    if (file_failed > 0) {
+        printf("  %u failed\n", file_failed);
+    }
+    *failed += file_failed;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <vector_file>...\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t run = 0, failed = 0;
+    bool ok = true;
+    for (int i = 1; i < argc; i++) {
+        ok = run_file(argv[i], &run, &failed) && ok;
+    }
+
+    printf("%u of %u CPU tests passed in %d files\n", run - failed, run, argc - 1);
+    return ok && failed == 0 ? 0 : 1;
+}
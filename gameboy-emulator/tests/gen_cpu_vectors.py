@@ -0,0 +1,428 @@
+#!/usr/bin/env python3
+"""Generates the single-step CPU vectors in tests/cpu.
+
+Each vector is one instruction run from a random state against a flat
+64 KB memory: the registers, IME, a pending EI and every byte the
+instruction reads before, and the registers and every byte it touched
+after, plus the clock cycles it took. The expected results come from the
+reference model below, written from the documented behaviour of each
+instruction rather than from src/cpu.c, so the two check each other.
+
+Conventions the model shares with the emulator: STOP is two bytes and
+halts, HALT has no halt bug, EI takes effect after the next instruction
+and no interrupt is pending while the instruction runs. The 11 illegal
+opcodes have no vectors.
+
+    python3 tests/gen_cpu_vectors.py [output_dir]
+"""
+import json
+import os
+import random
+import sys
+
+FLAG_Z, FLAG_N, FLAG_H, FLAG_C = 0x80, 0x40, 0x20, 0x10
+ILLEGAL = {0xD3, 0xDB, 0xDD, 0xE3, 0xE4, 0xEB, 0xEC, 0xED, 0xF4, 0xFC, 0xFD}
+EDGES = [0x00, 0x01, 0x0F, 0x10, 0x7F, 0x80, 0xF0, 0xFF]
+TESTS = 16
+TESTS_DAA = 256
+IF_REG, IE_REG = 0xFF0F, 0xFFFF
+
+
+class Machine:
+    def __init__(self, rng, regs):
+        self.rng = rng
+        self.r = dict(regs)
+        self.initial = {}
+        self.ram = {}
+        self.m_cycles = 0
+
+    # Memory comes into being on first read, so the vector records
+    # exactly what the instruction saw
+    def read(self, addr):
+        addr &= 0xFFFF
+        if addr not in self.ram:
+            value = self.rng.choice(EDGES) if self.rng.random() < 0.25 else self.rng.randrange(256)
+            self.initial[addr] = value
+            self.ram[addr] = value
+        return self.ram[addr]
+
+    def write(self, addr, value):
+        self.ram[addr & 0xFFFF] = value & 0xFF
+
+    def fetch(self):
+        value = self.read(self.r["pc"])
+        self.r["pc"] = (self.r["pc"] + 1) & 0xFFFF
+        return value
+
+    def fetch16(self):
+        low = self.fetch()
+        return low | self.fetch() << 8
+
+    def flag(self, mask):
+        return bool(self.r["f"] & mask)
+
+    def set_flags(self, z, n, h, c):
+        self.r["f"] = (FLAG_Z if z else 0) | (FLAG_N if n else 0) | \
+                      (FLAG_H if h else 0) | (FLAG_C if c else 0)
+
+    def pair(self, hi, lo):
+        return self.r[hi] << 8 | self.r[lo]
+
+    def set_pair(self, hi, lo, value):
+        self.r[hi] = value >> 8 & 0xFF
+        self.r[lo] = value & 0xFF
+
+    def push(self, value):
+        self.r["sp"] = (self.r["sp"] - 1) & 0xFFFF
+        self.write(self.r["sp"], value >> 8)
+        self.r["sp"] = (self.r["sp"] - 1) & 0xFFFF
+        self.write(self.r["sp"], value)
+
+    def pop(self):
+        low = self.read(self.r["sp"])
+        self.r["sp"] = (self.r["sp"] + 1) & 0xFFFF
+        high = self.read(self.r["sp"])
+        self.r["sp"] = (self.r["sp"] + 1) & 0xFFFF
+        return high << 8 | low
+
+
+R8 = ["b", "c", "d", "e", "h", "l", None, "a"]
+R16 = [("b", "c"), ("d", "e"), ("h", "l"), None]
+R16_STACK = [("b", "c"), ("d", "e"), ("h", "l"), ("a", "f")]
+
+
+def get_r8(m, index):
+    if R8[index] is None:
+        m.m_cycles += 1
+        return m.read(m.pair("h", "l"))
+    return m.r[R8[index]]
+
+
+def set_r8(m, index, value):
+    if R8[index] is None:
+        m.m_cycles += 1
+        m.write(m.pair("h", "l"), value)
+    else:
+        m.r[R8[index]] = value & 0xFF
+
+
+def get_r16(m, index):
+    return m.r["sp"] if R16[index] is None else m.pair(*R16[index])
+
+
+def set_r16(m, index, value):
+    value &= 0xFFFF
+    if R16[index] is None:
+        m.r["sp"] = value
+    else:
+        m.set_pair(*R16[index], value)
+
+
+def condition(m, index):
+    return [not m.flag(FLAG_Z), m.flag(FLAG_Z), not m.flag(FLAG_C), m.flag(FLAG_C)][index]
+
+
+def alu(m, op, value):
+    a = m.r["a"]
+    carry = 1 if op in (1, 3) and m.flag(FLAG_C) else 0
+    if op in (0, 1):
+        total = a + value + carry
+        m.set_flags(total & 0xFF == 0, False, (a & 0xF) + (value & 0xF) + carry > 0xF, total > 0xFF)
+        m.r["a"] = total & 0xFF
+    elif op in (2, 3, 7):
+        total = a - value - carry
+        m.set_flags(total & 0xFF == 0, True, (a & 0xF) - (value & 0xF) - carry < 0, total < 0)
+        if op != 7:
+            m.r["a"] = total & 0xFF
+    else:
+        result = {4: a & value, 5: a ^ value, 6: a | value}[op]
+        m.set_flags(result == 0, False, op == 4, False)
+        m.r["a"] = result
+
+
+def rotate(m, op, value):
+    carry_in = 1 if m.flag(FLAG_C) else 0
+    if op == 0:     # RLC
+        carry, value = value >> 7, value << 1 | value >> 7
+    elif op == 1:   # RRC
+        carry, value = value & 1, value >> 1 | (value & 1) << 7
+    elif op == 2:   # RL
+        carry, value = value >> 7, value << 1 | carry_in
+    elif op == 3:   # RR
+        carry, value = value & 1, value >> 1 | carry_in << 7
+    elif op == 4:   # SLA
+        carry, value = value >> 7, value << 1
+    elif op == 5:   # SRA
+        carry, value = value & 1, value >> 1 | value & 0x80
+    elif op == 6:   # SWAP
+        carry, value = 0, (value & 0xF) << 4 | value >> 4
+    else:           # SRL
+        carry, value = value & 1, value >> 1
+    value &= 0xFF
+    m.set_flags(value == 0, False, False, carry)
+    return value
+
+
+def sp_plus_offset(m):
+    offset = m.fetch()
+    sp = m.r["sp"]
+    m.set_flags(False, False, (sp & 0xF) + (offset & 0xF) > 0xF, (sp & 0xFF) + offset > 0xFF)
+    return (sp + (offset - 256 if offset & 0x80 else offset)) & 0xFFFF
+
+
+def execute_cb(m):
+    op = m.fetch()
+    m.m_cycles += 1
+    group, bit, reg = op >> 6, op >> 3 & 7, op & 7
+    value = get_r8(m, reg)
+    if group == 0:
+        set_r8(m, reg, rotate(m, bit, value))
+    elif group == 1:
+        m.r["f"] = (m.r["f"] & FLAG_C) | FLAG_H | (0 if value >> bit & 1 else FLAG_Z)
+    elif group == 2:
+        set_r8(m, reg, value & ~(1 << bit))
+    else:
+        set_r8(m, reg, value | 1 << bit)
+
+
+def execute(m):
+    enable = m.r["ei"]
+    m.r["ei"] = 0
+    op = m.fetch()
+    m.m_cycles = 1
+    x, y, z = op >> 6, op >> 3 & 7, op & 7
+
+    if x == 1 and op != 0x76:
+        set_r8(m, y, get_r8(m, z))
+    elif x == 2:
+        alu(m, y, get_r8(m, z))
+    elif op == 0x00:
+        pass
+    elif x == 0 and z == 1 and not y & 1:           # LD rr, d16
+        set_r16(m, y >> 1, m.fetch16())
+        m.m_cycles += 2
+    elif x == 0 and z == 1:                         # ADD HL, rr
+        hl, value = m.pair("h", "l"), get_r16(m, y >> 1)
+        m.r["f"] = (m.r["f"] & FLAG_Z) | (FLAG_H if (hl & 0xFFF) + (value & 0xFFF) > 0xFFF else 0) | \
+                   (FLAG_C if hl + value > 0xFFFF else 0)
+        m.set_pair("h", "l", (hl + value) & 0xFFFF)
+        m.m_cycles += 1
+    elif x == 0 and z == 2:                         # Loads through BC, DE, HL+ and HL-
+        addr = [m.pair("b", "c"), m.pair("d", "e"), m.pair("h", "l"), m.pair("h", "l")][y >> 1]
+        if y & 1:
+            m.r["a"] = m.read(addr)
+        else:
+            m.write(addr, m.r["a"])
+        if y >> 1 == 2:
+            m.set_pair("h", "l", (addr + 1) & 0xFFFF)
+        elif y >> 1 == 3:
+            m.set_pair("h", "l", (addr - 1) & 0xFFFF)
+        m.m_cycles += 1
+    elif x == 0 and z == 3:                         # INC rr, DEC rr
+        set_r16(m, y >> 1, get_r16(m, y >> 1) + (-1 if y & 1 else 1))
+        m.m_cycles += 1
+    elif x == 0 and z == 4:                         # INC r
+        value = (get_r8(m, y) + 1) & 0xFF
+        m.r["f"] = (m.r["f"] & FLAG_C) | (FLAG_Z if value == 0 else 0) | (FLAG_H if value & 0xF == 0 else 0)
+        set_r8(m, y, value)
+    elif x == 0 and z == 5:                         # DEC r
+        value = (get_r8(m, y) - 1) & 0xFF
+        m.r["f"] = (m.r["f"] & FLAG_C) | FLAG_N | (FLAG_Z if value == 0 else 0) | \
+                   (FLAG_H if value & 0xF == 0xF else 0)
+        set_r8(m, y, value)
+    elif x == 0 and z == 6:                         # LD r, d8
+        value = m.fetch()
+        m.m_cycles += 1
+        set_r8(m, y, value)
+    elif x == 0 and z == 7 and y < 4:               # RLCA, RRCA, RLA, RRA
+        m.r["a"] = rotate(m, y, m.r["a"])
+        m.r["f"] &= ~FLAG_Z
+    elif op == 0x27:                                # DAA
+        a, carry = m.r["a"], m.flag(FLAG_C)
+        if not m.flag(FLAG_N):
+            if carry or a > 0x99:
+                a += 0x60
+                carry = True
+            if m.flag(FLAG_H) or a & 0xF > 0x9:
+                a += 0x06
+        else:
+            if carry:
+                a -= 0x60
+            if m.flag(FLAG_H):
+                a -= 0x06
+        a &= 0xFF
+        m.set_flags(a == 0, m.flag(FLAG_N), False, carry)
+        m.r["a"] = a
+    elif op == 0x2F:                                # CPL
+        m.r["a"] ^= 0xFF
+        m.r["f"] |= FLAG_N | FLAG_H
+    elif op == 0x37:                                # SCF
+        m.set_flags(m.flag(FLAG_Z), False, False, True)
+    elif op == 0x3F:                                # CCF
+        m.set_flags(m.flag(FLAG_Z), False, False, not m.flag(FLAG_C))
+    elif op == 0x08:                                # LD (a16), SP
+        addr = m.fetch16()
+        m.write(addr, m.r["sp"])
+        m.write(addr + 1, m.r["sp"] >> 8)
+        m.m_cycles += 4
+    elif op == 0x10:                                # STOP
+        m.fetch()
+        m.r["halt"] = 1
+    elif op == 0x76:                                # HALT
+        m.r["halt"] = 1
+    elif op == 0x18 or (x == 0 and z == 0 and y >= 4):  # JR, JR cc
+        offset = m.fetch()
+        m.m_cycles += 1
+        if op == 0x18 or condition(m, y - 4):
+            m.r["pc"] = (m.r["pc"] + (offset - 256 if offset & 0x80 else offset)) & 0xFFFF
+            m.m_cycles += 1
+    elif x == 3 and z == 0 and y < 4:               # RET cc
+        m.m_cycles += 1
+        if condition(m, y):
+            m.r["pc"] = m.pop()
+            m.m_cycles += 3
+    elif x == 3 and z == 1 and not y & 1:           # POP rr
+        value = m.pop()
+        hi, lo = R16_STACK[y >> 1]
+        m.set_pair(hi, lo, value & 0xFFF0 if lo == "f" else value)
+        m.m_cycles += 2
+    elif op in (0xC9, 0xD9):                        # RET, RETI
+        m.r["pc"] = m.pop()
+        if op == 0xD9:
+            m.r["ime"] = 1
+        m.m_cycles += 3
+    elif op == 0xE9:                                # JP (HL)
+        m.r["pc"] = m.pair("h", "l")
+    elif op == 0xF9:                                # LD SP, HL
+        m.r["sp"] = m.pair("h", "l")
+        m.m_cycles += 1
+    elif x == 3 and z == 2 and y < 4:               # JP cc, a16
+        addr = m.fetch16()
+        m.m_cycles += 2
+        if condition(m, y):
+            m.r["pc"] = addr
+            m.m_cycles += 1
+    elif op == 0xC3:                                # JP a16
+        m.r["pc"] = m.fetch16()
+        m.m_cycles += 3
+    elif x == 3 and z == 4 and y < 4:               # CALL cc, a16
+        addr = m.fetch16()
+        m.m_cycles += 2
+        if condition(m, y):
+            m.push(m.r["pc"])
+            m.r["pc"] = addr
+            m.m_cycles += 3
+    elif op == 0xCD:                                # CALL a16
+        addr = m.fetch16()
+        m.push(m.r["pc"])
+        m.r["pc"] = addr
+        m.m_cycles += 5
+    elif x == 3 and z == 5:                         # PUSH rr
+        m.push(m.pair(*R16_STACK[y >> 1]))
+        m.m_cycles += 3
+    elif x == 3 and z == 6:                         # ALU A, d8
+        alu(m, y, m.fetch())
+        m.m_cycles += 1
+    elif x == 3 and z == 7:                         # RST n
+        m.push(m.r["pc"])
+        m.r["pc"] = y * 8
+        m.m_cycles += 3
+    elif op == 0xCB:
+        execute_cb(m)
+    elif op in (0xE0, 0xF0):                        # LDH (a8), A and LDH A, (a8)
+        addr = 0xFF00 | m.fetch()
+        if op == 0xE0:
+            m.write(addr, m.r["a"])
+        else:
+            m.r["a"] = m.read(addr)
+        m.m_cycles += 2
+    elif op in (0xE2, 0xF2):                        # LD (C), A and LD A, (C)
+        addr = 0xFF00 | m.r["c"]
+        if op == 0xE2:
+            m.write(addr, m.r["a"])
+        else:
+            m.r["a"] = m.read(addr)
+        m.m_cycles += 1
+    elif op in (0xEA, 0xFA):                        # LD (a16), A and LD A, (a16)
+        addr = m.fetch16()
+        if op == 0xEA:
+            m.write(addr, m.r["a"])
+        else:
+            m.r["a"] = m.read(addr)
+        m.m_cycles += 3
+    elif op == 0xE8:                                # ADD SP, r8
+        m.r["sp"] = sp_plus_offset(m)
+        m.m_cycles += 3
+    elif op == 0xF8:                                # LD HL, SP+r8
+        m.set_pair("h", "l", sp_plus_offset(m))
+        m.m_cycles += 2
+    elif op == 0xF3:                                # DI
+        m.r["ime"] = 0
+        enable = 0
+    elif op == 0xFB:                                # EI
+        m.r["ei"] = 1
+    else:
+        raise ValueError("no model for opcode %02X" % op)
+
+    if enable:
+        m.r["ime"] = 1
+
+
+def random_state(rng):
+    def byte():
+        return rng.choice(EDGES) if rng.random() < 0.25 else rng.randrange(256)
+    regs = {name: byte() for name in "abcdehl"}
+    regs["f"] = rng.randrange(16) << 4
+    regs["pc"] = rng.randrange(0x10000)
+    regs["sp"] = rng.randrange(0x10000)
+    regs["ime"] = rng.randrange(2)
+    regs["ei"] = rng.randrange(2)
+    regs["halt"] = 0
+    return regs
+
+
+def make_test(rng, opcode, cb, number):
+    while True:
+        regs = random_state(rng)
+        m = Machine(rng, regs)
+        pc = regs["pc"]
+        m.initial[pc] = m.ram[pc] = opcode
+        if cb is not None:
+            m.initial[(pc + 1) & 0xFFFF] = m.ram[(pc + 1) & 0xFFFF] = cb
+        execute(m)
+
+        # An interrupt pending at the start would be taken instead
+        if m.initial.get(IF_REG, 0) & m.initial.get(IE_REG, 0) & 0x1F:
+            continue
+
+        name = "%02x %04d" % (opcode, number) if cb is None else "cb %02x %04d" % (cb, number)
+        initial = dict(regs, ram=sorted([a, v] for a, v in m.initial.items()))
+        final = dict(m.r, ram=sorted([a, m.ram[a]] for a in m.ram))
+        return {"name": name, "initial": initial, "final": final, "cycles": m.m_cycles * 4}
+
+
+def write_file(path, tests):
+    with open(path, "w") as out:
+        out.write("[\n")
+        out.write(",\n".join(json.dumps(t, separators=(",", ":")) for t in tests))
+        out.write("\n]\n")
+
+
+def main():
+    out_dir = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "cpu")
+    os.makedirs(out_dir, exist_ok=True)
+    for opcode in range(256):
+        if opcode in ILLEGAL or opcode == 0xCB:
+            continue
+        rng = random.Random(opcode)
+        count = TESTS_DAA if opcode == 0x27 else TESTS
+        write_file(os.path.join(out_dir, "%02x.json" % opcode),
+                   [make_test(rng, opcode, None, i) for i in range(count)])
+    for cb in range(256):
+        rng = random.Random(0x100 + cb)
+        write_file(os.path.join(out_dir, "cb%02x.json" % cb),
+                   [make_test(rng, 0xCB, cb, i) for i in range(TESTS)])
+
+
+if __name__ == "__main__":
+    main()